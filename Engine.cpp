@@ -1,10 +1,20 @@
 
 #include "Engine.h"
 
-#include <stdio.h>  // vsnprintf
-#include <string.h> // strcmp, strcasecmp
+#include <stdio.h>  // vsnprintf, fopen
+#include <string.h> // strcmp, strcasecmp, memcmp
 #include <stdlib.h>	// strtod, strtol
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h> // mmap, madvise
+#include <sys/stat.h> // fstat
+#include <fcntl.h>    // open
+#include <unistd.h>   // close, sysconf
+#endif
+#if _MSC_VER
+#include <malloc.h> // _aligned_malloc
+#endif
+
 
 namespace M4 {
 
@@ -71,76 +81,197 @@ int String_ToIntegerHex(const char * str, char ** endptr) {
 	return strtol(str, endptr, 16);
 }
 
+unsigned int String_Hash(const char * str, size_t length) {
+    // FNV-1a
+    unsigned int hash = String_HashSeed;
+    for (size_t i = 0; i < length; i++) {
+        hash = String_HashAdd(hash, str[i]);
+    }
+    return hash;
+}
+
+unsigned long long String_Hash64(const char * str, size_t length, unsigned long long hash) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
 // Engine/StringPool.cpp
 
-StringPool::StringPool(Allocator * allocator) : stringArray(allocator) {
+StringPool::StringPool(Allocator * allocator, SharedStringPool * shared) : allocator(allocator), shared(shared), strings(allocator), slots(NULL), capacity(0), count(0), firstPage(NULL), currentPage(NULL), largePages(NULL), pageCursor(NULL), pageEnd(NULL) {
 }
 StringPool::~StringPool() {
-    for (int i = 0; i < stringArray.GetSize(); i++) {
-        free((void *)stringArray[i]);
-        stringArray[i] = NULL;
+    Page * pages[2] = { firstPage, largePages };
+    for (int i = 0; i < 2; i++) {
+        Page * page = pages[i];
+        while (page != NULL) {
+            Page * next = page->next;
+            allocator->Delete(allocator->m_userData, page);
+            page = next;
+        }
     }
-}
-
-const char * StringPool::AddString(const char * string) {
-    for (int i = 0; i < stringArray.GetSize(); i++) {
-        if (String_Equal(stringArray[i], string)) return stringArray[i];
+    if (slots != NULL) {
+        allocator->Delete(allocator->m_userData, slots);
     }
-#if _MSC_VER
-    const char * dup = _strdup(string);
-#else
-    const char * dup = strdup(string);
-#endif
-    stringArray.PushBack(dup);
-    return dup;
 }
 
-// @@ From mprintf.cpp
-static char *mprintf_valist(int size, const char *fmt, va_list args) {
-    ASSERT(size > 0);
-    char *res = NULL;
-    va_list tmp;
-
-    while (1) {
-        res = new char[size];
-        if (!res) return NULL;
+void StringPool::Reset() {
+    if (slots != NULL) {
+        memset(slots, 0, sizeof(Slot) * capacity);
+    }
+    count = 0;
+    strings.Clear();
+
+    Page * page = largePages;
+    while (page != NULL) {
+        Page * next = page->next;
+        allocator->Delete(allocator->m_userData, page);
+        page = next;
+    }
+    largePages = NULL;
 
-        va_copy(tmp, args);
-        int len = vsnprintf(res, size, fmt, tmp);
-        va_end(tmp);
+    currentPage = NULL;
+    pageCursor = NULL;
+    pageEnd = NULL;
+}
 
-        if ((len >= 0) && (size >= len + 1)) {
+int StringPool::FindSlot(const char * string, size_t length, unsigned int hash) const {
+    ASSERT(capacity > 0);
+    int mask = capacity - 1;
+    int i = hash & mask;
+    while (slots[i].string != NULL) {
+        if (slots[i].hash == hash && slots[i].length == length && memcmp(slots[i].string, string, length) == 0) {
             break;
         }
+        // Linear probing.
+        i = (i + 1) & mask;
+    }
+    return i;
+}
 
-        delete [] res;
+void StringPool::SetCapacity(int new_capacity) {
+    Slot * old_slots = slots;
+    int old_capacity = capacity;
+
+    slots = (Slot *)allocator->NewArray(allocator->m_userData, sizeof(Slot), new_capacity);
+    memset(slots, 0, sizeof(Slot) * new_capacity);
+    capacity = new_capacity;
+
+    // Rehash, strings never move so only the slots are copied.
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_slots[i].string != NULL) {
+            int mask = capacity - 1;
+            int j = old_slots[i].hash & mask;
+            while (slots[j].string != NULL) j = (j + 1) & mask;
+            slots[j] = old_slots[i];
+        }
+    }
 
-        if (len > -1 ) {
-            size = len + 1;
+    if (old_slots != NULL) {
+        allocator->Delete(allocator->m_userData, old_slots);
+    }
+}
+
+char * StringPool::AllocateChars(size_t size) {
+    if ((size_t)(pageEnd - pageCursor) < size) {
+        // Long strings get a page of their own, so that we don't waste the tail of the current page.
+        if (size > s_pageSize / 4) {
+            Page * page = (Page *)allocator->New(allocator->m_userData, sizeof(Page) + size);
+            page->next = largePages;
+            largePages = page;
+            return (char *)(page + 1);
         }
-        else {
-            size *= 2;
+
+        // Reuse the pages left over by a reset before allocating new ones.
+        Page * page = (currentPage != NULL) ? currentPage->next : firstPage;
+        if (page == NULL) {
+            page = (Page *)allocator->New(allocator->m_userData, sizeof(Page) + s_pageSize);
+            page->next = NULL;
+            if (currentPage != NULL) currentPage->next = page;
+            else firstPage = page;
         }
+
+        currentPage = page;
+        pageCursor = (char *)(page + 1);
+        pageEnd = pageCursor + s_pageSize;
+    }
+    char * chars = pageCursor;
+    pageCursor += size;
+    return chars;
+}
+
+const char * StringPool::AddString(const char * string, size_t length) {
+    return AddString(string, length, String_Hash(string, length));
+}
+
+const char * StringPool::AddString(const char * string, size_t length, unsigned int hash) {
+    AllocationSiteScope scope(AllocationSite_StringPool);
+
+    if (shared != NULL) {
+        return shared->AddString(string, length, hash);
     }
 
-    return res;
+    // Keep the load factor below 1/2.
+    if ((count + 1) * 2 > capacity) {
+        SetCapacity(capacity == 0 ? 256 : capacity * 2);
+    }
+
+    int i = FindSlot(string, length, hash);
+    if (slots[i].string != NULL) {
+        return slots[i].string;
+    }
+
+    if (strings.GetSize() == 0) {
+        strings.PushBack(NULL); // InvalidStringId
+    }
+    StringId id = (StringId)strings.GetSize();
+
+    // The id is stored in front of the characters, so that it can be found from the pointer.
+    char * chars = AllocateChars(sizeof(StringId) + length + 1);
+    memcpy(chars, &id, sizeof(StringId));
+    chars += sizeof(StringId);
+    memcpy(chars, string, length);
+    chars[length] = 0;
+
+    slots[i].string = chars;
+    slots[i].hash = hash;
+    slots[i].length = (unsigned int)length;
+    count++;
+
+    strings.PushBack(chars);
+
+    return chars;
+}
+
+const char * StringPool::AddString(const char * string) {
+    return AddString(string, strlen(string));
 }
 
 const char * StringPool::AddStringFormatList(const char * format, va_list args) {
+    char buffer[256];
+
     va_list tmp;
     va_copy(tmp, args);
-    const char * string = mprintf_valist(256, format, tmp);
+    int length = vsnprintf(buffer, sizeof(buffer), format, tmp);
     va_end(tmp);
 
-    for (int i = 0; i < stringArray.GetSize(); i++) {
-        if (String_Equal(stringArray[i], string)) {
-            delete [] string;
-            return stringArray[i];
-        }
+    if (length < 0) {
+        return AddString("", 0);
+    }
+    if (length < (int)sizeof(buffer)) {
+        return AddString(buffer, length);
     }
 
-    stringArray.PushBack(string);
-    return string;
+    // Doesn't fit in the stack buffer, format into a temporary allocation.
+    char * string = (char *)allocator->New(allocator->m_userData, length + 1);
+    va_copy(tmp, args);
+    vsnprintf(string, length + 1, format, tmp);
+    va_end(tmp);
+
+    const char * result = AddString(string, length);
+    allocator->Delete(allocator->m_userData, string);
+    return result;
 }
 
 const char * StringPool::AddStringFormat(const char * format, ...) {
@@ -153,10 +284,654 @@ const char * StringPool::AddStringFormat(const char * format, ...) {
 }
 
 bool StringPool::GetContainsString(const char * string) const {
-    for (int i = 0; i < stringArray.GetSize(); i++) {
-        if (String_Equal(stringArray[i], string)) return true;
+    return FindStringId(string) != InvalidStringId;
+}
+
+StringId StringPool::FindStringId(const char * string) const {
+    if (string == NULL) return InvalidStringId;
+    if (shared != NULL) return GetStringId(shared->FindString(string, strlen(string)));
+    if (count == 0) return InvalidStringId;
+    size_t length = strlen(string);
+    int i = FindSlot(string, length, String_Hash(string, length));
+    return GetStringId(slots[i].string);
+}
+
+// Engine/SharedStringPool.cpp
+
+// Each string is preceded by its hash, its length and its id, in that order, so that
+// slots only need to hold a pointer and can be swapped atomically.
+static const size_t s_sharedHeaderSize = 3 * sizeof(unsigned int);
+
+static unsigned int GetSharedHeader(const char * chars, int field) {
+    unsigned int value;
+    memcpy(&value, chars - s_sharedHeaderSize + field * sizeof(unsigned int), sizeof(unsigned int));
+    return value;
+}
+
+static bool GetIsSharedString(const char * chars, const char * string, size_t length, unsigned int hash) {
+    return GetSharedHeader(chars, 0) == hash && GetSharedHeader(chars, 1) == length && memcmp(chars, string, length) == 0;
+}
+
+SharedStringPool::SharedStringPool(Allocator * allocator) : allocator(allocator), nextId(1), count(0) {
+    for (int i = 0; i < s_maxSegments; i++) {
+        segments[i].store(NULL, std::memory_order_relaxed);
+    }
+    firstTable = NewTable(s_firstTableCapacity);
+}
+
+SharedStringPool::~SharedStringPool() {
+    Table * table = firstTable;
+    while (table != NULL) {
+        for (int i = 0; i < table->capacity; i++) {
+            const char * chars = table->slots[i].load(std::memory_order_relaxed);
+            if (chars != NULL) DeleteString(chars);
+        }
+        Table * next = table->next.load(std::memory_order_relaxed);
+        allocator->Delete(allocator->m_userData, table);
+        table = next;
+    }
+    for (int i = 0; i < s_maxSegments; i++) {
+        std::atomic<const char *> * segment = segments[i].load(std::memory_order_relaxed);
+        if (segment != NULL) allocator->Delete(allocator->m_userData, segment);
+    }
+}
+
+SharedStringPool::Table * SharedStringPool::NewTable(int capacity) {
+    AllocationSiteScope scope(AllocationSite_StringPool);
+    Table * table = (Table *)allocator->New(allocator->m_userData, sizeof(Table) + sizeof(std::atomic<const char *>) * capacity);
+    new (&table->next) std::atomic<Table *>(NULL);
+    table->capacity = capacity;
+    table->slots = (std::atomic<const char *> *)(table + 1);
+    for (int i = 0; i < capacity; i++) {
+        new (&table->slots[i]) std::atomic<const char *>(NULL);
+    }
+    return table;
+}
+
+SharedStringPool::Table * SharedStringPool::GetNextTable(Table * table) {
+    Table * next = table->next.load(std::memory_order_acquire);
+    if (next == NULL) {
+        Table * newTable = NewTable(table->capacity * 2);
+        if (table->next.compare_exchange_strong(next, newTable, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            next = newTable;
+        }
+        else {
+            // Another thread chained its table first.
+            allocator->Delete(allocator->m_userData, newTable);
+        }
+    }
+    return next;
+}
+
+char * SharedStringPool::NewString(const char * string, size_t length, unsigned int hash) {
+    AllocationSiteScope scope(AllocationSite_StringPool);
+    char * block = (char *)allocator->New(allocator->m_userData, s_sharedHeaderSize + length + 1);
+    unsigned int header[3] = { hash, (unsigned int)length, nextId.fetch_add(1, std::memory_order_relaxed) };
+    memcpy(block, header, s_sharedHeaderSize);
+    char * chars = block + s_sharedHeaderSize;
+    memcpy(chars, string, length);
+    chars[length] = 0;
+    return chars;
+}
+
+void SharedStringPool::DeleteString(const char * chars) {
+    allocator->Delete(allocator->m_userData, (void *)(chars - s_sharedHeaderSize));
+}
+
+void SharedStringPool::SetString(StringId id, const char * chars) {
+    int index = (int)(id / s_segmentSize);
+    if (index >= s_maxSegments) return;
+
+    std::atomic<const char *> * segment = segments[index].load(std::memory_order_acquire);
+    if (segment == NULL) {
+        AllocationSiteScope scope(AllocationSite_StringPool);
+        std::atomic<const char *> * newSegment = (std::atomic<const char *> *)allocator->NewArray(allocator->m_userData, sizeof(std::atomic<const char *>), s_segmentSize);
+        for (int i = 0; i < s_segmentSize; i++) {
+            new (&newSegment[i]) std::atomic<const char *>(NULL);
+        }
+        if (segments[index].compare_exchange_strong(segment, newSegment, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            segment = newSegment;
+        }
+        else {
+            allocator->Delete(allocator->m_userData, newSegment);
+        }
+    }
+    segment[id % s_segmentSize].store(chars, std::memory_order_release);
+}
+
+const char * SharedStringPool::GetString(StringId id) const {
+    int index = (int)(id / s_segmentSize);
+    if (index >= s_maxSegments) return NULL;
+
+    std::atomic<const char *> * segment = segments[index].load(std::memory_order_acquire);
+    if (segment == NULL) return NULL;
+    return segment[id % s_segmentSize].load(std::memory_order_acquire);
+}
+
+const char * SharedStringPool::AddString(const char * string) {
+    return AddString(string, strlen(string));
+}
+
+const char * SharedStringPool::AddString(const char * string, size_t length) {
+    return AddString(string, length, String_Hash(string, length));
+}
+
+const char * SharedStringPool::AddString(const char * string, size_t length, unsigned int hash) {
+    char * chars = NULL;    // Our copy, only made once we found an empty slot.
+
+    // Every thread walks the same probe sequence and slots are written once, so two
+    // threads adding the same string always meet at the same slot.
+    Table * table = firstTable;
+    while (true) {
+        int mask = table->capacity - 1;
+        int i = hash & mask;
+        for (int probe = 0; probe < s_maxProbes; probe++, i = (i + 1) & mask) {
+            const char * current = table->slots[i].load(std::memory_order_acquire);
+            if (current == NULL) {
+                if (chars == NULL) {
+                    chars = NewString(string, length, hash);
+                    // Register the id before publishing the string, so that the id of any
+                    // string returned by the pool can be looked up.
+                    SetString(GetSharedHeader(chars, 2), chars);
+                }
+                if (table->slots[i].compare_exchange_strong(current, chars, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    count.fetch_add(1, std::memory_order_relaxed);
+                    return chars;
+                }
+                // Lost the slot, current is the string that won it.
+            }
+            if (GetIsSharedString(current, string, length, hash)) {
+                if (chars != NULL) {
+                    SetString(GetSharedHeader(chars, 2), NULL);
+                    DeleteString(chars);
+                }
+                return current;
+            }
+        }
+        table = GetNextTable(table);
+    }
+}
+
+const char * SharedStringPool::FindString(const char * string, size_t length) const {
+    unsigned int hash = String_Hash(string, length);
+    const Table * table = firstTable;
+    while (table != NULL) {
+        int mask = table->capacity - 1;
+        int i = hash & mask;
+        for (int probe = 0; probe < s_maxProbes; probe++, i = (i + 1) & mask) {
+            const char * current = table->slots[i].load(std::memory_order_acquire);
+            if (current == NULL) return NULL;
+            if (GetIsSharedString(current, string, length, hash)) return current;
+        }
+        table = table->next.load(std::memory_order_acquire);
+    }
+    return NULL;
+}
+
+// Engine/Allocator.cpp
+
+#if _MSC_VER
+static __declspec(thread) AllocationSite s_allocationSite = AllocationSite_Other;
+#else
+static thread_local AllocationSite s_allocationSite = AllocationSite_Other;
+#endif
+
+AllocationSite GetAllocationSite() {
+    return s_allocationSite;
+}
+
+void SetAllocationSite(AllocationSite site) {
+    s_allocationSite = site;
+}
+
+// Engine/TrackingAllocator.cpp
+
+// Every allocation is preceded by a header that remembers its size and site, so that frees can be attributed.
+struct TrackingHeader {
+    size_t size;
+    size_t site;
+};
+static const size_t s_trackingHeaderSize = 16;
+
+static void * TrackingNew(void * userData, size_t size) {
+    return ((TrackingAllocator *)userData)->Allocate(size);
+}
+static void * TrackingNewArray(void * userData, size_t size, size_t count) {
+    return ((TrackingAllocator *)userData)->Allocate(size * count);
+}
+static void TrackingDelete(void * userData, void * ptr) {
+    ((TrackingAllocator *)userData)->Free(ptr);
+}
+static void * TrackingRealloc(void * userData, void * ptr, size_t size, size_t count) {
+    return ((TrackingAllocator *)userData)->Reallocate(ptr, size * count);
+}
+
+static int GetSizeBucket(size_t size) {
+    int bucket = 0;
+    while (size != 0 && bucket < TrackingAllocator::s_numSizeBuckets - 1) {
+        size >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+TrackingAllocator::TrackingAllocator(Allocator * allocator) : parent(allocator) {
+    this->allocator.m_userData = this;
+    this->allocator.New = TrackingNew;
+    this->allocator.NewArray = TrackingNewArray;
+    this->allocator.Delete = TrackingDelete;
+    this->allocator.Realloc = TrackingRealloc;
+    ResetStats();
+}
+
+void TrackingAllocator::ResetStats() {
+    memset(&stats, 0, sizeof(stats));
+}
+
+void TrackingAllocator::RecordAllocation(AllocationSite site, size_t size) {
+    SiteStats * siteStats[2] = { &stats.total, &stats.site[site] };
+    for (int i = 0; i < 2; i++) {
+        SiteStats & s = *siteStats[i];
+        s.allocatedBytes += size;
+        s.liveBytes += size;
+        if (s.liveBytes > s.peakLiveBytes) s.peakLiveBytes = s.liveBytes;
+        s.sizeHistogram[GetSizeBucket(size)]++;
+    }
+}
+
+void TrackingAllocator::RecordFree(AllocationSite site, size_t size) {
+    stats.total.liveBytes -= size;
+    stats.site[site].liveBytes -= size;
+}
+
+void * TrackingAllocator::Allocate(size_t size) {
+    AllocationSite site = GetAllocationSite();
+    char * block = (char *)parent->New(parent->m_userData, s_trackingHeaderSize + size);
+    if (block == NULL) return NULL;
+
+    TrackingHeader * header = (TrackingHeader *)block;
+    header->size = size;
+    header->site = site;
+
+    stats.total.numAllocations++;
+    stats.site[site].numAllocations++;
+    RecordAllocation(site, size);
+
+    return block + s_trackingHeaderSize;
+}
+
+void TrackingAllocator::Free(void * ptr) {
+    if (ptr == NULL) return;
+
+    char * block = (char *)ptr - s_trackingHeaderSize;
+    TrackingHeader * header = (TrackingHeader *)block;
+    AllocationSite site = (AllocationSite)header->site;
+
+    stats.total.numFrees++;
+    stats.site[site].numFrees++;
+    RecordFree(site, header->size);
+
+    parent->Delete(parent->m_userData, block);
+}
+
+void * TrackingAllocator::Reallocate(void * ptr, size_t size) {
+    if (ptr == NULL) return Allocate(size);
+
+    char * block = (char *)ptr - s_trackingHeaderSize;
+    TrackingHeader * header = (TrackingHeader *)block;
+    AllocationSite site = (AllocationSite)header->site;
+    size_t oldSize = header->size;
+
+    block = (char *)parent->Realloc(parent->m_userData, block, 1, s_trackingHeaderSize + size);
+    if (block == NULL) return NULL;
+
+    header = (TrackingHeader *)block;
+    header->size = size;
+
+    stats.total.numReallocations++;
+    stats.site[site].numReallocations++;
+    RecordFree(site, oldSize);
+    RecordAllocation(site, size);
+
+    return block + s_trackingHeaderSize;
+}
+
+// Engine/BudgetAllocator.cpp
+
+static const size_t s_budgetHeaderSize = 16;
+
+static void * BudgetNew(void * userData, size_t size) {
+    return ((BudgetAllocator *)userData)->Allocate(size);
+}
+static void * BudgetNewArray(void * userData, size_t size, size_t count) {
+    return ((BudgetAllocator *)userData)->Allocate(size * count);
+}
+static void BudgetDelete(void * userData, void * ptr) {
+    ((BudgetAllocator *)userData)->Free(ptr);
+}
+static void * BudgetRealloc(void * userData, void * ptr, size_t size, size_t count) {
+    return ((BudgetAllocator *)userData)->Reallocate(ptr, size * count);
+}
+
+BudgetAllocator::BudgetAllocator(Allocator * allocator, size_t budget) : parent(allocator), budget(budget), liveBytes(0), exhausted(false) {
+    this->allocator.m_userData = this;
+    this->allocator.New = BudgetNew;
+    this->allocator.NewArray = BudgetNewArray;
+    this->allocator.Delete = BudgetDelete;
+    this->allocator.Realloc = BudgetRealloc;
+}
+
+void BudgetAllocator::Reserve(size_t size) {
+    liveBytes += size;
+    if (liveBytes > budget) exhausted = true;
+}
+
+void * BudgetAllocator::Allocate(size_t size) {
+    char * block = (char *)parent->New(parent->m_userData, s_budgetHeaderSize + size);
+    if (block == NULL) {
+        exhausted = true;
+        return NULL;
+    }
+    *(size_t *)block = size;
+    Reserve(size);
+    return block + s_budgetHeaderSize;
+}
+
+void BudgetAllocator::Free(void * ptr) {
+    if (ptr == NULL) return;
+
+    char * block = (char *)ptr - s_budgetHeaderSize;
+    liveBytes -= *(size_t *)block;
+    parent->Delete(parent->m_userData, block);
+}
+
+void * BudgetAllocator::Reallocate(void * ptr, size_t size) {
+    if (ptr == NULL) return Allocate(size);
+
+    char * block = (char *)ptr - s_budgetHeaderSize;
+    size_t oldSize = *(size_t *)block;
+
+    block = (char *)parent->Realloc(parent->m_userData, block, 1, s_budgetHeaderSize + size);
+    if (block == NULL) {
+        exhausted = true;
+        return NULL;
+    }
+    *(size_t *)block = size;
+    liveBytes -= oldSize;
+    Reserve(size);
+    return block + s_budgetHeaderSize;
+}
+
+// Engine/ArenaAllocator.cpp
+
+// Every allocation is preceded by a header that stores its size, so that Reallocate can copy the contents.
+static const size_t s_arenaHeaderSize = ArenaAllocator::s_alignment;
+
+static void * ArenaNew(void * userData, size_t size) {
+    return ((ArenaAllocator *)userData)->Allocate(size);
+}
+static void * ArenaNewArray(void * userData, size_t size, size_t count) {
+    return ((ArenaAllocator *)userData)->Allocate(size * count);
+}
+static void ArenaDelete(void * userData, void * ptr) {
+    ((ArenaAllocator *)userData)->Free(ptr);
+}
+static void * ArenaRealloc(void * userData, void * ptr, size_t size, size_t count) {
+    return ((ArenaAllocator *)userData)->Reallocate(ptr, size * count);
+}
+
+ArenaAllocator::ArenaAllocator(size_t chunkSize, bool useHugePages) :
+    chunkSize(chunkSize), useHugePages(useHugePages), firstChunk(NULL), currentChunk(NULL), offset(0) {
+    allocator.m_userData = this;
+    allocator.New = ArenaNew;
+    allocator.NewArray = ArenaNewArray;
+    allocator.Delete = ArenaDelete;
+    allocator.Realloc = ArenaRealloc;
+}
+
+ArenaAllocator::~ArenaAllocator() {
+    Chunk * chunk = firstChunk;
+    while (chunk != NULL) {
+        Chunk * next = chunk->next;
+        FreeChunk(chunk);
+        chunk = next;
     }
+}
+
+ArenaAllocator::Chunk * ArenaAllocator::AllocateChunk(size_t size) {
+    size_t total = AlignSize(sizeof(Chunk)) + size;
+    size_t alignment = s_alignment;
+    if (useHugePages) {
+        total = (total + s_hugePageSize - 1) & ~(s_hugePageSize - 1);
+        alignment = s_hugePageSize;
+    }
+
+    void * memory = NULL;
+#if _MSC_VER
+    memory = _aligned_malloc(total, alignment);
+#else
+    if (posix_memalign(&memory, alignment, total) != 0) memory = NULL;
+#endif
+    if (memory == NULL) return NULL;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (useHugePages) {
+        madvise(memory, total, MADV_HUGEPAGE);
+    }
+#endif
+
+    Chunk * chunk = (Chunk *)memory;
+    chunk->next = NULL;
+    chunk->size = total - AlignSize(sizeof(Chunk));
+    chunk->used = 0;
+    return chunk;
+}
+
+void ArenaAllocator::FreeChunk(Chunk * chunk) {
+#if _MSC_VER
+    _aligned_free(chunk);
+#else
+    free(chunk);
+#endif
+}
+
+void ArenaAllocator::NextChunk(size_t size) {
+    if (currentChunk != NULL) {
+        currentChunk->used = offset;
+    }
+
+    // Reuse the chunks left over by a reset when they are large enough.
+    Chunk * next = (currentChunk != NULL) ? currentChunk->next : firstChunk;
+    if (next == NULL || next->size < size) {
+        Chunk * chunk = AllocateChunk(size > chunkSize ? size : chunkSize);
+        if (chunk == NULL) return;
+        chunk->next = next;
+        if (currentChunk != NULL) currentChunk->next = chunk;
+        else firstChunk = chunk;
+        next = chunk;
+    }
+
+    currentChunk = next;
+    offset = 0;
+}
+
+void * ArenaAllocator::Allocate(size_t size) {
+    size_t needed = s_arenaHeaderSize + AlignSize(size);
+    if (currentChunk == NULL || currentChunk->size - offset < needed) {
+        NextChunk(needed);
+        if (currentChunk == NULL || currentChunk->size - offset < needed) return NULL;
+    }
+
+    char * block = GetChunkData(currentChunk) + offset;
+    *(size_t *)block = size;
+    offset += needed;
+    return block + s_arenaHeaderSize;
+}
+
+void ArenaAllocator::Free(void * ptr) {
+    if (ptr == NULL || currentChunk == NULL) return;
+
+    // Only the last allocation can be given back, the rest is released by Reset.
+    size_t size = *(size_t *)((char *)ptr - s_arenaHeaderSize);
+    if ((char *)ptr + AlignSize(size) == GetChunkData(currentChunk) + offset) {
+        offset -= s_arenaHeaderSize + AlignSize(size);
+    }
+}
+
+void * ArenaAllocator::Reallocate(void * ptr, size_t size) {
+    if (ptr == NULL) return Allocate(size);
+
+    size_t * header = (size_t *)((char *)ptr - s_arenaHeaderSize);
+    size_t oldSize = *header;
+
+    // Grow or shrink in place when this is the last allocation.
+    if (currentChunk != NULL && (char *)ptr + AlignSize(oldSize) == GetChunkData(currentChunk) + offset) {
+        size_t start = (char *)ptr - GetChunkData(currentChunk);
+        if (currentChunk->size - start >= AlignSize(size)) {
+            *header = size;
+            offset = start + AlignSize(size);
+            return ptr;
+        }
+    }
+
+    void * result = Allocate(size);
+    if (result != NULL) {
+        memcpy(result, ptr, oldSize < size ? oldSize : size);
+    }
+    return result;
+}
+
+ArenaAllocator::Marker ArenaAllocator::Mark() const {
+    Marker marker;
+    marker.chunk = currentChunk;
+    marker.offset = offset;
+    return marker;
+}
+
+void ArenaAllocator::Reset(const Marker & marker) {
+    currentChunk = (Chunk *)marker.chunk;
+    offset = marker.offset;
+}
+
+void ArenaAllocator::Reset() {
+    currentChunk = NULL;
+    offset = 0;
+}
+
+size_t ArenaAllocator::GetUsedSize() const {
+    if (currentChunk == NULL) return 0;
+
+    size_t size = offset;
+    for (Chunk * chunk = firstChunk; chunk != currentChunk; chunk = chunk->next) {
+        size += chunk->used;
+    }
+    return size;
+}
+
+size_t ArenaAllocator::GetReservedSize() const {
+    size_t size = 0;
+    for (Chunk * chunk = firstChunk; chunk != NULL; chunk = chunk->next) {
+        size += chunk->size;
+    }
+    return size;
+}
+
+// Engine/MappedFile.cpp
+
+MappedFile::MappedFile() : data(NULL), size(0), mappedSize(0) {
+}
+MappedFile::~MappedFile() {
+    Close();
+}
+
+bool MappedFile::Open(const char * fileName) {
+    Close();
+    return Map(fileName) || Read(fileName);
+}
+
+void MappedFile::Close() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (mappedSize != 0) {
+        munmap(data, mappedSize);
+    }
+    else
+#endif
+    {
+        free(data);
+    }
+    data = NULL;
+    size = 0;
+    mappedSize = 0;
+}
+
+bool MappedFile::Map(const char * fileName) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) return false;
+
+    // Empty files and pipes are read instead.
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t fileSize = (size_t)info.st_size;
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t totalSize = (fileSize + s_padding + pageSize - 1) & ~(pageSize - 1);
+
+    // Reserve zeroed pages for the contents and the padding, then map the file over
+    // them. The kernel zeroes the rest of the file's last page.
+    void * memory = mmap(NULL, totalSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    if (mmap(memory, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(memory, totalSize);
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+#if defined(MADV_SEQUENTIAL)
+    madvise(memory, fileSize, MADV_SEQUENTIAL);
+#endif
+
+    data = (char *)memory;
+    size = fileSize;
+    mappedSize = totalSize;
+    return true;
+#else
     return false;
+#endif
+}
+
+bool MappedFile::Read(const char * fileName) {
+    FILE * file = fopen(fileName, "rb");
+    if (file == NULL) return false;
+
+    long fileSize = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        fileSize = ftell(file);
+    }
+    if (fileSize < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return false;
+    }
+
+    char * buffer = (char *)malloc((size_t)fileSize + s_padding);
+    if (buffer == NULL || fread(buffer, 1, (size_t)fileSize, file) != (size_t)fileSize) {
+        free(buffer);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    memset(buffer + fileSize, 0, s_padding);
+    data = buffer;
+    size = (size_t)fileSize;
+    return true;
 }
 
 } // M4 namespace
@@ -7,7 +7,11 @@
 
 #include <stdarg.h> // va_list, vsnprintf
 #include <stdlib.h> // malloc
+#include <string.h> // memcpy, memset
 #include <new> // for placement new
+#include <atomic> // std::atomic
+#include <type_traits> // std::is_trivial, std::is_trivially_copyable
+#include <utility> // std::move, std::forward
 
 #ifndef NULL
 #define NULL    0
@@ -37,6 +41,190 @@ struct Allocator
     void* (*Realloc)(void* userData, void* ptr, size_t size, size_t count);
 };
 
+// Identifies which part of the library is calling the allocator, so that
+// allocators can attribute memory to it.
+enum AllocationSite
+{
+    AllocationSite_Other,
+    AllocationSite_Array,
+    AllocationSite_NodePage,
+    AllocationSite_StringPool,
+    AllocationSite_Count
+};
+
+// The site is tracked per thread and set with AllocationSiteScope.
+AllocationSite GetAllocationSite();
+void SetAllocationSite(AllocationSite site);
+
+// The outermost scope wins, so that containers used inside the string pool are
+// attributed to the string pool.
+struct AllocationSiteScope
+{
+    explicit AllocationSiteScope(AllocationSite site) : previous(GetAllocationSite()) {
+        if (previous == AllocationSite_Other) SetAllocationSite(site);
+    }
+    ~AllocationSiteScope() { SetAllocationSite(previous); }
+    AllocationSite previous;
+};
+
+// Engine/ArenaAllocator.h
+
+// Bump allocator that hands out memory from large chunks. Delete only reclaims the
+// most recent allocation, everything else is released with Reset(), which keeps the
+// chunks around so that they can be reused by the next parse.
+class ArenaAllocator
+{
+public:
+
+    static const size_t s_defaultChunkSize = 64 * 1024;
+    static const size_t s_hugePageSize = 2 * 1024 * 1024;
+    static const size_t s_alignment = 16;
+
+    struct Marker {
+        void * chunk;
+        size_t offset;
+    };
+
+    explicit ArenaAllocator(size_t chunkSize = s_defaultChunkSize, bool useHugePages = false);
+    ~ArenaAllocator();
+
+    /** Returns the Allocator interface that routes to this arena. */
+    Allocator * GetAllocator() { return &allocator; }
+
+    void * Allocate(size_t size);
+    void * Reallocate(void * ptr, size_t size);
+    void Free(void * ptr);
+
+    /** Records the current position, allocations made after it can be released with Reset(marker). */
+    Marker Mark() const;
+    void Reset(const Marker & marker);
+
+    /** Releases all the allocations, but keeps the chunks for reuse. */
+    void Reset();
+
+    size_t GetUsedSize() const;
+    size_t GetReservedSize() const;
+
+private:
+
+    struct Chunk {
+        Chunk * next;
+        size_t size;
+        size_t used;            // Only valid once the arena moved past this chunk.
+    };
+
+    static size_t AlignSize(size_t size) { return (size + s_alignment - 1) & ~(s_alignment - 1); }
+    static char * GetChunkData(Chunk * chunk) { return (char *)chunk + AlignSize(sizeof(Chunk)); }
+
+    void NextChunk(size_t size);
+    Chunk * AllocateChunk(size_t size);
+    void FreeChunk(Chunk * chunk);
+
+    // Not copyable.
+    ArenaAllocator(const ArenaAllocator &);
+    void operator=(const ArenaAllocator &);
+
+    Allocator allocator;
+    size_t chunkSize;
+    bool useHugePages;
+    Chunk * firstChunk;
+    Chunk * currentChunk;
+    size_t offset;              // Offset of the next allocation in the current chunk.
+};
+
+// Engine/TrackingAllocator.h
+
+// Allocator that forwards to another one and records the number of calls and
+// bytes, peak live bytes, and a size histogram for each allocation site.
+class TrackingAllocator
+{
+public:
+
+    static const int s_numSizeBuckets = 32;     // Bucket i counts sizes in [2^(i-1), 2^i).
+
+    struct SiteStats {
+        size_t numAllocations;
+        size_t numFrees;
+        size_t numReallocations;
+        size_t allocatedBytes;                  // Total requested, including reallocations.
+        size_t liveBytes;
+        size_t peakLiveBytes;
+        size_t sizeHistogram[s_numSizeBuckets];
+    };
+
+    struct Stats {
+        SiteStats total;
+        SiteStats site[AllocationSite_Count];
+    };
+
+    explicit TrackingAllocator(Allocator * allocator);
+
+    /** Returns the Allocator interface that routes through this tracker. */
+    Allocator * GetAllocator() { return &allocator; }
+
+    const Stats & GetStats() const { return stats; }
+    void ResetStats();
+
+    void * Allocate(size_t size);
+    void * Reallocate(void * ptr, size_t size);
+    void Free(void * ptr);
+
+private:
+
+    void RecordAllocation(AllocationSite site, size_t size);
+    void RecordFree(AllocationSite site, size_t size);
+
+    // Not copyable.
+    TrackingAllocator(const TrackingAllocator &);
+    void operator=(const TrackingAllocator &);
+
+    Allocator allocator;
+    Allocator * parent;
+    Stats stats;
+};
+
+// Engine/BudgetAllocator.h
+
+// Allocator that forwards to another one and keeps the live bytes under a budget.
+// Callers don't check for NULL, so an allocation that goes over the budget is still
+// served, but the allocator is flagged as exhausted and the owner is expected to
+// give up at the next opportunity (HLSLParser checks it after every token).
+class BudgetAllocator
+{
+public:
+
+    BudgetAllocator(Allocator * allocator, size_t budget);
+
+    /** Returns the Allocator interface that routes through this budget. */
+    Allocator * GetAllocator() { return &allocator; }
+
+    void SetBudget(size_t budget) { this->budget = budget; }
+    size_t GetBudget() const { return budget; }
+    size_t GetLiveBytes() const { return liveBytes; }
+
+    /** True once an allocation went over the budget, until ClearExhausted is called. */
+    bool GetIsExhausted() const { return exhausted; }
+    void ClearExhausted() { exhausted = false; }
+
+    void * Allocate(size_t size);
+    void * Reallocate(void * ptr, size_t size);
+    void Free(void * ptr);
+
+private:
+
+    void Reserve(size_t size);
+
+    // Not copyable.
+    BudgetAllocator(const BudgetAllocator &);
+    void operator=(const BudgetAllocator &);
+
+    Allocator allocator;
+    Allocator * parent;
+    size_t budget;
+    size_t liveBytes;
+    bool exhausted;
+};
+
 struct Logger 
 {
     void* m_userData;
@@ -47,6 +235,46 @@ struct Logger
 
 typedef const char*(*FileReadCallback)(const char* fileName);
 
+// Engine/MappedFile.h
+
+// Read-only view of a file's contents. The file is memory mapped where the platform
+// supports it and read into memory otherwise. Either way the contents are followed
+// by s_padding zero bytes, so they can be read as a string and scanned a vector at
+// a time without checking for the end.
+class MappedFile
+{
+public:
+
+    static const size_t s_padding = 64;
+
+    MappedFile();
+    ~MappedFile();
+
+    /** Opens the file, replacing the previous one. Returns false if it can't be read. */
+    bool Open(const char * fileName);
+    void Close();
+
+    bool GetIsOpen() const { return data != NULL; }
+    const char * GetData() const { return data; }
+    size_t GetSize() const { return size; }
+
+    /** True if the contents are mapped rather than copied into memory. */
+    bool GetIsMapped() const { return mappedSize != 0; }
+
+private:
+
+    bool Map(const char * fileName);
+    bool Read(const char * fileName);
+
+    // Not copyable.
+    MappedFile(const MappedFile &);
+    void operator=(const MappedFile &);
+
+    char * data;
+    size_t size;
+    size_t mappedSize;          // Size of the whole mapping, including the padding.
+};
+
 // Engine/String.h
 
 int String_Printf(char * buffer, int size, const char * format, ...);
@@ -56,16 +284,40 @@ bool String_Equal(const char * a, const char * b);
 bool String_EqualNoCase(const char * a, const char * b);
 double String_ToDouble(const char * str, char ** end);
 int String_ToInteger(const char * str, char ** end);
+unsigned int String_Hash(const char * str, size_t length);
+
+// String_Hash is FNV-1a, these let callers hash characters while they scan them.
+static const unsigned int String_HashSeed = 2166136261u;
+inline unsigned int String_HashAdd(unsigned int hash, char c) { return (hash ^ (unsigned char)c) * 16777619u; }
+
+// 64 bit FNV-1a, for hashes of file contents that are kept across runs. Pass the
+// previous hash as the seed to hash several buffers as one.
+static const unsigned long long String_Hash64Seed = 14695981039346656037ull;
+unsigned long long String_Hash64(const char * str, size_t length, unsigned long long hash = String_Hash64Seed);
 
 // Engine/Array.h
 
+// Trivial types are zero filled with memset and copied with memcpy, everything
+// else goes through constructors and destructors.
 template <typename T>
-void ConstructRange(T * buffer, int new_size, int old_size) {
+void ConstructRange(T * buffer, int new_size, int old_size, std::true_type /*trivial*/) {
+    if (new_size > old_size) {
+        memset((void *)(buffer + old_size), 0, sizeof(T) * (new_size - old_size));
+    }
+}
+
+template <typename T>
+void ConstructRange(T * buffer, int new_size, int old_size, std::false_type /*trivial*/) {
     for (int i = old_size; i < new_size; i++) {
         new(buffer+i) T; // placement new
     }
 }
 
+template <typename T>
+void ConstructRange(T * buffer, int new_size, int old_size) {
+    ConstructRange(buffer, new_size, old_size, std::integral_constant<bool, std::is_trivial<T>::value>());
+}
+
 template <typename T>
 void ConstructRange(T * buffer, int new_size, int old_size, const T & val) {
     for (int i = old_size; i < new_size; i++) {
@@ -75,6 +327,7 @@ void ConstructRange(T * buffer, int new_size, int old_size, const T & val) {
 
 template <typename T>
 void DestroyRange(T * buffer, int new_size, int old_size) {
+    if (std::is_trivially_destructible<T>::value) return;
     for (int i = new_size; i < old_size; i++) {
         (buffer+i)->~T(); // Explicit call to the destructor
     }
@@ -84,7 +337,15 @@ void DestroyRange(T * buffer, int new_size, int old_size) {
 template <typename T>
 class Array {
 public:
-    Array(Allocator * allocator) : allocator(allocator), buffer(NULL), size(0), capacity(0) {}
+    // The first allocation holds at least this many elements.
+    static const int s_minCapacity = 8;
+
+    Array(Allocator * allocator) : allocator(allocator), buffer(NULL), size(0), capacity(0), growth(50) {}
+    Array(Array && other) : allocator(other.allocator), buffer(other.buffer), size(other.size), capacity(other.capacity), growth(other.growth) {
+        other.buffer = NULL;
+        other.size = 0;
+        other.capacity = 0;
+    }
     ~Array() { DestroyRange(buffer, 0, size);  allocator->Delete(allocator->m_userData, (void*)buffer); }
 
     void PushBack(const T & val) {
@@ -97,6 +358,21 @@ public:
 
         ConstructRange(buffer, new_size, old_size, val);
     }
+    void PushBack(T && val) {
+        ASSERT(&val < buffer || &val >= buffer+size);
+
+        int old_size = size;
+        SetSize(old_size + 1);
+
+        new(buffer+old_size) T(std::move(val));
+    }
+    template <typename... Args>
+    T & EmplaceBack(Args &&... args) {
+        int old_size = size;
+        SetSize(old_size + 1);
+
+        return *new(buffer+old_size) T(std::forward<Args>(args)...);
+    }
     T & PushBackNew() {
         int old_size = size;
         int new_size = size + 1;
@@ -124,7 +400,21 @@ public:
         ConstructRange(buffer, new_size, old_size);
     }
 
+    // Removes all the elements, but keeps the buffer.
+    void Clear() { Resize(0); }
+
+    // Makes sure that the array can hold new_capacity elements without reallocating.
+    void Reserve(int new_capacity) {
+        if (new_capacity > capacity) {
+            SetCapacity(new_capacity);
+        }
+    }
+
+    // Percentage by which the capacity grows when the array is full.
+    void SetGrowthPercent(int percent) { ASSERT(percent > 0); growth = percent; }
+
     int GetSize() const { return size; }
+    int GetCapacity() const { return capacity; }
     const T & operator[](int i) const { ASSERT(i < size); return buffer[i]; }
     T & operator[](int i) { ASSERT(i < size); return buffer[i]; }
 
@@ -132,21 +422,16 @@ private:
 
     // Change array size.
     void SetSize(int new_size) {
-        size = new_size;
-
         if (new_size > capacity) {
-            int new_buffer_size;
-            if (capacity == 0) {
-                // first allocation is exact
-                new_buffer_size = new_size;
-            }
-            else {
-                // following allocations grow array by 25%
-                new_buffer_size = new_size + (new_size >> 2);
-            }
+            // grow geometrically, so that pushing elements is amortized O(1).
+            int new_buffer_size = capacity + (int)((long long)capacity * growth / 100);
+            if (new_buffer_size < new_size) new_buffer_size = new_size;
+            if (new_buffer_size < s_minCapacity) new_buffer_size = s_minCapacity;
 
             SetCapacity(new_buffer_size);
         }
+
+        size = new_size;
     }
 
     // Change array capacity.
@@ -161,35 +446,272 @@ private:
             }
         }
         else {
-            // realloc the buffer
-            buffer = (T*)allocator->Realloc(allocator->m_userData, (void*)buffer, sizeof(T), new_capacity);
+            AllocationSiteScope scope(AllocationSite_Array);
+            MoveBuffer(new_capacity, std::integral_constant<bool, std::is_trivially_copyable<T>::value>());
         }
 
         capacity = new_capacity;
     }
 
+    // Trivially copyable elements can be moved bitwise by the allocator.
+    void MoveBuffer(int new_capacity, std::true_type) {
+        buffer = (T*)allocator->Realloc(allocator->m_userData, (void*)buffer, sizeof(T), new_capacity);
+    }
+
+    // Other elements are moved into a new buffer.
+    void MoveBuffer(int new_capacity, std::false_type) {
+        T * new_buffer = (T*)allocator->NewArray(allocator->m_userData, sizeof(T), new_capacity);
+        for (int i = 0; i < size; i++) {
+            new(new_buffer+i) T(std::move(buffer[i]));
+        }
+        DestroyRange(buffer, 0, size);
+        if (buffer != NULL) {
+            allocator->Delete(allocator->m_userData, (void*)buffer);
+        }
+        buffer = new_buffer;
+    }
+
+    // Not copyable.
+    Array(const Array &);
+    void operator=(const Array &);
 
 private:
     Allocator * allocator; // @@ Do we really have to keep a pointer to this?
     T * buffer;
     int size;
     int capacity;
+    int growth;
+};
+
+
+// Engine/SmallArray.h
+
+// Array that keeps the first N elements inline and only uses the allocator when it
+// grows past them. Meant for scratch containers that are usually small.
+template <typename T, int N>
+class SmallArray {
+public:
+    SmallArray(Allocator * allocator) : allocator(allocator), buffer((T *)storage), size(0), capacity(N) {}
+    ~SmallArray() {
+        DestroyRange(buffer, 0, size);
+        if (buffer != (T *)storage) {
+            allocator->Delete(allocator->m_userData, (void*)buffer);
+        }
+    }
+
+    void PushBack(const T & val) {
+        ASSERT(&val < buffer || &val >= buffer+size);
+        Grow(size + 1);
+        new(buffer+size) T(val);
+        size++;
+    }
+    template <typename... Args>
+    T & EmplaceBack(Args &&... args) {
+        Grow(size + 1);
+        T * element = new(buffer+size) T(std::forward<Args>(args)...);
+        size++;
+        return *element;
+    }
+    T & PushBackNew() {
+        Grow(size + 1);
+        ConstructRange(buffer, size + 1, size);
+        return buffer[size++];
+    }
+    void PopBack() {
+        if (size == 0)
+            return;
+
+        (buffer + (--size))->~T();
+    }
+
+    void Resize(int new_size) {
+        DestroyRange(buffer, new_size, size);
+        Grow(new_size);
+        ConstructRange(buffer, new_size, size);
+        size = new_size;
+    }
+
+    // Removes all the elements, but keeps the buffer.
+    void Clear() { Resize(0); }
+
+    void Reserve(int new_capacity) { Grow(new_capacity); }
+
+    int GetSize() const { return size; }
+    int GetCapacity() const { return capacity; }
+    bool GetIsInline() const { return buffer == (const T *)storage; }
+    const T & operator[](int i) const { ASSERT(i < size); return buffer[i]; }
+    T & operator[](int i) { ASSERT(i < size); return buffer[i]; }
+
+private:
+
+    void Grow(int new_size) {
+        if (new_size <= capacity) return;
+
+        int new_capacity = capacity * 2;
+        if (new_capacity < new_size) new_capacity = new_size;
+
+        AllocationSiteScope scope(AllocationSite_Array);
+        T * new_buffer = (T*)allocator->NewArray(allocator->m_userData, sizeof(T), new_capacity);
+        for (int i = 0; i < size; i++) {
+            new(new_buffer+i) T(std::move(buffer[i]));
+        }
+        DestroyRange(buffer, 0, size);
+        if (buffer != (T *)storage) {
+            allocator->Delete(allocator->m_userData, (void*)buffer);
+        }
+
+        buffer = new_buffer;
+        capacity = new_capacity;
+    }
+
+    // Not copyable.
+    SmallArray(const SmallArray &);
+    void operator=(const SmallArray &);
+
+private:
+    Allocator * allocator;
+    T * buffer;
+    int size;
+    int capacity;
+    alignas(T) char storage[sizeof(T) * N];
 };
 
 
 // Engine/StringPool.h
 
-// @@ Implement this with a hash table!
+// Compact handle for a string in a StringPool. Ids are assigned in insertion order
+// starting at 1, 0 is never a valid string.
+typedef unsigned int StringId;
+static const StringId InvalidStringId = 0;
+
+// Engine/SharedStringPool.h
+
+// Interns strings for several threads at once, so that trees parsed in parallel can
+// share their strings and compare them by pointer. Lookups and insertions don't take
+// locks: slots are only ever written once, with a compare and swap. When the probe
+// sequence of a table is full, the search continues in a table twice as large that
+// is chained after it, so strings never move. The allocator must be thread safe.
+// Ids are unique, but not dense, since a thread that loses a race discards its id.
+class SharedStringPool {
+public:
+    explicit SharedStringPool(Allocator * allocator);
+    ~SharedStringPool();
+
+    const char * AddString(const char * string);
+    const char * AddString(const char * string, size_t length);
+    const char * AddString(const char * string, size_t length, unsigned int hash);
+
+    // Returns the pooled copy of the string, or NULL if it is not in the pool.
+    const char * FindString(const char * string, size_t length) const;
+
+    const char * GetString(StringId id) const;
+    int GetSize() const { return count.load(std::memory_order_relaxed); }
+
+private:
+
+    struct Table {
+        std::atomic<Table *> next;
+        int capacity;                           // Always a power of two.
+        std::atomic<const char *> * slots;
+    };
+
+    static const int s_firstTableCapacity = 1024 * 4;
+    static const int s_maxProbes = 32;
+    static const int s_segmentSize = 1024 * 4;  // Strings per segment of the id map.
+    static const int s_maxSegments = 1024 * 4;
+
+    Table * NewTable(int capacity);
+    Table * GetNextTable(Table * table);
+    char * NewString(const char * string, size_t length, unsigned int hash);
+    void DeleteString(const char * chars);
+    void SetString(StringId id, const char * chars);
+
+    // Not copyable.
+    SharedStringPool(const SharedStringPool &);
+    void operator=(const SharedStringPool &);
+
+    Allocator * allocator;
+    Table * firstTable;
+    std::atomic<StringId> nextId;
+    std::atomic<int> count;
+    std::atomic<std::atomic<const char *> *> segments[s_maxSegments];   // Maps ids to strings.
+};
+
+// Interns strings in an open addressing hash table. The characters live in pages
+// taken from the allocator, so they are only released when the pool is destroyed.
+// When a shared pool is given, all the strings are forwarded to it instead.
 struct StringPool {
-    StringPool(Allocator * allocator);
+    StringPool(Allocator * allocator, SharedStringPool * shared = NULL);
     ~StringPool();
 
+    // Removes all the strings, but keeps the table and the pages for reuse.
+    void Reset();
+
     const char * AddString(const char * string);
+    // Adds a string that isn't zero terminated, hash must be String_Hash(string, length).
+    const char * AddString(const char * string, size_t length, unsigned int hash);
     const char * AddStringFormat(const char * fmt, ...);
     const char * AddStringFormatList(const char * fmt, va_list args);
     bool GetContainsString(const char * string) const;
 
-    Array<const char *> stringArray;
+    StringId AddStringId(const char * string) { return GetStringId(AddString(string)); }
+
+    // Returns the id of a string returned by this pool, without hashing it.
+    StringId GetStringId(const char * pooledString) const {
+        if (pooledString == NULL) return InvalidStringId;
+        StringId id;
+        memcpy(&id, pooledString - sizeof(StringId), sizeof(StringId));
+        return id;
+    }
+
+    // Returns the id of any string, or InvalidStringId if it is not in the pool.
+    StringId FindStringId(const char * string) const;
+
+    const char * GetString(StringId id) const {
+        if (shared != NULL) return shared->GetString(id);
+        ASSERT(id < (StringId)strings.GetSize());
+        return strings[id];
+    }
+
+    int GetSize() const { return count; }
+
+    SharedStringPool * GetSharedPool() const { return shared; }
+
+private:
+
+    struct Slot {
+        const char * string;
+        unsigned int hash;
+        unsigned int length;
+    };
+
+    struct Page {
+        Page * next;
+    };
+
+    static const size_t s_pageSize = 1024 * 16;
+
+    // Returns the slot holding the string, or the empty slot where it should be inserted.
+    int FindSlot(const char * string, size_t length, unsigned int hash) const;
+    const char * AddString(const char * string, size_t length);
+    void SetCapacity(int new_capacity);
+    char * AllocateChars(size_t size);
+
+    // Not copyable.
+    StringPool(const StringPool &);
+    void operator=(const StringPool &);
+
+    Allocator * allocator;
+    SharedStringPool * shared;
+    Array<const char *> strings;    // Indexed by id.
+    Slot * slots;
+    int capacity;       // Always a power of two.
+    int count;
+    Page * firstPage;
+    Page * currentPage;
+    Page * largePages;  // Strings that don't fit in a regular page.
+    char * pageCursor;
+    char * pageEnd;
 };
 
 
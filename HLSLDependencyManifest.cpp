@@ -0,0 +1,245 @@
+#include "Engine.h"
+
+#include "HLSLDependencyManifest.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace M4
+{
+
+static const char* _dependencyTypeName[HLSLDependency_Count] =
+    {
+        "source",
+        "include",
+        "line",
+    };
+
+static void AppendText(Array<char>& text, const char* string, size_t length)
+{
+    int size = text.GetSize();
+    text.Resize(size + (int)length);
+    memcpy(&text[size], string, length);
+}
+
+static void AppendText(Array<char>& text, const char* string)
+{
+    AppendText(text, string, strlen(string));
+}
+
+HLSLDependencyManifest::HLSLDependencyManifest(Allocator* allocator) :
+    m_strings(allocator),
+    m_files(allocator),
+    m_options(allocator)
+{
+    m_allocator = allocator;
+}
+
+void HLSLDependencyManifest::Clear()
+{
+    m_files.Clear();
+    m_options.Clear();
+    m_strings.Reset();
+}
+
+void HLSLDependencyManifest::AddFile(const char* fileName, HLSLDependencyType type, unsigned long long hash)
+{
+    Add(fileName, type, true, hash);
+}
+
+void HLSLDependencyManifest::AddMissingFile(const char* fileName, HLSLDependencyType type)
+{
+    Add(fileName, type, false, 0);
+}
+
+void HLSLDependencyManifest::Add(const char* fileName, HLSLDependencyType type, bool found, unsigned long long hash)
+{
+    // The names are pooled, so they can be compared by pointer.
+    fileName = m_strings.AddString(fileName);
+    for (int i = 0; i < m_files.GetSize(); ++i)
+    {
+        if (m_files[i].fileName == fileName)
+        {
+            return;
+        }
+    }
+    HLSLDependency& file = m_files.PushBackNew();
+    file.fileName   = fileName;
+    file.type       = type;
+    file.found      = found;
+    file.hash       = hash;
+}
+
+void HLSLDependencyManifest::AddOption(const char* name, const char* value)
+{
+    m_options.PushBack(m_strings.AddStringFormat("%s=%s", name, value));
+}
+
+void HLSLDependencyManifest::AddManifest(const HLSLDependencyManifest& manifest)
+{
+    for (int i = 0; i < manifest.m_files.GetSize(); ++i)
+    {
+        const HLSLDependency& file = manifest.m_files[i];
+        Add(file.fileName, file.type, file.found, file.hash);
+    }
+    for (int i = 0; i < manifest.m_options.GetSize(); ++i)
+    {
+        m_options.PushBack(m_strings.AddString(manifest.m_options[i]));
+    }
+}
+
+unsigned long long HLSLDependencyManifest::GetKey() const
+{
+    // The key is the hash of the text, so it doesn't depend on the platform.
+    Array<char> text(m_allocator);
+    WriteEntries(text);
+    return String_Hash64(text.GetSize() > 0 ? &text[0] : "", text.GetSize());
+}
+
+bool HLSLDependencyManifest::GetContainsFile(const HLSLDependency& file) const
+{
+    for (int i = 0; i < m_files.GetSize(); ++i)
+    {
+        const HLSLDependency& other = m_files[i];
+        if (other.found == file.found && other.hash == file.hash && String_Equal(other.fileName, file.fileName))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void HLSLDependencyManifest::WriteEntries(Array<char>& text) const
+{
+    for (int i = 0; i < m_files.GetSize(); ++i)
+    {
+        const HLSLDependency& file = m_files[i];
+        char line[64];
+        if (file.found)
+        {
+            String_Printf(line, sizeof(line), "%s %016llx ", _dependencyTypeName[file.type], file.hash);
+        }
+        else
+        {
+            String_Printf(line, sizeof(line), "%s missing ", _dependencyTypeName[file.type]);
+        }
+        AppendText(text, line);
+        AppendText(text, file.fileName);
+        AppendText(text, "\n");
+    }
+    for (int i = 0; i < m_options.GetSize(); ++i)
+    {
+        AppendText(text, "option ");
+        AppendText(text, m_options[i]);
+        AppendText(text, "\n");
+    }
+}
+
+void HLSLDependencyManifest::Write(Array<char>& text) const
+{
+    char line[64];
+    String_Printf(line, sizeof(line), "key %016llx\n", GetKey());
+    AppendText(text, line);
+    WriteEntries(text);
+}
+
+bool HLSLDependencyManifest::Read(const char* text, size_t length)
+{
+    Clear();
+
+    bool hasKey = false;
+    unsigned long long key = 0;
+    const char* end = text + length;
+    char buffer[1024];
+    while (text < end)
+    {
+        const char* lineEnd = (const char*)memchr(text, '\n', end - text);
+        if (lineEnd == NULL)
+        {
+            lineEnd = end;
+        }
+        size_t lineLength = lineEnd - text;
+        if (lineLength >= sizeof(buffer))
+        {
+            return false;
+        }
+        memcpy(buffer, text, lineLength);
+        buffer[lineLength] = 0;
+        text = lineEnd + 1;
+
+        char* value = strchr(buffer, ' ');
+        if (value == NULL)
+        {
+            return false;
+        }
+        *value++ = 0;
+
+        if (String_Equal(buffer, "key"))
+        {
+            char* valueEnd = NULL;
+            key = strtoull(value, &valueEnd, 16);
+            if (valueEnd == value || *valueEnd != 0)
+            {
+                return false;
+            }
+            hasKey = true;
+            continue;
+        }
+        if (String_Equal(buffer, "option"))
+        {
+            m_options.PushBack(m_strings.AddString(value));
+            continue;
+        }
+
+        int type = 0;
+        while (type < HLSLDependency_Count && !String_Equal(buffer, _dependencyTypeName[type]))
+        {
+            ++type;
+        }
+        char* fileName = strchr(value, ' ');
+        if (type == HLSLDependency_Count || fileName == NULL)
+        {
+            return false;
+        }
+        *fileName++ = 0;
+        if (String_Equal(value, "missing"))
+        {
+            AddMissingFile(fileName, (HLSLDependencyType)type);
+            continue;
+        }
+        char* valueEnd = NULL;
+        unsigned long long hash = strtoull(value, &valueEnd, 16);
+        if (valueEnd == value || *valueEnd != 0)
+        {
+            return false;
+        }
+        AddFile(fileName, (HLSLDependencyType)type, hash);
+    }
+
+    // A manifest that was cut or edited is not trusted.
+    return hasKey && key == GetKey();
+}
+
+bool HLSLDependencyManifest::GetIsUpToDate(FileReadCallback readFile, const HLSLDependencyManifest* known) const
+{
+    for (int i = 0; i < m_files.GetSize(); ++i)
+    {
+        const HLSLDependency& file = m_files[i];
+        if (known != NULL && known->GetContainsFile(file))
+        {
+            continue;
+        }
+        const char* text = (readFile != NULL) ? readFile(file.fileName) : NULL;
+        if ((text != NULL) != file.found)
+        {
+            return false;
+        }
+        if (text != NULL && String_Hash64(text, strlen(text)) != file.hash)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
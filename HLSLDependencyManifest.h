@@ -0,0 +1,91 @@
+#ifndef HLSL_DEPENDENCY_MANIFEST_H
+#define HLSL_DEPENDENCY_MANIFEST_H
+
+#include "Engine.h"
+
+namespace M4
+{
+
+enum HLSLDependencyType
+{
+    HLSLDependency_Source,          // The file that was preprocessed.
+    HLSLDependency_Include,
+    HLSLDependency_Line,            // Named by a #line directive.
+    HLSLDependency_Count,
+};
+
+struct HLSLDependency
+{
+    const char*         fileName;
+    HLSLDependencyType  type;
+    bool                found;      // Files that don't exist are dependencies too, since creating them changes the result.
+    unsigned long long  hash;       // String_Hash64 of the contents, 0 if the file wasn't found.
+};
+
+/** Lists the files that a shader depended on with a hash of their contents, and the
+options it was built with, like the macros. The key of the manifest changes when any
+of them does, so it can be used to cache what is built from the shader. Manifests are
+written as text, one entry per line, and can be read back to check whether the files
+have changed since. */
+class HLSLDependencyManifest
+{
+
+public:
+
+    explicit HLSLDependencyManifest(Allocator* allocator);
+
+    void Clear();
+
+    /** Adds a file, unless it is already in the manifest. */
+    void AddFile(const char* fileName, HLSLDependencyType type, unsigned long long hash);
+    void AddMissingFile(const char* fileName, HLSLDependencyType type);
+
+    /** Adds a setting that changes the result, like a macro. */
+    void AddOption(const char* name, const char* value);
+
+    /** Adds the files and the options of another manifest. */
+    void AddManifest(const HLSLDependencyManifest& manifest);
+
+    int GetNumFiles() const { return m_files.GetSize(); }
+    const HLSLDependency& GetFile(int index) const { return m_files[index]; }
+
+    int GetNumOptions() const { return m_options.GetSize(); }
+    const char* GetOption(int index) const { return m_options[index]; }
+
+    /** Hash of the files, their contents and the options, in the order they were added. */
+    unsigned long long GetKey() const;
+
+    /** Appends the manifest as text. */
+    void Write(Array<char>& text) const;
+
+    /** Replaces the manifest with one written by Write. Returns false if the text
+    isn't a valid manifest. */
+    bool Read(const char* text, size_t length);
+
+    /** Reads the files again with readFile, and returns true if none of them has
+    changed, appeared or disappeared. Files that are in the known manifest with the
+    same hash, like a source that was just read, are not read again. */
+    bool GetIsUpToDate(FileReadCallback readFile, const HLSLDependencyManifest* known = NULL) const;
+
+private:
+
+    void Add(const char* fileName, HLSLDependencyType type, bool found, unsigned long long hash);
+    void WriteEntries(Array<char>& text) const;
+    bool GetContainsFile(const HLSLDependency& file) const;
+
+    // Not copyable.
+    HLSLDependencyManifest(const HLSLDependencyManifest&);
+    void operator=(const HLSLDependencyManifest&);
+
+private:
+
+    Allocator*                  m_allocator;
+    StringPool                  m_strings;
+    Array<HLSLDependency>       m_files;
+    Array<const char*>          m_options;      // As "name=value".
+
+};
+
+}
+
+#endif
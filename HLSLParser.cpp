@@ -1132,8 +1132,14 @@ struct CompareRanks
 static CompareFunctionsResult CompareFunctions(HLSLTree* tree, const HLSLFunctionCall* call, const HLSLFunction* function1, const HLSLFunction* function2)
 { 
 
-	int* function1Ranks = static_cast<int*>(alloca(sizeof(int) * call->numArguments));
-	int* function2Ranks = static_cast<int*>(alloca(sizeof(int) * call->numArguments));
+	// Calls rarely have more than a few arguments, so the ranks fit inline.
+	SmallArray<int, 8> ranks1(tree->GetAllocator());
+	SmallArray<int, 8> ranks2(tree->GetAllocator());
+	ranks1.Resize(call->numArguments);
+	ranks2.Resize(call->numArguments);
+
+	int* function1Ranks = call->numArguments > 0 ? &ranks1[0] : NULL;
+	int* function2Ranks = call->numArguments > 0 ? &ranks2[0] : NULL;
 
 	const bool function1Viable = GetFunctionCallCastRanks(tree, call, function1, function1Ranks);
 	const bool function2Viable = GetFunctionCallCastRanks(tree, call, function2, function2Ranks);
@@ -1222,25 +1228,71 @@ static bool GetBinaryOpResultType(HLSLBinaryOp binaryOp, const HLSLType& type1,
 
 HLSLParser::HLSLParser(Allocator* allocator, Logger* logger, const char* fileName, const char* buffer, size_t length) : 
 	m_tokenizer(logger, fileName, buffer, length),
+	m_tokenBuffer(allocator),
 	m_userTypes(allocator),
 	m_variables(allocator),
 	m_buffers(allocator),
-	m_functions(allocator)
+	m_functions(allocator),
+	m_externalVariables(allocator)
+{
+	m_numGlobals = 0;
+	m_tree = NULL;
+}
+
+void HLSLParser::Reset(const char* fileName, const char* buffer, size_t length)
 {
+	m_tokenizer.Reset(fileName, buffer, length);
+	m_tokens = NULL;
+	m_userTypes.Clear();
+	m_variables.Clear();
+	m_externalVariables.Clear();
+	m_buffers.Clear();
+	m_functions.Clear();
 	m_numGlobals = 0;
 	m_tree = NULL;
 }
 
+void HLSLParser::Reset(const char* fileName, HLSLSourceStream* stream)
+{
+	Reset(fileName, NULL, 0);
+	m_tokenizer.Reset(fileName, stream);
+}
+
+bool HLSLParser::ResetFromFile(const char* fileName)
+{
+	if (!m_file.Open(fileName))
+	{
+		Reset(fileName, "", 0);
+		m_tokenizer.Error("Couldn't read the file");
+		return false;
+	}
+	Reset(fileName, m_file.GetData(), m_file.GetSize());
+	return true;
+}
+
 bool HLSLParser::Accept(int token)
 {
 	if (m_tokenizer.GetToken() == token)
 	{
 	   m_tokenizer.Next();
+	   CheckMemoryBudget();
 	   return true;
 	}
 	return false;
 }
 
+bool HLSLParser::CheckMemoryBudget()
+{
+	// Reporting an error makes the tokenizer return the end of the stream, so
+	// the parse unwinds without allocating much more.
+	if (m_memoryBudget != NULL && m_memoryBudget->GetIsExhausted())
+	{
+		m_tokenizer.Error("Shader exceeds the memory budget of %u bytes", (unsigned int)m_memoryBudget->GetBudget());
+		return false;
+	}
+	return true;
+}
+
 HLSLBaseType HLSLParser::GetTypeFromString(const std::string& name)
 {
 	HLSLBaseType type = TokenToBaseType(M4::HLSLTokenizer::GetTokenID(name.c_str()));
@@ -1251,9 +1303,10 @@ HLSLBaseType HLSLParser::GetTypeFromString(const std::string& name)
 
 bool HLSLParser::Accept(const char* token)
 {
-	if (m_tokenizer.GetToken() == HLSLToken_Identifier && String_Equal( token, m_tokenizer.GetIdentifier() ) )
+	if (m_tokenizer.GetIsIdentifier(token))
 	{
 		m_tokenizer.Next();
+		CheckMemoryBudget();
 		return true;
 	}
 	return false;
@@ -1291,7 +1344,7 @@ bool HLSLParser::AcceptIdentifier(const char*& identifier)
 {
 	if (m_tokenizer.GetToken() == HLSLToken_Identifier)
 	{
-		identifier = m_tree->AddString( m_tokenizer.GetIdentifier() );
+		identifier = m_tree->AddString( m_tokenizer.GetIdentifierStart(), m_tokenizer.GetIdentifierLength(), m_tokenizer.GetIdentifierHash() );
 		m_tokenizer.Next();
 		return true;
 	}
@@ -1350,6 +1403,7 @@ bool HLSLParser::ParseTopLevel(HLSLStatement*& statement)
 	ParseAttributeBlock(attributes);
 
 	int line             = GetLineNumber();
+	unsigned int offset  = GetOffset();
 	const char* fileName = GetFileName();
 	
 	HLSLType type;
@@ -1379,7 +1433,7 @@ bool HLSLParser::ParseTopLevel(HLSLStatement*& statement)
 			return false;
 		}
 
-		HLSLStruct* structure = m_tree->AddNode<HLSLStruct>(fileName, line);
+		HLSLStruct* structure = m_tree->AddNode<HLSLStruct>(fileName, line, offset);
 		structure->name = structName;
 
 		m_userTypes.PushBack(structure);
@@ -1416,7 +1470,7 @@ bool HLSLParser::ParseTopLevel(HLSLStatement*& statement)
 	{
 		// cbuffer/tbuffer declaration.
 
-		HLSLBuffer* buffer = m_tree->AddNode<HLSLBuffer>(fileName, line);
+		HLSLBuffer* buffer = m_tree->AddNode<HLSLBuffer>(fileName, line, offset);
 		AcceptIdentifier(buffer->name);
 
 		// Optional register assignment.
@@ -1485,7 +1539,7 @@ bool HLSLParser::ParseTopLevel(HLSLStatement*& statement)
 		{
 			// Function declaration.
 
-			HLSLFunction* function = m_tree->AddNode<HLSLFunction>(fileName, line);
+			HLSLFunction* function = m_tree->AddNode<HLSLFunction>(fileName, line, offset);
 			function->name                  = globalName;
 			function->returnType.baseType   = type.baseType;
 			function->returnType.typeName   = type.typeName;
@@ -1527,6 +1581,13 @@ bool HLSLParser::ParseTopLevel(HLSLStatement*& statement)
 					return false;
 				}
 
+				// The prelude is shared, so its declarations can't be linked to a definition.
+				if (GetIsPreludeFunction(declaration))
+				{
+					m_tokenizer.Error("Function '%s' is declared in the prelude and must be defined there", globalName);
+					return false;
+				}
+
 				const_cast<HLSLFunction*>(declaration)->forward = function;
 			}
 			else
@@ -1549,7 +1610,7 @@ bool HLSLParser::ParseTopLevel(HLSLStatement*& statement)
 		else
 		{
 			// Uniform declaration.
-			HLSLDeclaration* declaration = m_tree->AddNode<HLSLDeclaration>(fileName, line);
+			HLSLDeclaration* declaration = m_tree->AddNode<HLSLDeclaration>(fileName, line, offset);
 			declaration->name            = globalName;
 			declaration->type            = type;
 			
@@ -1682,13 +1743,14 @@ bool HLSLParser::ParseBlock(HLSLStatement*& firstStatement, const HLSLType& retu
 			while (lastStatement->nextStatement) lastStatement = lastStatement->nextStatement;
 		}
 	}
-	return true;
+	return CheckMemoryBudget();
 }
 
 bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& returnType)
 {
 	const char* fileName = GetFileName();
 	int         line     = GetLineNumber();
+	unsigned int offset  = GetOffset();
 
 	// Empty statements.
 	if (Accept(';'))
@@ -1705,7 +1767,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	{
 		if (Accept(HLSLToken_If))
 		{
-			//HLSLIfStatement* ifStatement = m_tree->AddNode<HLSLIfStatement>(fileName, line);
+			//HLSLIfStatement* ifStatement = m_tree->AddNode<HLSLIfStatement>(fileName, line, offset);
 			//ifStatement->isStatic = true;
 			//ifStatement->attributes = attributes;
 			
@@ -1770,7 +1832,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	// If statement.
 	if (Accept(HLSLToken_If))
 	{
-		HLSLIfStatement* ifStatement = m_tree->AddNode<HLSLIfStatement>(fileName, line);
+		HLSLIfStatement* ifStatement = m_tree->AddNode<HLSLIfStatement>(fileName, line, offset);
 		ifStatement->attributes = attributes;
 		if (!Expect('(') || !ParseExpression(ifStatement->condition) || !Expect(')'))
 		{
@@ -1791,7 +1853,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	// For statement.
 	if (Accept(HLSLToken_For))
 	{
-		HLSLForStatement* forStatement = m_tree->AddNode<HLSLForStatement>(fileName, line);
+		HLSLForStatement* forStatement = m_tree->AddNode<HLSLForStatement>(fileName, line, offset);
 		forStatement->attributes = attributes;
 		if (!Expect('('))
 		{
@@ -1833,7 +1895,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	// Block statement.
 	if (Accept('{'))
 	{
-		HLSLBlockStatement* blockStatement = m_tree->AddNode<HLSLBlockStatement>(fileName, line);
+		HLSLBlockStatement* blockStatement = m_tree->AddNode<HLSLBlockStatement>(fileName, line, offset);
 		statement = blockStatement;
 		BeginScope();
 		bool success = ParseBlock(blockStatement->statement, returnType);
@@ -1844,7 +1906,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	// Discard statement.
 	if (Accept(HLSLToken_Discard))
 	{
-		HLSLDiscardStatement* discardStatement = m_tree->AddNode<HLSLDiscardStatement>(fileName, line);
+		HLSLDiscardStatement* discardStatement = m_tree->AddNode<HLSLDiscardStatement>(fileName, line, offset);
 		statement = discardStatement;
 		return Expect(';');
 	}
@@ -1852,7 +1914,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	// Break statement.
 	if (Accept(HLSLToken_Break))
 	{
-		HLSLBreakStatement* breakStatement = m_tree->AddNode<HLSLBreakStatement>(fileName, line);
+		HLSLBreakStatement* breakStatement = m_tree->AddNode<HLSLBreakStatement>(fileName, line, offset);
 		statement = breakStatement;
 		return Expect(';');
 	}
@@ -1860,7 +1922,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	// Continue statement.
 	if (Accept(HLSLToken_Continue))
 	{
-		HLSLContinueStatement* continueStatement = m_tree->AddNode<HLSLContinueStatement>(fileName, line);
+		HLSLContinueStatement* continueStatement = m_tree->AddNode<HLSLContinueStatement>(fileName, line, offset);
 		statement = continueStatement;
 		return Expect(';');
 	}
@@ -1868,7 +1930,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	// Return statement
 	if (Accept(HLSLToken_Return))
 	{
-		HLSLReturnStatement* returnStatement = m_tree->AddNode<HLSLReturnStatement>(fileName, line);
+		HLSLReturnStatement* returnStatement = m_tree->AddNode<HLSLReturnStatement>(fileName, line, offset);
 		if (!Accept(';') && !ParseExpression(returnStatement->expression))
 		{
 			return false;
@@ -1897,7 +1959,7 @@ bool HLSLParser::ParseStatement(HLSLStatement*& statement, const HLSLType& retur
 	else if (ParseExpression(expression))
 	{
 		HLSLExpressionStatement* expressionStatement;
-		expressionStatement = m_tree->AddNode<HLSLExpressionStatement>(fileName, line);
+		expressionStatement = m_tree->AddNode<HLSLExpressionStatement>(fileName, line, offset);
 		expressionStatement->expression = expression;
 		statement = expressionStatement;
 	}
@@ -1912,6 +1974,7 @@ bool HLSLParser::ParseDeclaration(HLSLDeclaration*& declaration)
 {
 	const char* fileName    = GetFileName();
 	int         line        = GetLineNumber();
+	unsigned int offset     = GetOffset();
 
 	HLSLType type;
 	if (!AcceptType(/*allowVoid=*/false, type))
@@ -1946,7 +2009,7 @@ bool HLSLParser::ParseDeclaration(HLSLDeclaration*& declaration)
 			}
 		}
 
-		HLSLDeclaration * declaration = m_tree->AddNode<HLSLDeclaration>(fileName, line);
+		HLSLDeclaration * declaration = m_tree->AddNode<HLSLDeclaration>(fileName, line, offset);
 		declaration->type  = type;
 		declaration->name  = name;
 
@@ -1991,7 +2054,7 @@ bool HLSLParser::ParseDeclarationAssignment(HLSLDeclaration* declaration)
 
 bool HLSLParser::ParseFieldDeclaration(HLSLStructField*& field)
 {
-	field = m_tree->AddNode<HLSLStructField>( GetFileName(), GetLineNumber() );
+	field = m_tree->AddNode<HLSLStructField>( GetFileName(), GetLineNumber(), GetOffset() );
 	if (!ExpectDeclaration(false, field->type, field->name))
 	{
 		return false;
@@ -2010,7 +2073,7 @@ bool HLSLParser::ParseFieldDeclaration(HLSLStructField*& field)
 // @@ Add support for packoffset to general declarations.
 /*bool HLSLParser::ParseBufferFieldDeclaration(HLSLBufferField*& field)
 {
-	field = m_tree->AddNode<HLSLBufferField>( GetFileName(), GetLineNumber() );
+	field = m_tree->AddNode<HLSLBufferField>( GetFileName(), GetLineNumber(), GetOffset() );
 	if (AcceptDeclaration(false, field->type, field->name))
 	{
 		// Handle optional packoffset.
@@ -2059,7 +2122,7 @@ bool HLSLParser::ParseExpression(HLSLExpression*& expression)
 		{
 			return false;
 		}
-		HLSLBinaryExpression* binaryExpression = m_tree->AddNode<HLSLBinaryExpression>(expression->fileName, expression->line);
+		HLSLBinaryExpression* binaryExpression = m_tree->AddNode<HLSLBinaryExpression>(expression->fileName, expression->line, expression->offset);
 		binaryExpression->binaryOp = assignOp;
 		binaryExpression->expression1 = expression;
 		binaryExpression->expression2 = expression2;
@@ -2184,6 +2247,7 @@ bool HLSLParser::ParseBinaryExpression(int priority, HLSLExpression*& expression
 {
 	const char* fileName = GetFileName();
 	int         line     = GetLineNumber();
+	unsigned int offset  = GetOffset();
 
 	bool needsEndParen;
 
@@ -2208,7 +2272,7 @@ bool HLSLParser::ParseBinaryExpression(int priority, HLSLExpression*& expression
 			{
 				return false;
 			}
-			HLSLBinaryExpression* binaryExpression = m_tree->AddNode<HLSLBinaryExpression>(fileName, line);
+			HLSLBinaryExpression* binaryExpression = m_tree->AddNode<HLSLBinaryExpression>(fileName, line, offset);
 			binaryExpression->binaryOp    = binaryOp;
 			binaryExpression->expression1 = expression;
 			binaryExpression->expression2 = expression2;
@@ -2230,7 +2294,7 @@ bool HLSLParser::ParseBinaryExpression(int priority, HLSLExpression*& expression
 		else if (_conditionalOpPriority > priority && Accept('?'))
 		{
 
-			HLSLConditionalExpression* conditionalExpression = m_tree->AddNode<HLSLConditionalExpression>(fileName, line);
+			HLSLConditionalExpression* conditionalExpression = m_tree->AddNode<HLSLConditionalExpression>(fileName, line, offset);
 			conditionalExpression->condition = expression;
 			
 			HLSLExpression* expression1 = NULL;
@@ -2275,8 +2339,9 @@ bool HLSLParser::ParsePartialConstructor(HLSLExpression*& expression, HLSLBaseTy
 {
 	const char* fileName = GetFileName();
 	int         line     = GetLineNumber();
+	unsigned int offset  = GetOffset();
 
-	HLSLConstructorExpression* constructorExpression = m_tree->AddNode<HLSLConstructorExpression>(fileName, line);
+	HLSLConstructorExpression* constructorExpression = m_tree->AddNode<HLSLConstructorExpression>(fileName, line, offset);
 	constructorExpression->type.baseType = type;
 	constructorExpression->type.typeName = typeName;
 	int numArguments = 0;
@@ -2294,13 +2359,14 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 {
 	const char* fileName = GetFileName();
 	int         line     = GetLineNumber();
+	unsigned int offset  = GetOffset();
 
 	needsEndParen = false;
 
 	HLSLUnaryOp unaryOp;
 	if (AcceptUnaryOperator(true, unaryOp))
 	{
-		HLSLUnaryExpression* unaryExpression = m_tree->AddNode<HLSLUnaryExpression>(fileName, line);
+		HLSLUnaryExpression* unaryExpression = m_tree->AddNode<HLSLUnaryExpression>(fileName, line, offset);
 		unaryExpression->unaryOp = unaryOp;
 		if (!ParseTerminalExpression(unaryExpression->expression, needsEndParen))
 		{
@@ -2344,7 +2410,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 				needsEndParen = true;
 				return ParsePartialConstructor(expression, type.baseType, type.typeName);
 			}
-			HLSLCastingExpression* castingExpression = m_tree->AddNode<HLSLCastingExpression>(fileName, line);
+			HLSLCastingExpression* castingExpression = m_tree->AddNode<HLSLCastingExpression>(fileName, line, offset);
 			castingExpression->type = type;
 			expression = castingExpression;
 			castingExpression->expressionType = type;
@@ -2364,7 +2430,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		
 		if (AcceptFloat(fValue))
 		{
-			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line);
+			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line, offset);
 			literalExpression->type   = HLSLBaseType_Float;
 			literalExpression->fValue = fValue;
 			literalExpression->expressionType.baseType = literalExpression->type;
@@ -2374,7 +2440,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		}
 		if( AcceptHalf( fValue ) )
 		{
-			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>( fileName, line );
+			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line, offset);
 			literalExpression->type = HLSLBaseType_Half;
 			literalExpression->fValue = fValue;
 			literalExpression->expressionType.baseType = literalExpression->type;
@@ -2384,7 +2450,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		}
 		else if (AcceptInt(iValue))
 		{
-			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line);
+			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line, offset);
 			literalExpression->type   = HLSLBaseType_Int;
 			literalExpression->iValue = iValue;
 			literalExpression->expressionType.baseType = literalExpression->type;
@@ -2394,7 +2460,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		}
 		else if (Accept(HLSLToken_True))
 		{
-			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line);
+			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line, offset);
 			literalExpression->type   = HLSLBaseType_Bool;
 			literalExpression->bValue = true;
 			literalExpression->expressionType.baseType = literalExpression->type;
@@ -2404,7 +2470,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		}
 		else if (Accept(HLSLToken_False))
 		{
-			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line);
+			HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line, offset);
 			literalExpression->type   = HLSLBaseType_Bool;
 			literalExpression->bValue = false;
 			literalExpression->expressionType.baseType = literalExpression->type;
@@ -2425,7 +2491,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		}
 		else
 		{
-			HLSLIdentifierExpression* identifierExpression = m_tree->AddNode<HLSLIdentifierExpression>(fileName, line);
+			HLSLIdentifierExpression* identifierExpression = m_tree->AddNode<HLSLIdentifierExpression>(fileName, line, offset);
 			if (!ExpectIdentifier(identifierExpression->name))
 			{
 				return false;
@@ -2461,7 +2527,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 			{
 				if (m_allowUndeclaredIdentifiers)
 				{
-					HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line);
+					HLSLLiteralExpression* literalExpression = m_tree->AddNode<HLSLLiteralExpression>(fileName, line, offset);
 					literalExpression->bValue = false;
 					literalExpression->type = HLSLBaseType_Bool;
 					literalExpression->expressionType.baseType = literalExpression->type;
@@ -2489,7 +2555,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		HLSLUnaryOp unaryOp;
 		while (AcceptUnaryOperator(false, unaryOp))
 		{
-			HLSLUnaryExpression* unaryExpression = m_tree->AddNode<HLSLUnaryExpression>(fileName, line);
+			HLSLUnaryExpression* unaryExpression = m_tree->AddNode<HLSLUnaryExpression>(fileName, line, offset);
 			unaryExpression->unaryOp = unaryOp;
 			unaryExpression->expression = expression;
 			unaryExpression->expressionType = unaryExpression->expression->expressionType;
@@ -2509,7 +2575,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 
 			// method call
 			if (Accept('(')) {
-				HLSLMethodCall* methodCall = m_tree->AddNode<HLSLMethodCall>(fileName, line);
+				HLSLMethodCall* methodCall = m_tree->AddNode<HLSLMethodCall>(fileName, line, offset);
 				methodCall->object = expression;
 
 				if (!ParseExpressionList(')', false, methodCall->argument, methodCall->numArguments))
@@ -2528,7 +2594,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 			}
 			// member access
 			else {
-				HLSLMemberAccess* memberAccess = m_tree->AddNode<HLSLMemberAccess>(fileName, line);
+				HLSLMemberAccess* memberAccess = m_tree->AddNode<HLSLMemberAccess>(fileName, line, offset);
 				memberAccess->object = expression;
 				memberAccess->field = memberAccessFieldName;
 
@@ -2546,7 +2612,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		// Handle array access.
 		while (Accept('['))
 		{
-			HLSLArrayAccess* arrayAccess = m_tree->AddNode<HLSLArrayAccess>(fileName, line);
+			HLSLArrayAccess* arrayAccess = m_tree->AddNode<HLSLArrayAccess>(fileName, line, offset);
 			arrayAccess->array = expression;
 			if (!ParseExpression(arrayAccess->index) || !Expect(']'))
 			{
@@ -2633,7 +2699,7 @@ bool HLSLParser::ParseTerminalExpression(HLSLExpression*& expression, bool& need
 		// expression.
 		if (Accept('('))
 		{
-			HLSLFunctionCall* functionCall = m_tree->AddNode<HLSLFunctionCall>(fileName, line);
+			HLSLFunctionCall* functionCall = m_tree->AddNode<HLSLFunctionCall>(fileName, line, offset);
 			done = false;
 			if (!ParseExpressionList(')', false, functionCall->argument, functionCall->numArguments))
 			{
@@ -2706,6 +2772,7 @@ bool HLSLParser::ParseArgumentList(HLSLArgument*& firstArgument, int& numArgumen
 {
 	const char* fileName = GetFileName();
 	int         line     = GetLineNumber();
+	unsigned int offset  = GetOffset();
 		
 	HLSLArgument* lastArgument = NULL;
 	numArguments = 0;
@@ -2721,7 +2788,7 @@ bool HLSLParser::ParseArgumentList(HLSLArgument*& firstArgument, int& numArgumen
 			return false;
 		}
 
-		HLSLArgument* argument = m_tree->AddNode<HLSLArgument>(fileName, line);
+		HLSLArgument* argument = m_tree->AddNode<HLSLArgument>(fileName, line, offset);
 
 		if (Accept(HLSLToken_Uniform))     { argument->modifier = HLSLArgumentModifier_Uniform; }
 		else if (Accept(HLSLToken_In))     { argument->modifier = HLSLArgumentModifier_In;      }
@@ -2772,11 +2839,12 @@ bool HLSLParser::ParseSamplerState(const char*& registerName)
 {
 	const char* fileName = GetFileName();
 	int         line     = GetLineNumber();
+	unsigned int offset  = GetOffset();
 
 
 	if (Accept('{'))
 	{
-		HLSLSamplerState* samplerState = m_tree->AddNode<HLSLSamplerState>(fileName, line);
+		HLSLSamplerState* samplerState = m_tree->AddNode<HLSLSamplerState>(fileName, line, offset);
 		HLSLStateAssignment* lastStateAssignment = NULL;
 
 		// Parse state assignments.
@@ -2991,8 +3059,9 @@ bool HLSLParser::ParseSamplerStateAssignment(HLSLStateAssignment*& stateAssignme
 {
 	const char* fileName = GetFileName();
 	int         line     = GetLineNumber();
+	unsigned int offset  = GetOffset();
 
-	stateAssignment = m_tree->AddNode<HLSLStateAssignment>(fileName, line);
+	stateAssignment = m_tree->AddNode<HLSLStateAssignment>(fileName, line, offset);
 
 	const EffectState * state;
 	if (!ParseSamplerStateName(state)) {
@@ -3022,6 +3091,7 @@ bool HLSLParser::ParseAttributeList(HLSLAttribute*& firstAttribute)
 {
 	const char* fileName = GetFileName();
 	int         line     = GetLineNumber();
+	unsigned int offset  = GetOffset();
 	
 	HLSLAttribute * lastAttribute = firstAttribute;
 	do {
@@ -3030,7 +3100,7 @@ bool HLSLParser::ParseAttributeList(HLSLAttribute*& firstAttribute)
 			return false;
 		}
 
-		HLSLAttribute * attribute = m_tree->AddNode<HLSLAttribute>(fileName, line);
+		HLSLAttribute * attribute = m_tree->AddNode<HLSLAttribute>(fileName, line, offset);
 		
 		if (String_Equal(identifier, "unroll")) attribute->attributeType = HLSLAttributeType_Unroll;
 		else if (String_Equal(identifier, "flatten")) attribute->attributeType = HLSLAttributeType_Flatten;
@@ -3099,6 +3169,50 @@ bool HLSLParser::ParseAttributeBlock(HLSLAttribute*& attribute)
 bool HLSLParser::Parse(HLSLTree* tree)
 {
 	m_tree = tree;
+
+	if (m_prelude != NULL)
+	{
+		if (tree->GetSharedStringPool() == NULL || tree->GetSharedStringPool() != m_prelude->m_tree.GetSharedStringPool())
+		{
+			m_tokenizer.Error("The tree doesn't use the string pool of the prelude");
+			return false;
+		}
+		tree->SetPrelude(const_cast<HLSLTree*>(&m_prelude->m_tree));
+
+		// Only the pointers are copied, the declarations stay in the prelude.
+		for (int i = 0; i < m_prelude->m_userTypes.GetSize(); ++i)
+		{
+			m_userTypes.PushBack(m_prelude->m_userTypes[i]);
+		}
+		for (int i = 0; i < m_prelude->m_buffers.GetSize(); ++i)
+		{
+			m_buffers.PushBack(m_prelude->m_buffers[i]);
+		}
+		for (int i = 0; i < m_prelude->m_functions.GetSize(); ++i)
+		{
+			m_functions.PushBack(m_prelude->m_functions[i]);
+		}
+		ASSERT(m_variables.GetSize() == m_numGlobals);
+		for (int i = 0; i < m_prelude->m_variables.GetSize(); ++i)
+		{
+			m_variables.PushBack(m_prelude->m_variables[i]);
+			++m_numGlobals;
+		}
+	}
+
+	for (int i = 0; i < m_externalVariables.GetSize(); ++i)
+	{
+		DeclareVariable(m_tree->AddString(m_externalVariables[i].name), m_externalVariables[i].type);
+	}
+
+	if (m_tokens != NULL && !m_tokenizer.GetIsTokenized())
+	{
+		m_tokenizer.SetTokens(m_tokens);
+	}
+	if ((m_preTokenize || m_numLexThreads > 1) && !m_tokenizer.GetIsTokenized())
+	{
+		m_tokenizer.Tokenize(&m_tokenBuffer, m_numLexThreads);
+	}
 	
 	HLSLRoot* root = m_tree->GetRoot();
 	HLSLStatement* lastStatement = NULL;
@@ -3124,6 +3238,52 @@ bool HLSLParser::Parse(HLSLTree* tree)
 			while (lastStatement->nextStatement) lastStatement = lastStatement->nextStatement;
 		}
 	}
+	return CheckMemoryBudget();
+}
+
+HLSLPrelude::HLSLPrelude(Allocator* allocator, SharedStringPool* sharedStrings) :
+	m_tree(allocator, sharedStrings),
+	m_userTypes(allocator),
+	m_variables(allocator),
+	m_buffers(allocator),
+	m_functions(allocator)
+{
+	m_hash = 0;
+}
+
+bool HLSLPrelude::Parse(Logger* logger, const char* fileName, const char* buffer, size_t length)
+{
+	m_tree.Reset();
+	m_userTypes.Clear();
+	m_variables.Clear();
+	m_buffers.Clear();
+	m_functions.Clear();
+	m_hash = String_Hash64(buffer, length, String_Hash64(fileName, strlen(fileName) + 1));
+
+	HLSLParser parser(m_tree.GetAllocator(), logger, fileName, buffer, length);
+	if (!parser.Parse(&m_tree))
+	{
+		return false;
+	}
+
+	// Every scope is closed at the end of the source, so the variables left are the globals.
+	ASSERT(parser.m_variables.GetSize() == parser.m_numGlobals);
+	for (int i = 0; i < parser.m_userTypes.GetSize(); ++i)
+	{
+		m_userTypes.PushBack(parser.m_userTypes[i]);
+	}
+	for (int i = 0; i < parser.m_variables.GetSize(); ++i)
+	{
+		m_variables.PushBack(parser.m_variables[i]);
+	}
+	for (int i = 0; i < parser.m_buffers.GetSize(); ++i)
+	{
+		m_buffers.PushBack(parser.m_buffers[i]);
+	}
+	for (int i = 0; i < parser.m_functions.GetSize(); ++i)
+	{
+		m_functions.PushBack(parser.m_functions[i]);
+	}
 	return true;
 }
 
@@ -3336,7 +3496,7 @@ bool HLSLParser::AcceptType(bool allowVoid, HLSLType& type/*, bool acceptFlags*/
 	}
 	if (token == HLSLToken_Identifier)
 	{
-		const char* identifier = m_tree->AddString( m_tokenizer.GetIdentifier() );
+		const char* identifier = m_tree->AddString( m_tokenizer.GetIdentifierStart(), m_tokenizer.GetIdentifierLength(), m_tokenizer.GetIdentifierHash() );
 		if (FindUserDefinedType(identifier) != NULL)
 		{
 			m_tokenizer.Next();
@@ -3432,6 +3592,11 @@ int HLSLParser::GetLineNumber() const
 	return m_tokenizer.GetLineNumber();
 }
 
+unsigned int HLSLParser::GetOffset() const
+{
+	return m_tokenizer.GetOffset();
+}
+
 const char* HLSLParser::GetFileName()
 {
 	return m_tree->AddString( m_tokenizer.GetFileName() );
@@ -3439,15 +3604,15 @@ const char* HLSLParser::GetFileName()
 
 void HLSLParser::BeginScope()
 {
-	// Use NULL as a sentinel that indices a new scope level.
+	// Use InvalidStringId as a sentinel that indices a new scope level.
 	Variable& variable = m_variables.PushBackNew();
-	variable.name = NULL;
+	variable.name = InvalidStringId;
 }
 
 void HLSLParser::EndScope()
 {
 	int numVariables = m_variables.GetSize() - 1;
-	while (m_variables[numVariables].name != NULL)
+	while (m_variables[numVariables].name != InvalidStringId)
 	{
 		--numVariables;
 		ASSERT(numVariables >= 0);
@@ -3457,12 +3622,11 @@ void HLSLParser::EndScope()
 
 const HLSLType* HLSLParser::FindVariable(const char* name, bool& global) const
 {
+	// The name comes from the string pool, so we can compare ids.
+	StringId id = m_tree->GetStringId(name);
 	for (int i = m_variables.GetSize() - 1; i >= 0; --i)
 	{
-		if (m_variables[i].name == nullptr)
-			continue;
-
-		if (String_Equal(m_variables[i].name, name))
+		if (m_variables[i].name == id)
 		{
 			global = (i < m_numGlobals);
 			return &m_variables[i].type;
@@ -3522,14 +3686,47 @@ const HLSLFunction* HLSLParser::FindFunction(const HLSLFunction* fun) const
 	return NULL;
 }
 
+void HLSLParser::AddOptions(HLSLDependencyManifest* manifest) const
+{
+	if (m_prelude != NULL)
+	{
+		char hash[32];
+		String_Printf(hash, sizeof(hash), "%016llx", m_prelude->GetHash());
+		manifest->AddOption("prelude", hash);
+	}
+}
+
+bool HLSLParser::GetIsPreludeFunction(const HLSLFunction* function) const
+{
+	if (m_prelude != NULL)
+	{
+		for (int i = 0; i < m_prelude->m_functions.GetSize(); ++i)
+		{
+			if (m_prelude->m_functions[i] == function)
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
 void HLSLParser::DeclareVariable(const char* name, const HLSLType& type)
 {
+	if (m_tree == NULL)
+	{
+		// Declared before parsing, the name is added to the string pool of the tree by Parse.
+		ExternalVariable& variable = m_externalVariables.PushBackNew();
+		variable.name = name;
+		variable.type = type;
+		return;
+	}
 	if (m_variables.GetSize() == m_numGlobals)
 	{
 		++m_numGlobals;
 	}
 	Variable& variable = m_variables.PushBackNew();
-	variable.name = name;
+	variable.name = m_tree->AddStringId(name);
 	variable.type = type;
 }
 
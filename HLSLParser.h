@@ -12,6 +12,7 @@
 
 #include "Engine.h"
 
+#include "HLSLDependencyManifest.h"
 #include "HLSLTokenizer.h"
 #include "HLSLTree.h"
 
@@ -21,6 +22,7 @@ namespace M4
 {
 
 struct EffectState;
+class HLSLPrelude;
 
 class HLSLParser
 {
@@ -29,8 +31,53 @@ public:
 
     HLSLParser(Allocator* allocator, Logger* logger, const char* fileName, const char* buffer, size_t length);
 
+    /** Points the parser at a new buffer. The declarations from the previous parse
+    are dropped, but the memory used to track them is kept. */
+    void Reset(const char* fileName, const char* buffer, size_t length);
+
+    /** Same as Reset, but reads the source from a file, which is memory mapped when
+    possible. The file stays open until the next ResetFromFile or until the parser
+    is destroyed; the tree doesn't reference it once Parse returns. Returns false
+    and reports an error if the file can't be read. */
+    bool ResetFromFile(const char* fileName);
+
+    /** Same as Reset, but reads the source from a stream. Streams are never
+    tokenized ahead, regardless of SetPreTokenize. */
+    void Reset(const char* fileName, HLSLSourceStream* stream);
+
     bool Parse(HLSLTree* tree);
 
+    /** Makes Parse fail with an error once the budget is exhausted. The tree and
+    the parser should both allocate through the budget. Pass NULL to disable. */
+    void SetMemoryBudget(const BudgetAllocator* budget) { m_memoryBudget = budget; }
+
+    /** When enabled, Parse tokenizes the whole buffer before parsing it. */
+    void SetPreTokenize(bool preTokenize) { m_preTokenize = preTokenize; }
+
+    /** Number of threads used to tokenize large buffers ahead. Implies SetPreTokenize,
+    and the allocator must be thread safe. */
+    void SetNumLexThreads(int numThreads) { m_numLexThreads = numThreads; }
+
+    /** Makes Parse walk the tokens instead of lexing the buffer, which must be the
+    text they were made from, like HLSLPreprocessor::GetTokens for its output. The
+    tokens are dropped by Reset. */
+    void SetTokens(const HLSLTokenBuffer* tokens) { m_tokens = tokens; }
+
+    /** Makes Parse start from the declarations of the prelude, as if they were at
+    the top of the source. The tree must use the shared string pool of the prelude.
+    Pass NULL to disable. */
+    void SetPrelude(const HLSLPrelude* prelude) { m_prelude = prelude; }
+
+    /** Adds the options that change the tree to the manifest. Threads, budgets and
+    pretokenizing don't change it, so they are left out of the key. */
+    void AddOptions(HLSLDependencyManifest* manifest) const;
+
+    /** Fills the index with the lines of the source, so that the offsets stored in
+    the nodes can be mapped to lines and columns. See HLSLTokenizer::SetLineIndex. */
+    void SetLineIndex(HLSLLineIndex* lineIndex) { m_tokenizer.SetLineIndex(lineIndex); }
+
+    /** Declares a global variable. Before Parse, the name is only copied into the
+    tree by Parse, so it must stay valid until then. */
     void DeclareVariable(const char* name, const HLSLType& type);
     static HLSLBaseType GetTypeFromString(const std::string& name);
 
@@ -96,17 +143,20 @@ private:
     bool ParseAttributeBlock(HLSLAttribute*& attribute);
 
     bool CheckForUnexpectedEndOfStream(int endToken);
+    bool CheckMemoryBudget();
 
     const HLSLStruct* FindUserDefinedType(const char* name) const;
 
     void BeginScope();
     void EndScope();
     
-    /** Returned pointer is only valid until Declare or Begin/EndScope is called. */
+    /** Returned pointer is only valid until Declare or Begin/EndScope is called. The
+    name must come from the string pool of the tree, variables are found by id. */
     const HLSLType* FindVariable(const char* name, bool& global) const;
 
     const HLSLFunction* FindFunction(const char* name) const;
     const HLSLFunction* FindFunction(const HLSLFunction* fun) const;
+    bool GetIsPreludeFunction(const HLSLFunction* function) const;
 
     bool GetIsFunction(const char* name) const;
     const HLSLBuffer* FindBuffer(const char* name) const;
@@ -122,28 +172,90 @@ private:
 
     const char* GetFileName();
     int GetLineNumber() const;
+    unsigned int GetOffset() const;
 
 private:
 
+    friend class HLSLPrelude;
+
     struct Variable
+    {
+        StringId        name;
+        HLSLType        type;
+    };
+
+    struct ExternalVariable
     {
         const char*     name;
         HLSLType        type;
     };
 
-    HLSLTokenizer           m_tokenizer;
-    Array<HLSLStruct*>      m_userTypes;
-    Array<Variable>         m_variables;
-    Array<HLSLBuffer*>      m_buffers;
-    Array<HLSLFunction*>    m_functions;
+    MappedFile                          m_file;
+    HLSLTokenizer                       m_tokenizer;
+    HLSLTokenBuffer                     m_tokenBuffer;
+
+    // Most shaders declare few types and functions, keep them inline so that
+    // parsing a small shader doesn't touch the allocator.
+    SmallArray<HLSLStruct*, 16>         m_userTypes;
+    SmallArray<Variable, 64>            m_variables;
+    SmallArray<HLSLBuffer*, 8>          m_buffers;
+    SmallArray<HLSLFunction*, 32>       m_functions;
+    Array<ExternalVariable>             m_externalVariables;    // Declared before Parse.
     int                     m_numGlobals;
 
     HLSLTree*               m_tree;
+    const BudgetAllocator*  m_memoryBudget = NULL;
+    const HLSLPrelude*      m_prelude = NULL;
+    const HLSLTokenBuffer*  m_tokens = NULL;
+    bool                    m_preTokenize = false;
+    int                     m_numLexThreads = 1;
     
     bool                    m_allowUndeclaredIdentifiers = false;
     bool                    m_disableSemanticValidation = false;
 };
 
+/**
+ * Declarations parsed once and shared by many shaders, like a precompiled header.
+ * Parsers started from the prelude only parse the code of the shader, and find the
+ * structs, buffers, functions and globals of the prelude through a snapshot of the
+ * symbol tables. The tree and the snapshot are never modified once Parse returns,
+ * so the prelude can be used by parsers on several threads.
+ */
+class HLSLPrelude
+{
+
+public:
+
+    /** The trees of the shaders must use the same shared string pool, since names
+    are compared by pointer. */
+    HLSLPrelude(Allocator* allocator, SharedStringPool* sharedStrings);
+
+    /** Parses the declarations, dropping the previous ones. Must not be called while
+    parsers use the prelude. */
+    bool Parse(Logger* logger, const char* fileName, const char* buffer, size_t length);
+
+    const HLSLTree* GetTree() const { return &m_tree; }
+
+    /** String_Hash64 of the file name and the source of the prelude. */
+    unsigned long long GetHash() const { return m_hash; }
+
+private:
+
+    friend class HLSLParser;
+
+    // Not copyable.
+    HLSLPrelude(const HLSLPrelude&);
+    void operator=(const HLSLPrelude&);
+
+    HLSLTree                        m_tree;
+    Array<HLSLStruct*>              m_userTypes;
+    Array<HLSLParser::Variable>     m_variables;    // Globals only.
+    Array<HLSLBuffer*>              m_buffers;
+    Array<HLSLFunction*>            m_functions;
+    unsigned long long              m_hash;
+
+};
+
 }
 
 #endif
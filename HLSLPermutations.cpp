@@ -0,0 +1,650 @@
+#include "Engine.h"
+
+#include "HLSLPermutations.h"
+
+#include <string.h>
+
+namespace M4
+{
+
+// Errors of the attempts that fall back to a full parse are not reported.
+static void LogNothing(void* /*userData*/, const char* /*format*/, ...)
+{
+}
+
+static void LogNothingArgList(void* /*userData*/, const char* /*format*/, va_list /*args*/)
+{
+}
+
+static Logger _silentLogger = { NULL, LogNothing, LogNothingArgList };
+
+HLSLPermutations::HLSLPermutations(Allocator* allocator, Logger* logger, FileReadCallback readFile, HLSLIncludeCache* cache) :
+    m_includeCache(allocator),
+    m_strings(allocator),
+    m_names(allocator),
+    m_values(allocator),
+    m_permutations(allocator),
+    m_text(allocator),
+    m_sources(allocator),
+    m_declarations(allocator),
+    m_identifiers(allocator),
+    m_table(allocator),
+    m_trees(allocator),
+    m_prelude(allocator, &m_strings)
+{
+    m_allocator     = allocator;
+    m_logger        = logger;
+    m_readFile      = readFile;
+    m_cache         = (cache != NULL) ? cache : &m_includeCache;
+    m_preludeLength = 0;
+    m_usePrelude    = true;
+}
+
+HLSLPermutations::~HLSLPermutations()
+{
+    Clear();
+}
+
+int HLSLPermutations::AddPermutation()
+{
+    Permutation& permutation = m_permutations.PushBackNew();
+    permutation.firstDefine = m_names.GetSize();
+    permutation.numDefines  = 0;
+    permutation.source      = -1;
+    return m_permutations.GetSize() - 1;
+}
+
+void HLSLPermutations::Define(const char* name, const char* value)
+{
+    ASSERT(m_permutations.GetSize() > 0);
+    m_names.PushBack(m_strings.AddString(name));
+    m_values.PushBack(m_strings.AddString(value));
+    ++m_permutations[m_permutations.GetSize() - 1].numDefines;
+}
+
+HLSLTree* HLSLPermutations::GetTree(int permutation) const
+{
+    int source = m_permutations[permutation].source;
+    return (source >= 0) ? m_trees[source] : NULL;
+}
+
+void HLSLPermutations::Clear()
+{
+    for (int i = 0; i < m_trees.GetSize(); ++i)
+    {
+        if (m_trees[i] != NULL)
+        {
+            m_trees[i]->~HLSLTree();
+            m_allocator->Delete(m_allocator->m_userData, m_trees[i]);
+        }
+    }
+    m_trees.Clear();
+    m_sources.Clear();
+    m_declarations.Clear();
+    m_identifiers.Clear();
+    m_table.Clear();
+    m_text.Clear();
+    m_preludeLength = 0;
+}
+
+bool HLSLPermutations::Build(const char* fileName, const char* buffer, size_t length)
+{
+    Clear();
+    bool result = true;
+
+    // Without a cache of the caller, the files may have changed since the last build.
+    m_includeCache.Clear();
+
+    // Preprocess every permutation, and keep each different source once.
+    HLSLPreprocessor preprocessor(m_allocator, m_logger, m_readFile, m_cache);
+    for (int i = 0; i < m_permutations.GetSize(); ++i)
+    {
+        Permutation& permutation = m_permutations[i];
+        permutation.source = -1;
+
+        preprocessor.Reset();
+        for (int j = 0; j < permutation.numDefines; ++j)
+        {
+            preprocessor.Define(m_names[permutation.firstDefine + j], m_values[permutation.firstDefine + j]);
+        }
+        if (!preprocessor.Preprocess(fileName, buffer, length))
+        {
+            result = false;
+            continue;
+        }
+
+        const char*  text       = preprocessor.GetOutput();
+        size_t       textLength = preprocessor.GetOutputLength();
+        unsigned int hash       = String_Hash(text, textLength);
+        for (int j = 0; j < m_sources.GetSize(); ++j)
+        {
+            const Source& source = m_sources[j];
+            if (source.hash == hash && source.length == textLength && memcmp(&m_text[(int)source.offset], text, textLength) == 0)
+            {
+                permutation.source = j;
+                break;
+            }
+        }
+        if (permutation.source < 0)
+        {
+            Source& source = m_sources.PushBackNew();
+            source.offset = m_text.GetSize();
+            source.length = textLength;
+            source.hash   = hash;
+            source.firstDeclaration = 0;
+            source.numDeclarations  = 0;
+            m_text.Resize((int)(source.offset + textLength));
+            memcpy(&m_text[(int)source.offset], text, textLength);
+            permutation.source = m_sources.GetSize() - 1;
+        }
+    }
+
+    // The declarations that all the sources have are parsed once, in the prelude.
+    if (m_usePrelude && m_sources.GetSize() > 1)
+    {
+        for (int i = 0; i < m_sources.GetSize(); ++i)
+        {
+            SplitDeclarations(fileName, i);
+        }
+        AddDeclarationsToTable();
+        if (!ParsePrelude(fileName))
+        {
+            m_preludeLength = 0;
+        }
+    }
+
+    for (int i = 0; i < m_sources.GetSize(); ++i)
+    {
+        HLSLTree* tree = ParseSource(fileName, i);
+        if (tree == NULL)
+        {
+            result = false;
+        }
+        m_trees.PushBack(tree);
+    }
+    for (int i = 0; i < m_permutations.GetSize(); ++i)
+    {
+        if (m_permutations[i].source >= 0 && m_trees[m_permutations[i].source] == NULL)
+        {
+            m_permutations[i].source = -1;
+        }
+    }
+    return result;
+}
+
+void HLSLPermutations::SplitDeclarations(const char* fileName, int sourceIndex)
+{
+    // A declaration ends after a top-level ';', or after a top-level '}' that isn't
+    // followed by one.
+    Source& source = m_sources[sourceIndex];
+    source.firstDeclaration = m_declarations.GetSize();
+    source.numDeclarations  = 0;
+
+    const char* text = &m_text[(int)source.offset];
+    HLSLTokenizer tokenizer(&_silentLogger, fileName, text, source.length);
+    size_t      start           = 0;
+    const char* startFileName   = m_strings.AddString(fileName);
+    int         startLine       = 1;
+    int         firstIdentifier = m_identifiers.GetSize();
+    bool        hasTokens       = false;
+    int         depth           = 0;
+    while (tokenizer.GetToken() != HLSLToken_EndOfStream)
+    {
+        int token = tokenizer.GetToken();
+        hasTokens = true;
+        if (token == HLSLToken_Identifier)
+        {
+            m_identifiers.PushBack(tokenizer.GetIdentifierHash());
+        }
+        else if (token == '{' || token == '(' || token == '[')
+        {
+            ++depth;
+        }
+        else if (token == '}' || token == ')' || token == ']')
+        {
+            --depth;
+        }
+        if (depth == 0 && (token == ';' || (token == '}' && !GetIsFollowedBySemicolon(sourceIndex, tokenizer.GetOffset() + 1))))
+        {
+            size_t end = tokenizer.GetOffset() + 1;
+            Declaration& declaration = m_declarations.PushBackNew();
+            declaration.source          = sourceIndex;
+            declaration.offset          = source.offset + start;
+            declaration.length          = end - start;
+            declaration.fileName        = startFileName;
+            declaration.line            = startLine;
+            declaration.firstIdentifier = firstIdentifier;
+            declaration.numIdentifiers  = m_identifiers.GetSize() - firstIdentifier;
+            ++source.numDeclarations;
+
+            // The next one starts right after, on the same line.
+            start = end;
+            if (strcmp(tokenizer.GetFileName(), startFileName) != 0)
+            {
+                startFileName = m_strings.AddString(tokenizer.GetFileName());
+            }
+            startLine       = tokenizer.GetLineNumber();
+            firstIdentifier = m_identifiers.GetSize();
+            hasTokens       = false;
+        }
+        tokenizer.Next();
+    }
+
+    // Trailing white space and directives go with the last declaration, an unfinished
+    // one is kept as it is so that parsing it reports the error.
+    if (start < source.length)
+    {
+        if (!hasTokens && source.numDeclarations > 0)
+        {
+            m_declarations[m_declarations.GetSize() - 1].length += source.length - start;
+        }
+        else
+        {
+            Declaration& declaration = m_declarations.PushBackNew();
+            declaration.source          = sourceIndex;
+            declaration.offset          = source.offset + start;
+            declaration.length          = source.length - start;
+            declaration.fileName        = startFileName;
+            declaration.line            = startLine;
+            declaration.firstIdentifier = firstIdentifier;
+            declaration.numIdentifiers  = m_identifiers.GetSize() - firstIdentifier;
+            ++source.numDeclarations;
+        }
+    }
+
+    for (int i = source.firstDeclaration; i < m_declarations.GetSize(); ++i)
+    {
+        Declaration& declaration = m_declarations[i];
+        unsigned long long hash = String_Hash64(declaration.fileName, strlen(declaration.fileName));
+        hash = String_Hash64((const char*)&declaration.line, sizeof(declaration.line), hash);
+        declaration.hash        = String_Hash64(&m_text[(int)declaration.offset], declaration.length, hash);
+        declaration.duplicate   = false;
+        declaration.excluded    = false;
+        declaration.shared      = false;
+    }
+}
+
+bool HLSLPermutations::GetIsFollowedBySemicolon(int source, size_t offset) const
+{
+    // The sources are preprocessed, so there are no comments, only #line and #pragma.
+    const char* p   = &m_text[(int)m_sources[source].offset] + offset;
+    const char* end = &m_text[(int)m_sources[source].offset] + m_sources[source].length;
+    bool lineStart = false;
+    while (p < end)
+    {
+        if (p[0] == '\n')
+        {
+            lineStart = true;
+        }
+        else if (p[0] == '#' && lineStart)
+        {
+            while (p < end && p[0] != '\n')
+            {
+                ++p;
+            }
+            continue;
+        }
+        else if (p[0] != ' ' && p[0] != '\t' && p[0] != '\r')
+        {
+            break;
+        }
+        ++p;
+    }
+    return p < end && p[0] == ';';
+}
+
+static int GetTableIndex(unsigned long long hash, int source, int capacity)
+{
+    return (int)((hash ^ ((unsigned long long)source * 0x9E3779B97F4A7C15ull)) & (unsigned long long)(capacity - 1));
+}
+
+void HLSLPermutations::AddDeclarationsToTable()
+{
+    int capacity = 16;
+    while (capacity < 2 * m_declarations.GetSize())
+    {
+        capacity *= 2;
+    }
+    m_table.Resize(capacity);
+    for (int i = 0; i < capacity; ++i)
+    {
+        m_table[i] = -1;
+    }
+
+    for (int i = 0; i < m_declarations.GetSize(); ++i)
+    {
+        Declaration& declaration = m_declarations[i];
+        int index = GetTableIndex(declaration.hash, declaration.source, capacity);
+        while (m_table[index] >= 0)
+        {
+            Declaration& other = m_declarations[m_table[index]];
+            if (other.source == declaration.source && GetIsSameDeclaration(other, declaration))
+            {
+                // A file included twice without a guard, which of the two is meant
+                // can't be told apart in the other sources.
+                other.duplicate       = true;
+                declaration.duplicate = true;
+                break;
+            }
+            index = (index + 1) & (capacity - 1);
+        }
+        if (!declaration.duplicate)
+        {
+            m_table[index] = i;
+        }
+    }
+}
+
+int HLSLPermutations::FindDeclaration(int source, const Declaration& declaration) const
+{
+    int capacity = m_table.GetSize();
+    int index = GetTableIndex(declaration.hash, source, capacity);
+    while (m_table[index] >= 0)
+    {
+        const Declaration& other = m_declarations[m_table[index]];
+        if (other.source == source && GetIsSameDeclaration(other, declaration))
+        {
+            return other.duplicate ? -1 : m_table[index];
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    return -1;
+}
+
+bool HLSLPermutations::GetIsSameDeclaration(const Declaration& a, const Declaration& b) const
+{
+    // File names are pooled.
+    return a.hash == b.hash && a.line == b.line && a.fileName == b.fileName && a.length == b.length &&
+        memcmp(&m_text[(int)a.offset], &m_text[(int)b.offset], a.length) == 0;
+}
+
+/** Set of identifiers, by hash. Identifiers with the same hash are taken for the
+same one, which can only keep a declaration out of the prelude. */
+class IdentifierSet
+{
+
+public:
+
+    explicit IdentifierSet(Allocator* allocator) : m_slots(allocator)
+    {
+        m_size = 0;
+        m_slots.Resize(64);
+        Clear();
+    }
+
+    void Clear()
+    {
+        for (int i = 0; i < m_slots.GetSize(); ++i)
+        {
+            m_slots[i] = 0;
+        }
+        m_size = 0;
+    }
+
+    void Add(unsigned int hash)
+    {
+        if (2 * (m_size + 1) > m_slots.GetSize())
+        {
+            Grow();
+        }
+        int index = Find(hash);
+        if (m_slots[index] == 0)
+        {
+            m_slots[index] = GetKey(hash);
+            ++m_size;
+        }
+    }
+
+    bool GetContains(unsigned int hash) const
+    {
+        return m_slots[Find(hash)] != 0;
+    }
+
+private:
+
+    // 0 marks an empty slot.
+    static unsigned int GetKey(unsigned int hash)
+    {
+        return (hash != 0) ? hash : 1;
+    }
+
+    int Find(unsigned int hash) const
+    {
+        unsigned int key = GetKey(hash);
+        int mask  = m_slots.GetSize() - 1;
+        int index = (int)(key & (unsigned int)mask);
+        while (m_slots[index] != 0 && m_slots[index] != key)
+        {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+
+    void Grow()
+    {
+        int capacity = m_slots.GetSize();
+        Array<unsigned int> keys(std::move(m_slots));
+        m_slots.Resize(2 * capacity);
+        Clear();
+        for (int i = 0; i < capacity; ++i)
+        {
+            if (keys[i] != 0)
+            {
+                Add(keys[i]);
+            }
+        }
+    }
+
+    Array<unsigned int> m_slots;
+    int                 m_size;
+
+};
+
+void HLSLPermutations::SelectSharedDeclarations()
+{
+    // The prelude takes the declarations of the first source that are in every
+    // source, in the same order. A declaration that names something that one of
+    // the declarations left before it in a source also names stays in the sources:
+    // once in the prelude, it would come before them.
+    int numSources = m_sources.GetSize();
+    Array<int> next(m_allocator);       // First declaration of each source not looked at yet.
+    Array<int> matches(m_allocator);
+    next.Resize(numSources);
+    matches.Resize(numSources);
+    for (int i = 0; i < numSources; ++i)
+    {
+        next[i] = m_sources[i].firstDeclaration;
+    }
+    for (int i = 0; i < m_declarations.GetSize(); ++i)
+    {
+        m_declarations[i].shared = false;
+    }
+
+    IdentifierSet kept(m_allocator);    // Identifiers of the declarations left in the sources.
+    const Source& first = m_sources[0];
+    for (int i = first.firstDeclaration; i < first.firstDeclaration + first.numDeclarations; ++i)
+    {
+        const Declaration& declaration = m_declarations[i];
+        bool shared = !declaration.duplicate && !declaration.excluded;
+        matches[0] = i;
+        for (int j = 1; j < numSources && shared; ++j)
+        {
+            matches[j] = FindDeclaration(j, declaration);
+            shared = matches[j] >= next[j];
+        }
+
+        if (shared)
+        {
+            for (int j = 0; j < numSources; ++j)
+            {
+                for (int k = next[j]; k < matches[j]; ++k)
+                {
+                    const Declaration& skipped = m_declarations[k];
+                    for (int l = 0; l < skipped.numIdentifiers; ++l)
+                    {
+                        kept.Add(m_identifiers[skipped.firstIdentifier + l]);
+                    }
+                }
+                next[j] = matches[j] + 1;
+            }
+            for (int l = 0; l < declaration.numIdentifiers && shared; ++l)
+            {
+                shared = !kept.GetContains(m_identifiers[declaration.firstIdentifier + l]);
+            }
+        }
+        else
+        {
+            next[0] = i + 1;
+        }
+
+        if (shared)
+        {
+            for (int j = 0; j < numSources; ++j)
+            {
+                m_declarations[matches[j]].shared = true;
+            }
+        }
+        else
+        {
+            for (int l = 0; l < declaration.numIdentifiers; ++l)
+            {
+                kept.Add(m_identifiers[declaration.firstIdentifier + l]);
+            }
+        }
+    }
+}
+
+bool HLSLPermutations::ParsePrelude(const char* fileName)
+{
+    Array<char> text(m_allocator);
+    while (true)
+    {
+        SelectSharedDeclarations();
+        text.Clear();
+        AppendDeclarations(text, 0, true);
+        if (text.GetSize() == 0 || !m_prelude.Parse(&_silentLogger, fileName, &text[0], text.GetSize()))
+        {
+            return false;
+        }
+        if (m_prelude.GetTree()->GetRoot()->statement == NULL)
+        {
+            return false;
+        }
+
+        // Functions declared in the prelude can't be defined by the sources, so their
+        // declarations stay in the sources, along with the ones that use them.
+        bool excluded = false;
+        for (const HLSLStatement* statement = m_prelude.GetTree()->GetRoot()->statement; statement != NULL; statement = statement->nextStatement)
+        {
+            if (statement->nodeType == HLSLNodeType_Function)
+            {
+                const HLSLFunction* function = (const HLSLFunction*)statement;
+                if (function->statement == NULL && function->forward == NULL)
+                {
+                    unsigned int hash = String_Hash(function->name, strlen(function->name));
+                    const Source& first = m_sources[0];
+                    for (int i = first.firstDeclaration; i < first.firstDeclaration + first.numDeclarations; ++i)
+                    {
+                        Declaration& declaration = m_declarations[i];
+                        for (int j = 0; j < declaration.numIdentifiers && declaration.shared && !declaration.excluded; ++j)
+                        {
+                            if (m_identifiers[declaration.firstIdentifier + j] == hash)
+                            {
+                                declaration.excluded = true;
+                                excluded = true;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        if (!excluded)
+        {
+            break;
+        }
+    }
+
+    m_preludeLength = 0;
+    const Source& first = m_sources[0];
+    for (int i = first.firstDeclaration; i < first.firstDeclaration + first.numDeclarations; ++i)
+    {
+        if (m_declarations[i].shared)
+        {
+            m_preludeLength += m_declarations[i].length;
+        }
+    }
+    return true;
+}
+
+static void AppendText(Array<char>& text, const char* chars, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    int size = text.GetSize();
+    text.Resize(size + (int)length);
+    memcpy(&text[size], chars, length);
+}
+
+void HLSLPermutations::AppendDeclarations(Array<char>& text, int sourceIndex, bool shared) const
+{
+    const Source& source = m_sources[sourceIndex];
+    size_t end = source.offset;
+    for (int i = source.firstDeclaration; i < source.firstDeclaration + source.numDeclarations; ++i)
+    {
+        const Declaration& declaration = m_declarations[i];
+        if (declaration.shared != shared)
+        {
+            continue;
+        }
+
+        // A declaration that doesn't follow the previous one keeps its location with a #line.
+        if (declaration.offset != end)
+        {
+            char directive[32];
+            int directiveLength = String_Printf(directive, sizeof(directive), "#line %d \"", declaration.line);
+            ASSERT(directiveLength > 0);
+            AppendText(text, directive, directiveLength);
+            AppendText(text, declaration.fileName, strlen(declaration.fileName));
+            AppendText(text, "\"\n", 2);
+        }
+        AppendText(text, &m_text[(int)declaration.offset], declaration.length);
+        end = declaration.offset + declaration.length;
+    }
+}
+
+HLSLTree* HLSLPermutations::ParseSource(const char* fileName, int sourceIndex)
+{
+    const Source& source = m_sources[sourceIndex];
+    HLSLTree* tree = new (m_allocator->New(m_allocator->m_userData, sizeof(HLSLTree))) HLSLTree(m_allocator, &m_strings);
+
+    if (m_preludeLength > 0)
+    {
+        Array<char> rest(m_allocator);
+        AppendDeclarations(rest, sourceIndex, false);
+
+        HLSLParser parser(m_allocator, &_silentLogger, fileName, (rest.GetSize() > 0) ? &rest[0] : "", rest.GetSize());
+        parser.SetPrelude(&m_prelude);
+        if (parser.Parse(tree))
+        {
+            return tree;
+        }
+
+        // The errors are reported by parsing the whole source.
+        tree->~HLSLTree();
+        m_allocator->Delete(m_allocator->m_userData, tree);
+        tree = new (m_allocator->New(m_allocator->m_userData, sizeof(HLSLTree))) HLSLTree(m_allocator, &m_strings);
+    }
+
+    HLSLParser parser(m_allocator, m_logger, fileName, &m_text[(int)source.offset], source.length);
+    if (!parser.Parse(tree))
+    {
+        tree->~HLSLTree();
+        m_allocator->Delete(m_allocator->m_userData, tree);
+        return NULL;
+    }
+    return tree;
+}
+
+}
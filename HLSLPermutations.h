@@ -0,0 +1,140 @@
+#ifndef HLSL_PERMUTATIONS_H
+#define HLSL_PERMUTATIONS_H
+
+#include "Engine.h"
+
+#include "HLSLParser.h"
+#include "HLSLPreprocessor.h"
+
+namespace M4
+{
+
+/** Builds the permutations of a shader, each with its own set of macros, and parses
+each one into a tree. The work that doesn't depend on the macros is only done once:
+- Included files are lexed once, through the include cache.
+- Permutations that preprocess to the same source share their tree.
+- The top-level declarations that every source has, at the same place in the same
+  file, are parsed once into a prelude, and only the others are parsed with each
+  source. A declaration stays in the sources if it names something that one of the
+  declarations that differ between the sources also names, so that moving it into
+  the prelude can't change what either of them refers to.
+The trees find the declarations of the prelude through HLSLTree::GetPrelude, see
+GetTree and SetUsePrelude. */
+class HLSLPermutations
+{
+
+public:
+
+    /** Includes are read with readFile, through the cache when there is one, or
+    through a cache owned by the permutations, which is cleared by each Build. */
+    HLSLPermutations(Allocator* allocator, Logger* logger, FileReadCallback readFile, HLSLIncludeCache* cache = NULL);
+    ~HLSLPermutations();
+
+    /** Starts a new permutation, and returns its index. */
+    int AddPermutation();
+
+    /** Adds a macro to the last permutation, see HLSLPreprocessor::Define. */
+    void Define(const char* name, const char* value = "1");
+
+    /** Preprocesses and parses every permutation. Returns false if any of them
+    fails, the others still get their tree. */
+    bool Build(const char* fileName, const char* buffer, size_t length);
+
+    int GetNumPermutations() const { return m_permutations.GetSize(); }
+
+    /** When enabled, which is the default, the declarations shared by the sources
+    are parsed once into a prelude. Disable it to get trees that hold the whole
+    source. Takes effect on the next Build. */
+    void SetUsePrelude(bool usePrelude) { m_usePrelude = usePrelude; }
+
+    /** Returns the tree of the permutation, or NULL if it failed. Permutations
+    with the same source return the same tree.
+    Unless the prelude is disabled, the root of the tree may only hold part of the
+    source: the shared declarations are in the tree returned by GetPrelude, and
+    code that walks the declarations has to visit both. */
+    HLSLTree* GetTree(int permutation) const;
+
+    /** Number of different sources among the permutations. */
+    int GetNumTrees() const { return m_trees.GetSize(); }
+
+    /** Length of the declarations shared by every permutation and parsed once,
+    0 if nothing could be shared. */
+    size_t GetPreludeLength() const { return m_preludeLength; }
+
+private:
+
+    struct Permutation
+    {
+        int         firstDefine;
+        int         numDefines;
+        int         source;         // Index in m_sources, -1 if it failed.
+    };
+
+    struct Source
+    {
+        size_t          offset;     // In m_text.
+        size_t          length;
+        unsigned int    hash;
+        int             firstDeclaration;   // In m_declarations.
+        int             numDeclarations;
+    };
+
+    /** A top-level declaration, with the text between it and the previous one. */
+    struct Declaration
+    {
+        int                 source;
+        size_t              offset;         // In m_text.
+        size_t              length;
+        const char*         fileName;       // Where the text starts, pooled.
+        int                 line;
+        unsigned long long  hash;           // Of the location and the text.
+        int                 firstIdentifier;    // In m_identifiers.
+        int                 numIdentifiers;
+        bool                duplicate;      // Appears twice in its source.
+        bool                excluded;       // Can't be in the prelude.
+        bool                shared;         // In the prelude.
+    };
+
+    void Clear();
+    void SplitDeclarations(const char* fileName, int source);
+    bool GetIsFollowedBySemicolon(int source, size_t offset) const;
+    void AddDeclarationsToTable();
+    int FindDeclaration(int source, const Declaration& declaration) const;
+    bool GetIsSameDeclaration(const Declaration& a, const Declaration& b) const;
+    void SelectSharedDeclarations();
+    bool ParsePrelude(const char* fileName);
+    void AppendDeclarations(Array<char>& text, int source, bool shared) const;
+    HLSLTree* ParseSource(const char* fileName, int source);
+
+    // Not copyable.
+    HLSLPermutations(const HLSLPermutations&);
+    void operator=(const HLSLPermutations&);
+
+private:
+
+    Allocator*              m_allocator;
+    Logger*                 m_logger;
+    FileReadCallback        m_readFile;
+    HLSLIncludeCache        m_includeCache;
+    HLSLIncludeCache*       m_cache;
+
+    SharedStringPool        m_strings;      // Shared by the trees and the prelude.
+    Array<const char*>      m_names;
+    Array<const char*>      m_values;
+    Array<Permutation>      m_permutations;
+
+    Array<char>             m_text;         // Preprocessed sources.
+    Array<Source>           m_sources;
+    Array<Declaration>      m_declarations;
+    Array<unsigned int>     m_identifiers;  // String_Hash of the identifiers of the declarations.
+    Array<int>              m_table;        // Open addressing on the declarations, -1 when empty.
+    Array<HLSLTree*>        m_trees;        // By source, NULL if it failed.
+    HLSLPrelude             m_prelude;
+    size_t                  m_preludeLength;
+    bool                    m_usePrelude;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,1807 @@
+#include "Engine.h"
+
+#include "HLSLPreprocessor.h"
+#include "HLSLTokenCache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+
+namespace M4
+{
+
+enum TokenFlag
+{
+    TokenFlag_NoExpand          = 1 << 0,   // Named a macro that was being expanded.
+    TokenFlag_Expanded          = 1 << 1,   // Comes from the expansion of a macro.
+    TokenFlag_Paste             = 1 << 2,   // ## in the body of a macro.
+    TokenFlag_Placemarker       = 1 << 3,   // Empty argument next to a ##.
+    TokenFlag_ParameterShift    = 4,        // Index of the parameter plus one, in the body of a macro.
+};
+
+static const int _maxIncludeDepth = 64;
+
+static const HLSLPreprocessorToken _newlineToken = { "\n", 1, 0, 0, HLSLPreprocessorToken_Newline, 0 };
+
+struct HLSLPreprocessor::Macro
+{
+    explicit Macro(Allocator* allocator) : parameters(allocator), body(allocator) {}
+
+    const char*                     name;       // Pooled.
+    unsigned int                    length;
+    unsigned int                    hash;
+    bool                            defined;
+    bool                            functionLike;
+    bool                            variadic;   // The last parameter is __VA_ARGS__.
+    bool                            active;     // Being expanded.
+    Array<const char*>              parameters; // Pooled.
+    Array<HLSLPreprocessorToken>    body;
+};
+
+struct HLSLPreprocessor::Reader
+{
+    explicit Reader(Allocator* allocator) : contexts(allocator) {}
+    Array<Context>                  contexts;
+};
+
+static bool GetIsIdentifierStart(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool GetIsIdentifierChar(char c)
+{
+    return GetIsIdentifierStart(c) || (c >= '0' && c <= '9');
+}
+
+static bool GetIsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool GetIsHorizontalSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static bool GetIsPunctuator(const HLSLPreprocessorToken& token, const char* text)
+{
+    return token.kind == HLSLPreprocessorToken_Punctuator && strncmp(token.text, text, token.length) == 0 && text[token.length] == 0;
+}
+
+static bool GetIsIdentifier(const HLSLPreprocessorToken& token, const char* text)
+{
+    return token.kind == HLSLPreprocessorToken_Identifier && strncmp(token.text, text, token.length) == 0 && text[token.length] == 0;
+}
+
+static bool GetIsBuiltinMacro(const HLSLPreprocessorToken& token)
+{
+    return GetIsIdentifier(token, "__LINE__") || GetIsIdentifier(token, "__FILE__");
+}
+
+static bool GetIsSpace(const HLSLPreprocessorToken& token)
+{
+    return token.kind == HLSLPreprocessorToken_Space || token.kind == HLSLPreprocessorToken_Newline;
+}
+
+/** Returns the index of the first token from index that isn't a space, or count. */
+static int SkipSpaces(const HLSLPreprocessorToken* tokens, int index, int count)
+{
+    while (index < count && GetIsSpace(tokens[index]))
+    {
+        ++index;
+    }
+    return index;
+}
+
+// Longest first, so that the first match is the longest one.
+static const char* _punctuators[] =
+    {
+        "...", "<<=", ">>=",
+        "##", "&&", "||", "<<", ">>", "<=", ">=", "==", "!=", "++", "--",
+        "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "->", "::",
+    };
+
+/** Splits the text into preprocessing tokens, and ends them with a newline. */
+static void LexTokens(const char* text, size_t length, Array<HLSLPreprocessorToken>& tokens)
+{
+    const char* p   = text;
+    const char* end = text + length;
+    int line = 1;
+
+    while (p < end)
+    {
+        HLSLPreprocessorToken& token = tokens.PushBackNew();
+        token.text  = p;
+        token.line  = line;
+        token.hash  = 0;
+        token.flags = 0;
+
+        char c = p[0];
+        if (c == '\n')
+        {
+            token.kind = HLSLPreprocessorToken_Newline;
+            ++line;
+            ++p;
+        }
+        else if (GetIsHorizontalSpace(c) || (c == '\\' && (p + 1 < end && (p[1] == '\n' || (p[1] == '\r' && p + 2 < end && p[2] == '\n')))))
+        {
+            // Runs of spaces and line continuations.
+            token.kind = HLSLPreprocessorToken_Space;
+            while (p < end)
+            {
+                if (GetIsHorizontalSpace(p[0]))
+                {
+                    ++p;
+                }
+                else if (p[0] == '\\' && p + 1 < end && p[1] == '\n')
+                {
+                    p += 2;
+                    ++line;
+                }
+                else if (p[0] == '\\' && p + 2 < end && p[1] == '\r' && p[2] == '\n')
+                {
+                    p += 3;
+                    ++line;
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+        else if (c == '/' && p + 1 < end && p[1] == '/')
+        {
+            token.kind = HLSLPreprocessorToken_Space;
+            const char* newline = (const char*)memchr(p, '\n', end - p);
+            p = (newline != NULL) ? newline : end;
+        }
+        else if (c == '/' && p + 1 < end && p[1] == '*')
+        {
+            token.kind = HLSLPreprocessorToken_Space;
+            p += 2;
+            while (p < end && !(p[0] == '*' && p + 1 < end && p[1] == '/'))
+            {
+                if (p[0] == '\n')
+                {
+                    ++line;
+                }
+                ++p;
+            }
+            p = (p < end) ? p + 2 : end;
+        }
+        else if (GetIsIdentifierStart(c))
+        {
+            token.kind = HLSLPreprocessorToken_Identifier;
+            unsigned int hash = String_HashSeed;
+            while (p < end && GetIsIdentifierChar(p[0]))
+            {
+                hash = String_HashAdd(hash, p[0]);
+                ++p;
+            }
+            token.hash = hash;
+        }
+        else if (GetIsDigit(c) || (c == '.' && p + 1 < end && GetIsDigit(p[1])))
+        {
+            // Preprocessing numbers also take in suffixes and exponents.
+            token.kind = HLSLPreprocessorToken_Number;
+            ++p;
+            while (p < end)
+            {
+                if ((p[0] == '+' || p[0] == '-') && (p[-1] == 'e' || p[-1] == 'E' || p[-1] == 'p' || p[-1] == 'P'))
+                {
+                    ++p;
+                }
+                else if (GetIsIdentifierChar(p[0]) || p[0] == '.')
+                {
+                    ++p;
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+        else if (c == '"' || c == '\'')
+        {
+            token.kind = HLSLPreprocessorToken_String;
+            ++p;
+            while (p < end && p[0] != c && p[0] != '\n')
+            {
+                p += (p[0] == '\\' && p + 1 < end && p[1] != '\n') ? 2 : 1;
+            }
+            if (p < end && p[0] == c)
+            {
+                ++p;
+            }
+        }
+        else
+        {
+            token.kind = HLSLPreprocessorToken_Other;
+            ++p;
+            if (strchr("!#%&()*+,-./:;<=>?[]^{|}~", c) != NULL)
+            {
+                token.kind = HLSLPreprocessorToken_Punctuator;
+                for (size_t i = 0; i < sizeof(_punctuators) / sizeof(_punctuators[0]); ++i)
+                {
+                    size_t n = strlen(_punctuators[i]);
+                    if ((size_t)(end - token.text) >= n && memcmp(token.text, _punctuators[i], n) == 0)
+                    {
+                        p = token.text + n;
+                        break;
+                    }
+                }
+            }
+        }
+
+        token.length = (unsigned int)(p - token.text);
+    }
+
+    HLSLPreprocessorToken& newline = tokens.PushBackNew();
+    newline = _newlineToken;
+    newline.line = line;
+}
+
+static char* CopyString(Allocator* allocator, const char* string, size_t length)
+{
+    char* copy = (char*)allocator->New(allocator->m_userData, length + 1);
+    memcpy(copy, string, length);
+    copy[length] = 0;
+    return copy;
+}
+
+HLSLPreprocessorFile::HLSLPreprocessorFile(Allocator* allocator) : allocator(allocator), tokens(allocator)
+{
+    name    = NULL;
+    text    = NULL;
+    length  = 0;
+    hash    = 0;
+}
+
+HLSLPreprocessorFile::~HLSLPreprocessorFile()
+{
+    allocator->Delete(allocator->m_userData, name);
+    allocator->Delete(allocator->m_userData, text);
+}
+
+void HLSLPreprocessorFile::Lex(const char* name, const char* text, size_t length)
+{
+    allocator->Delete(allocator->m_userData, this->name);
+    allocator->Delete(allocator->m_userData, this->text);
+    this->name   = CopyString(allocator, name, strlen(name));
+    this->text   = CopyString(allocator, text, length);
+    this->length = length;
+    this->hash   = String_Hash64(text, length);
+    tokens.Clear();
+    LexTokens(this->text, length, tokens);
+}
+
+static HLSLPreprocessorFile* ReadFile(Allocator* allocator, const char* fileName, FileReadCallback readFile)
+{
+    const char* text = (readFile != NULL) ? readFile(fileName) : NULL;
+    if (text == NULL)
+    {
+        return NULL;
+    }
+    HLSLPreprocessorFile* file = new (allocator->New(allocator->m_userData, sizeof(HLSLPreprocessorFile))) HLSLPreprocessorFile(allocator);
+    file->Lex(fileName, text, strlen(text));
+    return file;
+}
+
+static void DeleteFile(HLSLPreprocessorFile* file)
+{
+    Allocator* allocator = file->allocator;
+    file->~HLSLPreprocessorFile();
+    allocator->Delete(allocator->m_userData, file);
+}
+
+HLSLIncludeCache::HLSLIncludeCache(Allocator* allocator) :
+    m_names(allocator),
+    m_entries(allocator),
+    m_slots(allocator)
+{
+    m_allocator = allocator;
+}
+
+HLSLIncludeCache::~HLSLIncludeCache()
+{
+    Clear();
+}
+
+int HLSLIncludeCache::FindSlot(const char* fileName, unsigned int hash) const
+{
+    int mask = m_slots.GetSize() - 1;
+    int i = hash & mask;
+    for (; m_slots[i] >= 0; i = (i + 1) & mask)
+    {
+        const Entry& entry = m_entries[m_slots[i]];
+        if (entry.hash == hash && String_Equal(entry.name, fileName))
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+const HLSLPreprocessorFile* HLSLIncludeCache::GetFile(const char* fileName, FileReadCallback readFile)
+{
+    size_t length = strlen(fileName);
+    unsigned int hash = String_Hash(fileName, length);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_slots.GetSize() > 0)
+        {
+            int slot = FindSlot(fileName, hash);
+            if (m_slots[slot] >= 0)
+            {
+                return m_entries[m_slots[slot]].file;
+            }
+        }
+    }
+
+    // Read and lexed without the lock, so that the threads that find their files
+    // in the cache don't wait for it.
+    HLSLPreprocessorFile* file = ReadFile(m_allocator, fileName, readFile);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if ((m_entries.GetSize() + 1) * 2 > m_slots.GetSize())
+    {
+        int capacity = (m_slots.GetSize() == 0) ? 64 : m_slots.GetSize() * 2;
+        m_slots.Resize(capacity);
+        for (int i = 0; i < capacity; ++i)
+        {
+            m_slots[i] = -1;
+        }
+        for (int i = 0; i < m_entries.GetSize(); ++i)
+        {
+            int j = m_entries[i].hash & (capacity - 1);
+            while (m_slots[j] >= 0)
+            {
+                j = (j + 1) & (capacity - 1);
+            }
+            m_slots[j] = i;
+        }
+    }
+    int slot = FindSlot(fileName, hash);
+    if (m_slots[slot] >= 0)
+    {
+        // Another thread read it first.
+        if (file != NULL)
+        {
+            DeleteFile(file);
+        }
+        return m_entries[m_slots[slot]].file;
+    }
+    m_slots[slot] = m_entries.GetSize();
+    Entry& entry = m_entries.PushBackNew();
+    entry.name = m_names.AddString(fileName, length, hash);
+    entry.hash = hash;
+    entry.file = file;
+    return file;
+}
+
+void HLSLIncludeCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (int i = 0; i < m_entries.GetSize(); ++i)
+    {
+        if (m_entries[i].file != NULL)
+        {
+            DeleteFile(m_entries[i].file);
+        }
+    }
+    m_entries.Clear();
+    m_slots.Clear();
+    m_names.Reset();
+}
+
+HLSLPreprocessor::HLSLPreprocessor(Allocator* allocator, Logger* logger, FileReadCallback readFile, HLSLIncludeCache* cache) :
+    m_manifest(allocator),
+    m_strings(allocator),
+    m_macros(allocator),
+    m_macroSlots(allocator),
+    m_defines(allocator),
+    m_defineFile(allocator),
+    m_includeCache(allocator),
+    m_onceFiles(allocator),
+    m_conditionals(allocator),
+    m_expansion(allocator),
+    m_output(allocator),
+    m_tokens(allocator)
+{
+    m_allocator         = allocator;
+    m_logger            = logger;
+    m_readFile          = readFile;
+    m_cache             = (cache != NULL) ? cache : &m_includeCache;
+    m_dependencies      = NULL;
+    m_tokenCache        = NULL;
+    m_recordDependencies = false;
+    m_error             = false;
+    m_firstConditional  = 0;
+    m_fileName          = NULL;
+    m_lineOffset        = 0;
+    m_outputFileName    = NULL;
+    m_outputLine        = 1;
+    m_spaceNeeded       = false;
+    m_output.PushBack(0);
+}
+
+HLSLPreprocessor::~HLSLPreprocessor()
+{
+    ClearMacros();
+}
+
+void HLSLPreprocessor::Define(const char* name, const char* value)
+{
+    m_defines.PushBack(m_strings.AddStringFormat("%s %s", name, value));
+}
+
+void HLSLPreprocessor::Reset()
+{
+    m_defines.Clear();
+}
+
+bool HLSLPreprocessor::Preprocess(const char* fileName, const char* buffer, size_t length)
+{
+    m_error = false;
+    m_output.Clear();
+    m_tokens.Clear();
+    m_manifest.Clear();
+    m_recordDependencies = (m_dependencies != NULL || m_tokenCache != NULL);
+    m_onceFiles.Clear();
+    m_conditionals.Clear();
+    m_expansion.Clear();
+    m_firstConditional = 0;
+    m_spaceNeeded = false;
+    ClearMacros();
+
+    // Without a cache, the files may have changed since the last time.
+    m_includeCache.Clear();
+
+    // The entry of the token cache is named by what is known before reading the source.
+    HLSLDependencyManifest inputs(m_allocator);
+    if (m_tokenCache != NULL)
+    {
+        inputs.AddFile(fileName, HLSLDependency_Source, String_Hash64(buffer, length));
+        for (int i = 0; i < m_defines.GetSize(); ++i)
+        {
+            inputs.AddOption("define", m_defines[i]);
+        }
+        if (m_tokenCache->Load(inputs, m_readFile, m_output, &m_tokens, &m_manifest))
+        {
+            if (m_dependencies != NULL)
+            {
+                m_dependencies->AddManifest(m_manifest);
+            }
+            return true;
+        }
+        m_output.Clear();
+        m_manifest.Clear();
+    }
+
+    // The macros from Define are read as the lines of a file.
+    Array<char> defines(m_allocator);
+    for (int i = 0; i < m_defines.GetSize(); ++i)
+    {
+        int size = defines.GetSize();
+        int n = (int)strlen(m_defines[i]);
+        defines.Resize(size + n + 1);
+        memcpy(&defines[size], m_defines[i], n);
+        defines[size + n] = '\n';
+    }
+    m_defineFile.Lex("<command line>", defines.GetSize() > 0 ? &defines[0] : "", defines.GetSize());
+    m_fileName   = m_defineFile.name;
+    m_lineOffset = 0;
+    const Array<HLSLPreprocessorToken>& tokens = m_defineFile.tokens;
+    int start = 0;
+    for (int i = 0; i < tokens.GetSize() && !m_error; ++i)
+    {
+        if (tokens[i].kind == HLSLPreprocessorToken_Newline)
+        {
+            if (i > start)
+            {
+                ProcessDefine(tokens[i].line, &tokens[start], i - start);
+            }
+            start = i + 1;
+        }
+    }
+
+    HLSLPreprocessorFile file(m_allocator);
+    file.Lex(fileName, buffer, length);
+    if (m_recordDependencies)
+    {
+        m_manifest.AddFile(file.name, HLSLDependency_Source, file.hash);
+        for (int i = 0; i < m_defines.GetSize(); ++i)
+        {
+            m_manifest.AddOption("define", m_defines[i]);
+        }
+    }
+    m_outputFileName = file.name;
+    m_outputLine     = 1;
+    if (!m_error)
+    {
+        ProcessFile(&file, 0);
+    }
+
+    // The file names in the output point to the file.
+    m_outputFileName = NULL;
+    m_fileName       = NULL;
+
+    m_output.PushBack(0);
+
+    if (m_dependencies != NULL)
+    {
+        m_dependencies->AddManifest(m_manifest);
+    }
+    if (m_tokenCache != NULL && !m_error)
+    {
+        HLSLTokenizer tokenizer(m_logger, fileName, &m_output[0], GetOutputLength());
+        tokenizer.Tokenize(&m_tokens);
+        m_tokenCache->Store(inputs, m_manifest, &m_output[0], GetOutputLength(), m_tokens);
+    }
+    return !m_error;
+}
+
+bool HLSLPreprocessor::GetIsActive() const
+{
+    int size = m_conditionals.GetSize();
+    return size == 0 || m_conditionals[size - 1].active;
+}
+
+bool HLSLPreprocessor::ProcessFile(const HLSLPreprocessorFile* file, int depth)
+{
+    const char* parentFileName   = m_fileName;
+    int         parentLineOffset = m_lineOffset;
+    int         parentFirstConditional = m_firstConditional;
+    m_fileName          = file->name;
+    m_lineOffset        = 0;
+    m_firstConditional  = m_conditionals.GetSize();
+
+    Reader reader(m_allocator);
+    Context& base = reader.contexts.PushBackNew();
+    base.tokens   = &file->tokens[0];
+    base.position = 0;
+    base.end      = file->tokens.GetSize();
+    base.macro    = NULL;
+
+    const HLSLPreprocessorToken* tokens = base.tokens;
+    int count = base.end;
+
+    bool lineStart = true;
+    while (!m_error)
+    {
+        if (lineStart)
+        {
+            // Macros never span lines, so only the file is being read here.
+            ASSERT(reader.contexts.GetSize() == 1);
+            Context& context = reader.contexts[0];
+            int first = context.position;
+            while (first < count && tokens[first].kind == HLSLPreprocessorToken_Space)
+            {
+                ++first;
+            }
+            int last = first;
+            while (last < count && tokens[last].kind != HLSLPreprocessorToken_Newline)
+            {
+                ++last;
+            }
+            if (first < count && GetIsPunctuator(tokens[first], "#"))
+            {
+                context.position = last + 1;
+                if (!ProcessDirective(file, &tokens[first + 1], last - first - 1, depth))
+                {
+                    break;
+                }
+                continue;
+            }
+            if (!GetIsActive())
+            {
+                context.position = last + 1;
+                if (context.position >= count)
+                {
+                    break;
+                }
+                continue;
+            }
+            lineStart = false;
+        }
+
+        HLSLPreprocessorToken token;
+        if (!ReadToken(reader, token))
+        {
+            break;
+        }
+        if (reader.contexts.GetSize() == 1)
+        {
+            m_expansion.Clear();
+        }
+        if (token.kind == HLSLPreprocessorToken_Newline)
+        {
+            lineStart = true;
+        }
+        Emit(token);
+    }
+
+    if (!m_error && m_conditionals.GetSize() > m_firstConditional)
+    {
+        Error(tokens[count - 1].line, "Syntax error: unterminated #if");
+    }
+
+    m_fileName          = parentFileName;
+    m_lineOffset        = parentLineOffset;
+    m_firstConditional  = parentFirstConditional;
+    return !m_error;
+}
+
+bool HLSLPreprocessor::ProcessDirective(const HLSLPreprocessorFile* file, const HLSLPreprocessorToken* tokens, int count, int depth)
+{
+    int first = SkipSpaces(tokens, 0, count);
+    if (first == count)
+    {
+        // Null directive.
+        return true;
+    }
+
+    const HLSLPreprocessorToken& name = tokens[first];
+    const HLSLPreprocessorToken* arguments = tokens + first + 1;
+    int numArguments = count - first - 1;
+    bool active = GetIsActive();
+
+    if (GetIsIdentifier(name, "if") || GetIsIdentifier(name, "ifdef") || GetIsIdentifier(name, "ifndef"))
+    {
+        Conditional conditional;
+        conditional.active  = false;
+        conditional.taken   = true;
+        conditional.sawElse = false;
+        if (active)
+        {
+            bool result = false;
+            if (GetIsIdentifier(name, "if"))
+            {
+                if (!EvaluateCondition(name.line, arguments, numArguments, result))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                int index = SkipSpaces(arguments, 0, numArguments);
+                if (index == numArguments || arguments[index].kind != HLSLPreprocessorToken_Identifier)
+                {
+                    Error(name.line, "Syntax error: expected identifier after #%.*s", (int)name.length, name.text);
+                    return false;
+                }
+                bool defined = FindMacro(arguments[index]) != NULL || GetIsBuiltinMacro(arguments[index]);
+                result = defined == GetIsIdentifier(name, "ifdef");
+            }
+            conditional.active = result;
+            conditional.taken  = result;
+        }
+        m_conditionals.PushBack(conditional);
+        return true;
+    }
+
+    if (GetIsIdentifier(name, "elif") || GetIsIdentifier(name, "else") || GetIsIdentifier(name, "endif"))
+    {
+        if (m_conditionals.GetSize() <= m_firstConditional)
+        {
+            Error(name.line, "Syntax error: #%.*s without #if", (int)name.length, name.text);
+            return false;
+        }
+        Conditional& conditional = m_conditionals[m_conditionals.GetSize() - 1];
+        if (GetIsIdentifier(name, "endif"))
+        {
+            m_conditionals.PopBack();
+            return true;
+        }
+        if (conditional.sawElse)
+        {
+            Error(name.line, "Syntax error: #%.*s after #else", (int)name.length, name.text);
+            return false;
+        }
+        if (GetIsIdentifier(name, "else"))
+        {
+            conditional.active  = !conditional.taken;
+            conditional.taken   = true;
+            conditional.sawElse = true;
+            return true;
+        }
+        conditional.active = false;
+        if (!conditional.taken)
+        {
+            bool result = false;
+            if (!EvaluateCondition(name.line, arguments, numArguments, result))
+            {
+                return false;
+            }
+            // The conditional may have moved while evaluating.
+            Conditional& current = m_conditionals[m_conditionals.GetSize() - 1];
+            current.active = result;
+            current.taken  = result;
+        }
+        return true;
+    }
+
+    if (!active)
+    {
+        return true;
+    }
+
+    if (GetIsIdentifier(name, "define"))
+    {
+        return ProcessDefine(name.line, arguments, numArguments);
+    }
+    if (GetIsIdentifier(name, "undef"))
+    {
+        int index = SkipSpaces(arguments, 0, numArguments);
+        if (index == numArguments || arguments[index].kind != HLSLPreprocessorToken_Identifier)
+        {
+            Error(name.line, "Syntax error: expected identifier after #undef");
+            return false;
+        }
+        Macro* macro = FindMacro(arguments[index]);
+        if (macro != NULL)
+        {
+            macro->defined = false;
+        }
+        return true;
+    }
+    if (GetIsIdentifier(name, "include"))
+    {
+        return ProcessInclude(file, name.line, arguments, numArguments, depth);
+    }
+    if (GetIsIdentifier(name, "line"))
+    {
+        return ProcessLine(name.line, arguments, numArguments);
+    }
+    if (GetIsIdentifier(name, "pragma"))
+    {
+        int index = SkipSpaces(arguments, 0, numArguments);
+        if (index < numArguments && GetIsIdentifier(arguments[index], "once"))
+        {
+            m_onceFiles.PushBack(file);
+            return true;
+        }
+
+        // HLSLTokenizer skips the other pragmas, but keep them for other tools.
+        SyncLine(name.line + m_lineOffset);
+        EmitText("#pragma", 7);
+        for (int i = 0; i < numArguments; ++i)
+        {
+            if (arguments[i].kind == HLSLPreprocessorToken_Space)
+            {
+                EmitText(" ", 1);
+            }
+            else
+            {
+                EmitText(arguments[i].text, arguments[i].length);
+            }
+        }
+        EmitText("\n", 1);
+        ++m_outputLine;
+        m_spaceNeeded = false;
+        return true;
+    }
+    if (GetIsIdentifier(name, "error"))
+    {
+        int index = SkipSpaces(arguments, 0, numArguments);
+        const char* message = (index < numArguments) ? arguments[index].text : "";
+        const char* end     = (numArguments > 0) ? arguments[numArguments - 1].text + arguments[numArguments - 1].length : message;
+        Error(name.line, "#error %.*s", (int)(end - message), message);
+        return false;
+    }
+
+    Error(name.line, "Syntax error: unknown directive #%.*s", (int)name.length, name.text);
+    return false;
+}
+
+bool HLSLPreprocessor::ProcessInclude(const HLSLPreprocessorFile* file, int line, const HLSLPreprocessorToken* tokens, int count, int depth)
+{
+    // The file name can also come from a macro.
+    Array<HLSLPreprocessorToken> expanded(m_allocator);
+    int index = SkipSpaces(tokens, 0, count);
+    if (index < count && tokens[index].kind == HLSLPreprocessorToken_Identifier)
+    {
+        ExpandTokens(tokens + index, count - index, expanded);
+        tokens = expanded.GetSize() > 0 ? &expanded[0] : NULL;
+        count  = expanded.GetSize();
+        index  = SkipSpaces(tokens, 0, count);
+    }
+
+    char name[1024];
+    size_t length = 0;
+    bool quoted = false;
+    if (index < count && tokens[index].kind == HLSLPreprocessorToken_String && tokens[index].text[0] == '"' && tokens[index].length >= 2)
+    {
+        quoted = true;
+        length = tokens[index].length - 2;
+        if (length < sizeof(name))
+        {
+            memcpy(name, tokens[index].text + 1, length);
+        }
+    }
+    else if (index < count && GetIsPunctuator(tokens[index], "<"))
+    {
+        for (++index; index < count && !GetIsPunctuator(tokens[index], ">"); ++index)
+        {
+            if (length + tokens[index].length < sizeof(name))
+            {
+                memcpy(name + length, tokens[index].text, tokens[index].length);
+            }
+            length += tokens[index].length;
+        }
+        if (index == count)
+        {
+            length = 0;
+        }
+    }
+    if (length == 0 || length >= sizeof(name))
+    {
+        Error(line, "Syntax error: expected file name after #include");
+        return false;
+    }
+    name[length] = 0;
+
+    if (depth + 1 >= _maxIncludeDepth)
+    {
+        Error(line, "#include nested too deeply");
+        return false;
+    }
+
+    // Quoted names are looked up next to the including file first.
+    const HLSLPreprocessorFile* included = NULL;
+    const char* slash = quoted ? strrchr(file->name, '/') : NULL;
+    const char* backslash = quoted ? strrchr(file->name, '\\') : NULL;
+    if (backslash > slash)
+    {
+        slash = backslash;
+    }
+    if (slash != NULL)
+    {
+        char path[2048];
+        String_Printf(path, sizeof(path), "%.*s%s", (int)(slash - file->name + 1), file->name, name);
+        included = LoadFile(path);
+        if (included == NULL && m_recordDependencies)
+        {
+            m_manifest.AddMissingFile(path, HLSLDependency_Include);
+        }
+    }
+    if (included == NULL)
+    {
+        included = LoadFile(name);
+    }
+    if (included == NULL)
+    {
+        Error(line, "Couldn't open include file '%s'", name);
+        return false;
+    }
+    if (m_recordDependencies)
+    {
+        m_manifest.AddFile(included->name, HLSLDependency_Include, included->hash);
+    }
+
+    for (int i = 0; i < m_onceFiles.GetSize(); ++i)
+    {
+        if (m_onceFiles[i] == included)
+        {
+            return true;
+        }
+    }
+    return ProcessFile(included, depth + 1);
+}
+
+const HLSLPreprocessorFile* HLSLPreprocessor::LoadFile(const char* fileName)
+{
+    return m_cache->GetFile(fileName, m_readFile);
+}
+
+bool HLSLPreprocessor::ProcessDefine(int line, const HLSLPreprocessorToken* tokens, int count)
+{
+    int index = SkipSpaces(tokens, 0, count);
+    if (index == count || tokens[index].kind != HLSLPreprocessorToken_Identifier)
+    {
+        Error(line, "Syntax error: expected macro name after #define");
+        return false;
+    }
+
+    const HLSLPreprocessorToken& name = tokens[index];
+    Macro* macro = AddMacro(name);
+    macro->functionLike = false;
+    macro->variadic     = false;
+    macro->parameters.Clear();
+    macro->body.Clear();
+    ++index;
+
+    // Only a parenthesis right after the name starts the parameters.
+    if (index < count && GetIsPunctuator(tokens[index], "("))
+    {
+        macro->functionLike = true;
+        index = SkipSpaces(tokens, index + 1, count);
+        if (index < count && GetIsPunctuator(tokens[index], ")"))
+        {
+            ++index;
+        }
+        else
+        {
+            bool closed = false;
+            while (!closed)
+            {
+                if (index < count && GetIsPunctuator(tokens[index], "..."))
+                {
+                    macro->variadic = true;
+                    macro->parameters.PushBack(m_strings.AddString("__VA_ARGS__"));
+                }
+                else if (index < count && tokens[index].kind == HLSLPreprocessorToken_Identifier)
+                {
+                    macro->parameters.PushBack(m_strings.AddString(tokens[index].text, tokens[index].length, tokens[index].hash));
+                }
+                else
+                {
+                    break;
+                }
+                index = SkipSpaces(tokens, index + 1, count);
+                if (index < count && GetIsPunctuator(tokens[index], ")"))
+                {
+                    closed = true;
+                }
+                else if (index == count || !GetIsPunctuator(tokens[index], ",") || macro->variadic)
+                {
+                    break;
+                }
+                index = SkipSpaces(tokens, index + 1, count);
+            }
+            if (!closed)
+            {
+                Error(name.line, "Syntax error: expected ')' in the parameters of macro '%.*s'", (int)name.length, name.text);
+                macro->defined = false;
+                return false;
+            }
+        }
+    }
+
+    // The body, without the spaces around it.
+    int first = SkipSpaces(tokens, index, count);
+    int last  = count;
+    while (last > first && GetIsSpace(tokens[last - 1]))
+    {
+        --last;
+    }
+    for (int i = first; i < last; ++i)
+    {
+        HLSLPreprocessorToken token = tokens[i];
+        token.flags = 0;
+        if (token.kind == HLSLPreprocessorToken_Identifier && macro->functionLike)
+        {
+            const char* pooled = m_strings.AddString(token.text, token.length, token.hash);
+            for (int j = 0; j < macro->parameters.GetSize(); ++j)
+            {
+                if (macro->parameters[j] == pooled)
+                {
+                    token.flags = (unsigned short)((j + 1) << TokenFlag_ParameterShift);
+                    break;
+                }
+            }
+        }
+        else if (GetIsPunctuator(token, "##"))
+        {
+            if (i == first || i == last - 1)
+            {
+                Error(name.line, "Syntax error: '##' can't be at either end of macro '%.*s'", (int)name.length, name.text);
+                macro->defined = false;
+                return false;
+            }
+            token.flags = TokenFlag_Paste;
+        }
+        macro->body.PushBack(token);
+    }
+    return true;
+}
+
+bool HLSLPreprocessor::ProcessLine(int line, const HLSLPreprocessorToken* tokens, int count)
+{
+    Array<HLSLPreprocessorToken> expanded(m_allocator);
+    ExpandTokens(tokens, count, expanded);
+
+    int index = SkipSpaces(expanded.GetSize() > 0 ? &expanded[0] : NULL, 0, expanded.GetSize());
+    if (index == expanded.GetSize() || expanded[index].kind != HLSLPreprocessorToken_Number)
+    {
+        Error(line, "Syntax error: expected line number after #line");
+        return false;
+    }
+    char number[32];
+    String_Printf(number, sizeof(number), "%.*s", (int)expanded[index].length, expanded[index].text);
+    int lineNumber = atoi(number);
+
+    index = SkipSpaces(&expanded[0], index + 1, expanded.GetSize());
+    if (index < expanded.GetSize())
+    {
+        const HLSLPreprocessorToken& name = expanded[index];
+        if (name.kind != HLSLPreprocessorToken_String || name.text[0] != '"' || name.length < 2)
+        {
+            Error(line, "Syntax error: expected file name after line number near #line");
+            return false;
+        }
+        m_fileName = m_strings.AddStringFormat("%.*s", (int)name.length - 2, name.text + 1);
+
+        if (m_recordDependencies)
+        {
+            const HLSLPreprocessorFile* named = LoadFile(m_fileName);
+            if (named != NULL)
+            {
+                m_manifest.AddFile(named->name, HLSLDependency_Line, named->hash);
+            }
+            else
+            {
+                m_manifest.AddMissingFile(m_fileName, HLSLDependency_Line);
+            }
+        }
+    }
+
+    // The line after the directive gets the number.
+    m_lineOffset = lineNumber - (line + 1);
+    return true;
+}
+
+HLSLPreprocessor::Macro* HLSLPreprocessor::FindMacro(const HLSLPreprocessorToken& token) const
+{
+    if (m_macroSlots.GetSize() == 0)
+    {
+        return NULL;
+    }
+    int mask = m_macroSlots.GetSize() - 1;
+    for (int i = token.hash & mask; m_macroSlots[i] != NULL; i = (i + 1) & mask)
+    {
+        Macro* macro = m_macroSlots[i];
+        if (macro->hash == token.hash && macro->length == token.length && memcmp(macro->name, token.text, token.length) == 0)
+        {
+            return macro->defined ? macro : NULL;
+        }
+    }
+    return NULL;
+}
+
+HLSLPreprocessor::Macro* HLSLPreprocessor::AddMacro(const HLSLPreprocessorToken& name)
+{
+    // Undefined macros keep their slot, so that they can be defined again.
+    if ((m_macros.GetSize() + 1) * 2 > m_macroSlots.GetSize())
+    {
+        int capacity = (m_macroSlots.GetSize() == 0) ? 64 : m_macroSlots.GetSize() * 2;
+        m_macroSlots.Clear();
+        m_macroSlots.Resize(capacity);
+        for (int i = 0; i < m_macros.GetSize(); ++i)
+        {
+            int j = m_macros[i]->hash & (capacity - 1);
+            while (m_macroSlots[j] != NULL)
+            {
+                j = (j + 1) & (capacity - 1);
+            }
+            m_macroSlots[j] = m_macros[i];
+        }
+    }
+
+    int mask = m_macroSlots.GetSize() - 1;
+    int i = name.hash & mask;
+    for (; m_macroSlots[i] != NULL; i = (i + 1) & mask)
+    {
+        Macro* macro = m_macroSlots[i];
+        if (macro->hash == name.hash && macro->length == name.length && memcmp(macro->name, name.text, name.length) == 0)
+        {
+            macro->defined = true;
+            return macro;
+        }
+    }
+
+    Macro* macro = new (m_allocator->New(m_allocator->m_userData, sizeof(Macro))) Macro(m_allocator);
+    macro->name         = m_strings.AddString(name.text, name.length, name.hash);
+    macro->length       = name.length;
+    macro->hash         = name.hash;
+    macro->defined      = true;
+    macro->functionLike = false;
+    macro->variadic     = false;
+    macro->active       = false;
+    m_macros.PushBack(macro);
+    m_macroSlots[i] = macro;
+    return macro;
+}
+
+void HLSLPreprocessor::ClearMacros()
+{
+    for (int i = 0; i < m_macros.GetSize(); ++i)
+    {
+        m_macros[i]->~Macro();
+        m_allocator->Delete(m_allocator->m_userData, m_macros[i]);
+    }
+    m_macros.Clear();
+    m_macroSlots.Clear();
+}
+
+const HLSLPreprocessorToken& HLSLPreprocessor::GetToken(const Context& context, int index) const
+{
+    return (context.tokens != NULL) ? context.tokens[index] : m_expansion[index];
+}
+
+bool HLSLPreprocessor::ReadRawToken(Reader& reader, HLSLPreprocessorToken& token)
+{
+    while (reader.contexts.GetSize() > 0)
+    {
+        Context& context = reader.contexts[reader.contexts.GetSize() - 1];
+        if (context.position < context.end)
+        {
+            token = GetToken(context, context.position++);
+            return true;
+        }
+        if (context.macro != NULL)
+        {
+            context.macro->active = false;
+        }
+        reader.contexts.PopBack();
+    }
+    return false;
+}
+
+bool HLSLPreprocessor::ReadToken(Reader& reader, HLSLPreprocessorToken& token)
+{
+    while (ReadRawToken(reader, token))
+    {
+        if (token.kind != HLSLPreprocessorToken_Identifier || (token.flags & TokenFlag_NoExpand))
+        {
+            return true;
+        }
+        Macro* macro = FindMacro(token);
+        if (macro == NULL)
+        {
+            ExpandBuiltinMacro(token);
+            return true;
+        }
+        if (macro->active)
+        {
+            // Never expanded again, even once the macro is done.
+            token.flags |= TokenFlag_NoExpand;
+            return true;
+        }
+
+        Array<int> argumentEnds(m_allocator);
+        Array<HLSLPreprocessorToken> arguments(m_allocator);
+        if (macro->functionLike)
+        {
+            if (!PeekIsOpenParen(reader))
+            {
+                return true;
+            }
+            if (!ReadArguments(reader, macro, token, argumentEnds, arguments))
+            {
+                return false;
+            }
+        }
+        ExpandMacro(reader, macro, token, argumentEnds, arguments);
+    }
+    return false;
+}
+
+void HLSLPreprocessor::ExpandBuiltinMacro(HLSLPreprocessorToken& token)
+{
+    if (!GetIsBuiltinMacro(token))
+    {
+        return;
+    }
+    // The line of a token from a macro is the line where the macro was called.
+    if (GetIsIdentifier(token, "__LINE__"))
+    {
+        token.text = m_strings.AddStringFormat("%d", token.line + m_lineOffset);
+        token.kind = HLSLPreprocessorToken_Number;
+    }
+    else
+    {
+        // Written like the file names of #line.
+        token.text = m_strings.AddStringFormat("\"%s\"", m_fileName);
+        token.kind = HLSLPreprocessorToken_String;
+    }
+    token.length = (unsigned int)strlen(token.text);
+    token.hash   = 0;
+}
+
+bool HLSLPreprocessor::PeekIsOpenParen(const Reader& reader) const
+{
+    for (int i = reader.contexts.GetSize() - 1; i >= 0; --i)
+    {
+        const Context& context = reader.contexts[i];
+        for (int j = context.position; j < context.end; ++j)
+        {
+            const HLSLPreprocessorToken& token = GetToken(context, j);
+            if (!GetIsSpace(token))
+            {
+                return GetIsPunctuator(token, "(");
+            }
+        }
+    }
+    return false;
+}
+
+bool HLSLPreprocessor::ReadArguments(Reader& reader, Macro* macro, const HLSLPreprocessorToken& name, Array<int>& argumentEnds, Array<HLSLPreprocessorToken>& arguments)
+{
+    HLSLPreprocessorToken token;
+    do
+    {
+        ReadRawToken(reader, token);
+    }
+    while (GetIsSpace(token));
+
+    int numParameters = macro->parameters.GetSize();
+    int depth = 0;
+    while (true)
+    {
+        if (!ReadRawToken(reader, token))
+        {
+            Error(name.line, "Syntax error: unterminated call to macro '%.*s'", (int)name.length, name.text);
+            return false;
+        }
+        if (token.kind == HLSLPreprocessorToken_Newline)
+        {
+            // Arguments can span lines, but the expansion is written on one.
+            token.kind   = HLSLPreprocessorToken_Space;
+            token.text   = " ";
+            token.length = 1;
+        }
+        if (depth == 0 && GetIsPunctuator(token, ")"))
+        {
+            break;
+        }
+        if (depth == 0 && GetIsPunctuator(token, ",") && !(macro->variadic && argumentEnds.GetSize() + 1 >= numParameters))
+        {
+            argumentEnds.PushBack(arguments.GetSize());
+            continue;
+        }
+        if (GetIsPunctuator(token, "("))
+        {
+            ++depth;
+        }
+        else if (GetIsPunctuator(token, ")"))
+        {
+            --depth;
+        }
+        arguments.PushBack(token);
+    }
+    argumentEnds.PushBack(arguments.GetSize());
+
+    // F() passes one empty argument, which is fine for a macro without parameters.
+    int numArguments = argumentEnds.GetSize();
+    if (numParameters == 0 && numArguments == 1 && SkipSpaces(arguments.GetSize() > 0 ? &arguments[0] : NULL, 0, arguments.GetSize()) == arguments.GetSize())
+    {
+        argumentEnds.Clear();
+        numArguments = 0;
+    }
+    // A variadic macro can be called without the variable arguments.
+    if (macro->variadic && numArguments == numParameters - 1)
+    {
+        argumentEnds.PushBack(arguments.GetSize());
+        ++numArguments;
+    }
+    if (numArguments != numParameters)
+    {
+        Error(name.line, "Syntax error: macro '%.*s' takes %d arguments, but %d were given", (int)name.length, name.text, numParameters, numArguments);
+        return false;
+    }
+    return true;
+}
+
+void HLSLPreprocessor::ExpandMacro(Reader& reader, Macro* macro, const HLSLPreprocessorToken& name, const Array<int>& argumentEnds, const Array<HLSLPreprocessorToken>& arguments)
+{
+    Array<HLSLPreprocessorToken> result(m_allocator);
+    Array<HLSLPreprocessorToken> expanded(m_allocator);
+    const Array<HLSLPreprocessorToken>& body = macro->body;
+
+    for (int i = 0; i < body.GetSize(); ++i)
+    {
+        const HLSLPreprocessorToken& token = body[i];
+        int parameter = (token.flags >> TokenFlag_ParameterShift) - 1;
+
+        // # turns the argument that follows into a string.
+        if (macro->functionLike && GetIsPunctuator(token, "#"))
+        {
+            int next = SkipSpaces(&body[0], i + 1, body.GetSize());
+            int nextParameter = (next < body.GetSize()) ? (body[next].flags >> TokenFlag_ParameterShift) - 1 : -1;
+            if (nextParameter >= 0)
+            {
+                int first = (nextParameter > 0) ? argumentEnds[nextParameter - 1] : 0;
+                int last  = argumentEnds[nextParameter];
+                result.PushBack(Stringize(arguments.GetSize() > 0 ? &arguments[first] : NULL, last - first));
+                i = next;
+                continue;
+            }
+        }
+
+        if (parameter < 0)
+        {
+            result.PushBack(token);
+            continue;
+        }
+
+        int first = (parameter > 0) ? argumentEnds[parameter - 1] : 0;
+        int last  = argumentEnds[parameter];
+
+        // Arguments next to ## are pasted as they are, the others are expanded first.
+        int previous = i - 1;
+        while (previous >= 0 && GetIsSpace(body[previous]))
+        {
+            --previous;
+        }
+        int next = SkipSpaces(&body[0], i + 1, body.GetSize());
+        bool pasted = (previous >= 0 && (body[previous].flags & TokenFlag_Paste)) || (next < body.GetSize() && (body[next].flags & TokenFlag_Paste));
+        if (pasted)
+        {
+            first = SkipSpaces(arguments.GetSize() > 0 ? &arguments[0] : NULL, first, last);
+            while (last > first && GetIsSpace(arguments[last - 1]))
+            {
+                --last;
+            }
+            if (first == last)
+            {
+                HLSLPreprocessorToken placemarker = token;
+                placemarker.text   = "";
+                placemarker.length = 0;
+                placemarker.kind   = HLSLPreprocessorToken_Other;
+                placemarker.flags  = TokenFlag_Placemarker;
+                result.PushBack(placemarker);
+            }
+            for (int j = first; j < last; ++j)
+            {
+                result.PushBack(arguments[j]);
+            }
+        }
+        else
+        {
+            expanded.Clear();
+            ExpandTokens(arguments.GetSize() > 0 ? &arguments[first] : NULL, last - first, expanded);
+            for (int j = 0; j < expanded.GetSize(); ++j)
+            {
+                result.PushBack(expanded[j]);
+            }
+        }
+    }
+
+    // Paste the tokens around ##, dropping the spaces around it.
+    int start = m_expansion.GetSize();
+    for (int i = 0; i < result.GetSize(); ++i)
+    {
+        HLSLPreprocessorToken token = result[i];
+        if (token.flags & TokenFlag_Paste)
+        {
+            while (m_expansion.GetSize() > start && GetIsSpace(m_expansion[m_expansion.GetSize() - 1]))
+            {
+                m_expansion.PopBack();
+            }
+            int next = SkipSpaces(&result[0], i + 1, result.GetSize());
+            if (m_expansion.GetSize() > start && next < result.GetSize())
+            {
+                HLSLPreprocessorToken& left = m_expansion[m_expansion.GetSize() - 1];
+                left = Paste(left, result[next]);
+                i = next;
+            }
+            continue;
+        }
+        m_expansion.PushBack(token);
+    }
+
+    // Everything is written where the macro was called.
+    int end = start;
+    for (int i = start; i < m_expansion.GetSize(); ++i)
+    {
+        HLSLPreprocessorToken token = m_expansion[i];
+        if (token.flags & TokenFlag_Placemarker)
+        {
+            continue;
+        }
+        token.line   = name.line;
+        token.flags  = (unsigned short)((token.flags & TokenFlag_NoExpand) | TokenFlag_Expanded);
+        m_expansion[end++] = token;
+    }
+    m_expansion.Resize(end);
+
+    Context& context = reader.contexts.PushBackNew();
+    context.tokens   = NULL;
+    context.position = start;
+    context.end      = end;
+    context.macro    = macro;
+    macro->active    = true;
+}
+
+void HLSLPreprocessor::ExpandTokens(const HLSLPreprocessorToken* tokens, int count, Array<HLSLPreprocessorToken>& result)
+{
+    Reader reader(m_allocator);
+    Context& context = reader.contexts.PushBackNew();
+    context.tokens   = tokens;
+    context.position = 0;
+    context.end      = count;
+    context.macro    = NULL;
+
+    HLSLPreprocessorToken token;
+    while (ReadToken(reader, token))
+    {
+        result.PushBack(token);
+    }
+}
+
+HLSLPreprocessorToken HLSLPreprocessor::Stringize(const HLSLPreprocessorToken* tokens, int count)
+{
+    Array<char> string(m_allocator);
+    string.PushBack('"');
+    int first = SkipSpaces(tokens, 0, count);
+    int last  = count;
+    while (last > first && GetIsSpace(tokens[last - 1]))
+    {
+        --last;
+    }
+    for (int i = first; i < last; ++i)
+    {
+        const HLSLPreprocessorToken& token = tokens[i];
+        if (GetIsSpace(token))
+        {
+            if (string[string.GetSize() - 1] != ' ')
+            {
+                string.PushBack(' ');
+            }
+            continue;
+        }
+        for (unsigned int j = 0; j < token.length; ++j)
+        {
+            char c = token.text[j];
+            if (token.kind == HLSLPreprocessorToken_String && (c == '"' || c == '\\'))
+            {
+                string.PushBack('\\');
+            }
+            string.PushBack(c);
+        }
+    }
+    string.PushBack('"');
+
+    HLSLPreprocessorToken result;
+    result.length = string.GetSize();
+    result.text   = m_strings.AddString(&string[0], result.length, String_Hash(&string[0], result.length));
+    result.line   = 0;
+    result.hash   = 0;
+    result.kind   = HLSLPreprocessorToken_String;
+    result.flags  = 0;
+    return result;
+}
+
+HLSLPreprocessorToken HLSLPreprocessor::Paste(const HLSLPreprocessorToken& left, const HLSLPreprocessorToken& right)
+{
+    if (left.flags & TokenFlag_Placemarker)
+    {
+        return right;
+    }
+    if (right.flags & TokenFlag_Placemarker)
+    {
+        return left;
+    }
+
+    Array<char> string(m_allocator);
+    string.Resize(left.length + right.length);
+    memcpy(&string[0], left.text, left.length);
+    memcpy(&string[left.length], right.text, right.length);
+
+    HLSLPreprocessorToken result = left;
+    result.length = string.GetSize();
+    result.text   = m_strings.AddString(&string[0], result.length, String_Hash(&string[0], result.length));
+
+    // The pasted text is lexed again to find what it is.
+    Array<HLSLPreprocessorToken> tokens(m_allocator);
+    LexTokens(result.text, result.length, tokens);
+    result.kind  = tokens[0].kind;
+    result.hash  = tokens[0].hash;
+    result.flags = 0;
+    return result;
+}
+
+/** Evaluates the expression of an #if, once the macros are expanded. */
+struct ConditionParser
+{
+    const HLSLPreprocessorToken*    tokens;
+    int                             count;
+    int                             position;
+    bool                            error;
+
+    bool Accept(const char* punctuator)
+    {
+        if (position < count && GetIsPunctuator(tokens[position], punctuator))
+        {
+            ++position;
+            return true;
+        }
+        return false;
+    }
+
+    /** Arithmetic that can overflow is done unsigned, so it wraps around instead of
+    being undefined. */
+    static long long Wrap(unsigned long long value)
+    {
+        return value > (unsigned long long)LLONG_MAX ? -(long long)(~value) - 1 : (long long)value;
+    }
+
+    long long ParseConditional()
+    {
+        long long value = ParseBinary(0);
+        if (Accept("?"))
+        {
+            long long a = ParseConditional();
+            if (!Accept(":"))
+            {
+                error = true;
+                return 0;
+            }
+            long long b = ParseConditional();
+            return value ? a : b;
+        }
+        return value;
+    }
+
+    static int GetPriority(const HLSLPreprocessorToken& token)
+    {
+        static const char* operators[] = { "||", "&&", "|", "^", "&", "==", "!=", "<", ">", "<=", ">=", "<<", ">>", "+", "-", "*", "/", "%" };
+        static const int priorities[]  = { 1,    2,    3,   4,   5,   6,    6,    7,   7,   7,    7,    8,    8,    9,   9,   10,  10,  10  };
+        for (int i = 0; i < (int)(sizeof(priorities) / sizeof(priorities[0])); ++i)
+        {
+            if (GetIsPunctuator(token, operators[i]))
+            {
+                return priorities[i];
+            }
+        }
+        return 0;
+    }
+
+    long long ParseBinary(int minPriority)
+    {
+        long long value = ParseUnary();
+        while (position < count && !error)
+        {
+            const HLSLPreprocessorToken& op = tokens[position];
+            int priority = GetPriority(op);
+            if (priority <= minPriority)
+            {
+                break;
+            }
+            ++position;
+            long long rhs = ParseBinary(priority);
+            if      (GetIsPunctuator(op, "||")) value = value || rhs;
+            else if (GetIsPunctuator(op, "&&")) value = value && rhs;
+            else if (GetIsPunctuator(op, "|"))  value = value | rhs;
+            else if (GetIsPunctuator(op, "^"))  value = value ^ rhs;
+            else if (GetIsPunctuator(op, "&"))  value = value & rhs;
+            else if (GetIsPunctuator(op, "==")) value = value == rhs;
+            else if (GetIsPunctuator(op, "!=")) value = value != rhs;
+            else if (GetIsPunctuator(op, "<"))  value = value < rhs;
+            else if (GetIsPunctuator(op, ">"))  value = value > rhs;
+            else if (GetIsPunctuator(op, "<=")) value = value <= rhs;
+            else if (GetIsPunctuator(op, ">=")) value = value >= rhs;
+            else if (GetIsPunctuator(op, "<<")) value = Wrap((unsigned long long)value << (rhs & 63));
+            else if (GetIsPunctuator(op, ">>")) value = value >> (rhs & 63);
+            else if (GetIsPunctuator(op, "+"))  value = Wrap((unsigned long long)value + (unsigned long long)rhs);
+            else if (GetIsPunctuator(op, "-"))  value = Wrap((unsigned long long)value - (unsigned long long)rhs);
+            else if (GetIsPunctuator(op, "*"))  value = Wrap((unsigned long long)value * (unsigned long long)rhs);
+            else if (rhs == 0)                  error = true;
+            else if (rhs == -1 && value == LLONG_MIN) error = true;
+            else if (GetIsPunctuator(op, "/"))  value = value / rhs;
+            else                                value = value % rhs;
+        }
+        return value;
+    }
+
+    long long ParseUnary()
+    {
+        if (Accept("!")) return !ParseUnary();
+        if (Accept("~")) return ~ParseUnary();
+        if (Accept("-")) return Wrap(0 - (unsigned long long)ParseUnary());
+        if (Accept("+")) return ParseUnary();
+        if (Accept("("))
+        {
+            long long value = ParseConditional();
+            if (!Accept(")"))
+            {
+                error = true;
+            }
+            return value;
+        }
+        if (position >= count)
+        {
+            error = true;
+            return 0;
+        }
+
+        const HLSLPreprocessorToken& token = tokens[position++];
+        if (token.kind == HLSLPreprocessorToken_Identifier)
+        {
+            // Identifiers left after the expansion are not macros.
+            return 0;
+        }
+        if (token.kind == HLSLPreprocessorToken_Number)
+        {
+            char number[64];
+            String_Printf(number, sizeof(number), "%.*s", (int)token.length, token.text);
+            char* end = NULL;
+            long long value = strtoll(number, &end, 0);
+            while (*end == 'u' || *end == 'U' || *end == 'l' || *end == 'L')
+            {
+                ++end;
+            }
+            if (*end != 0)
+            {
+                error = true;
+            }
+            return value;
+        }
+        if (token.kind == HLSLPreprocessorToken_String && token.text[0] == '\'' && token.length == 3)
+        {
+            return token.text[1];
+        }
+        error = true;
+        return 0;
+    }
+};
+
+bool HLSLPreprocessor::EvaluateCondition(int line, const HLSLPreprocessorToken* tokens, int count, bool& result)
+{
+    // defined is replaced before the macros are expanded.
+    static const HLSLPreprocessorToken zero = { "0", 1, 0, 0, HLSLPreprocessorToken_Number, 0 };
+    static const HLSLPreprocessorToken one  = { "1", 1, 0, 0, HLSLPreprocessorToken_Number, 0 };
+    Array<HLSLPreprocessorToken> replaced(m_allocator);
+    for (int i = 0; i < count; ++i)
+    {
+        if (!GetIsIdentifier(tokens[i], "defined"))
+        {
+            replaced.PushBack(tokens[i]);
+            continue;
+        }
+        int index = SkipSpaces(tokens, i + 1, count);
+        bool parenthesis = index < count && GetIsPunctuator(tokens[index], "(");
+        if (parenthesis)
+        {
+            index = SkipSpaces(tokens, index + 1, count);
+        }
+        if (index == count || tokens[index].kind != HLSLPreprocessorToken_Identifier)
+        {
+            Error(line, "Syntax error: expected identifier after defined");
+            return false;
+        }
+        replaced.PushBack(FindMacro(tokens[index]) != NULL || GetIsBuiltinMacro(tokens[index]) ? one : zero);
+        if (parenthesis)
+        {
+            index = SkipSpaces(tokens, index + 1, count);
+            if (index == count || !GetIsPunctuator(tokens[index], ")"))
+            {
+                Error(line, "Syntax error: expected ')' after defined");
+                return false;
+            }
+        }
+        i = index;
+    }
+
+    Array<HLSLPreprocessorToken> expanded(m_allocator);
+    ExpandTokens(replaced.GetSize() > 0 ? &replaced[0] : NULL, replaced.GetSize(), expanded);
+    if (m_error)
+    {
+        return false;
+    }
+
+    Array<HLSLPreprocessorToken> expression(m_allocator);
+    for (int i = 0; i < expanded.GetSize(); ++i)
+    {
+        if (!GetIsSpace(expanded[i]))
+        {
+            expression.PushBack(expanded[i]);
+        }
+    }
+
+    ConditionParser parser;
+    parser.tokens   = expression.GetSize() > 0 ? &expression[0] : NULL;
+    parser.count    = expression.GetSize();
+    parser.position = 0;
+    parser.error    = false;
+    long long value = parser.ParseConditional();
+    if (parser.error || parser.position != parser.count)
+    {
+        Error(line, "Syntax error: invalid expression in #if");
+        return false;
+    }
+    result = value != 0;
+    return true;
+}
+
+void HLSLPreprocessor::EmitText(const char* text, size_t length)
+{
+    int size = m_output.GetSize();
+    m_output.Resize(size + (int)length);
+    memcpy(&m_output[size], text, length);
+}
+
+void HLSLPreprocessor::SyncLine(int line)
+{
+    // Small gaps are filled with newlines, anything else needs a #line.
+    if (m_outputFileName == m_fileName && line >= m_outputLine && line - m_outputLine <= 8)
+    {
+        while (m_outputLine < line)
+        {
+            EmitText("\n", 1);
+            ++m_outputLine;
+        }
+        return;
+    }
+
+    int size = m_output.GetSize();
+    if (size > 0 && m_output[size - 1] != '\n')
+    {
+        EmitText("\n", 1);
+    }
+    char directive[32];
+    EmitText(directive, String_Printf(directive, sizeof(directive), "#line %d \"", line));
+    EmitText(m_fileName, strlen(m_fileName));
+    EmitText("\"\n", 2);
+    m_outputFileName = m_fileName;
+    m_outputLine     = line;
+    m_spaceNeeded    = false;
+}
+
+void HLSLPreprocessor::Emit(const HLSLPreprocessorToken& token)
+{
+    if (token.kind == HLSLPreprocessorToken_Newline)
+    {
+        EmitText("\n", 1);
+        ++m_outputLine;
+        m_spaceNeeded = false;
+        return;
+    }
+
+    if (token.kind == HLSLPreprocessorToken_Space)
+    {
+        // Comments and continuations only keep their newlines.
+        int numNewlines = 0;
+        for (unsigned int i = 0; i < token.length; ++i)
+        {
+            numNewlines += (token.text[i] == '\n');
+        }
+        if (numNewlines == 0)
+        {
+            EmitText(" ", 1);
+        }
+        for (int i = 0; i < numNewlines; ++i)
+        {
+            EmitText("\n", 1);
+            ++m_outputLine;
+        }
+        m_spaceNeeded = false;
+        return;
+    }
+
+    SyncLine(token.line + m_lineOffset);
+
+    // Keep the tokens of an expansion from running into their neighbors.
+    bool expanded = (token.flags & TokenFlag_Expanded) != 0;
+    int size = m_output.GetSize();
+    if ((expanded || m_spaceNeeded) && size > 0 && m_output[size - 1] != ' ' && m_output[size - 1] != '\n')
+    {
+        EmitText(" ", 1);
+    }
+    EmitText(token.text, token.length);
+    m_spaceNeeded = expanded;
+}
+
+void HLSLPreprocessor::Error(int line, const char* format, ...)
+{
+    // Only the first error is reported, like the tokenizer.
+    if (m_error)
+    {
+        return;
+    }
+    m_error = true;
+
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer) - 1, format, args);
+    va_end(args);
+
+    m_logger->LogError(m_logger->m_userData, "%s(%d) : %s\n", m_fileName, line + m_lineOffset, buffer);
+}
+
+}
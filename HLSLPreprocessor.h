@@ -0,0 +1,236 @@
+#ifndef HLSL_PREPROCESSOR_H
+#define HLSL_PREPROCESSOR_H
+
+#include "Engine.h"
+
+#include "HLSLDependencyManifest.h"
+#include "HLSLTokenizer.h"
+
+#include <mutex>
+
+namespace M4
+{
+
+class HLSLTokenCache;
+
+enum HLSLPreprocessorTokenKind
+{
+    HLSLPreprocessorToken_Identifier,
+    HLSLPreprocessorToken_Number,
+    HLSLPreprocessorToken_String,       // String or character literal.
+    HLSLPreprocessorToken_Punctuator,
+    HLSLPreprocessorToken_Space,        // Spaces, comments and line continuations.
+    HLSLPreprocessorToken_Newline,
+    HLSLPreprocessorToken_Other,
+};
+
+/** Preprocessing token. The text points into the source, or into the string pool of
+the preprocessor for tokens made by # and ##. */
+struct HLSLPreprocessorToken
+{
+    const char*     text;
+    unsigned int    length;
+    int             line;
+    unsigned int    hash;               // String_Hash of the text, only for identifiers.
+    unsigned short  kind;
+    unsigned short  flags;
+};
+
+/** A source file split into preprocessing tokens. */
+struct HLSLPreprocessorFile
+{
+    explicit HLSLPreprocessorFile(Allocator* allocator);
+    ~HLSLPreprocessorFile();
+
+    /** Copies the text and splits it into tokens. */
+    void Lex(const char* name, const char* text, size_t length);
+
+    Allocator*                      allocator;
+    char*                           name;
+    char*                           text;
+    size_t                          length;
+    unsigned long long              hash;       // String_Hash64 of the text.
+    Array<HLSLPreprocessorToken>    tokens;     // Ends with a newline.
+};
+
+/** Keeps the tokens of the included files, so that headers shared by many shaders
+are only read and lexed once. Files that couldn't be read are remembered too, since
+includes are looked for in several places. The files are never reloaded, Clear drops
+them once they may have changed. A cache can be used by several preprocessors on
+different threads, as long as the allocator and the read callback are thread safe. */
+class HLSLIncludeCache
+{
+
+public:
+
+    explicit HLSLIncludeCache(Allocator* allocator);
+    ~HLSLIncludeCache();
+
+    /** Returns the file, reading it with readFile the first time it is requested.
+    Returns NULL if it can't be read. Files are read without holding the lock, so
+    two threads may read the same file, and only one of them keeps it. */
+    const HLSLPreprocessorFile* GetFile(const char* fileName, FileReadCallback readFile);
+
+    void Clear();
+
+private:
+
+    struct Entry
+    {
+        const char*                 name;       // Pooled.
+        unsigned int                hash;
+        HLSLPreprocessorFile*       file;       // NULL if the file couldn't be read.
+    };
+
+    /** Returns the slot of the file, or the empty slot where it should be added. */
+    int FindSlot(const char* fileName, unsigned int hash) const;
+
+    // Not copyable.
+    HLSLIncludeCache(const HLSLIncludeCache&);
+    void operator=(const HLSLIncludeCache&);
+
+    Allocator*                      m_allocator;
+    std::mutex                      m_mutex;
+    StringPool                      m_names;
+    Array<Entry>                    m_entries;
+    Array<int>                      m_slots;        // Hash table of the entries by name, -1 when empty.
+
+};
+
+/** Expands #include, #define and conditional compilation, and writes the result as
+source for HLSLTokenizer. File and line changes are written as #line directives, so
+that the tokens of the output keep their original locations. #pragma directives are
+copied to the output. */
+class HLSLPreprocessor
+{
+
+public:
+
+    /** Includes are read with readFile, through the cache when there is one, or
+    through a cache owned by the preprocessor that is cleared by each Preprocess. */
+    HLSLPreprocessor(Allocator* allocator, Logger* logger, FileReadCallback readFile, HLSLIncludeCache* cache = NULL);
+    ~HLSLPreprocessor();
+
+    /** Defines a macro before the source is read, as with -D. The name may have
+    parameters, like Define("F(x)", "(x * 2)"). */
+    void Define(const char* name, const char* value = "1");
+
+    /** Drops the macros added with Define. */
+    void Reset();
+
+    /** Adds the files read by Preprocess to the manifest, including the ones that
+    were looked for and not found, and the macros given with Define. The manifest is
+    not cleared, so that it can cover several files. Pass NULL to disable. */
+    void SetDependencies(HLSLDependencyManifest* dependencies) { m_dependencies = dependencies; }
+
+    /** Makes Preprocess load the output and its tokens from the cache when the source,
+    the macros and the included files haven't changed, without reading the includes
+    other than to hash them. Otherwise the output is tokenized and stored in the cache.
+    Includes are read with readFile either way. Pass NULL to disable. */
+    void SetTokenCache(const HLSLTokenCache* tokenCache) { m_tokenCache = tokenCache; }
+
+    /** Preprocesses the buffer. Returns false and reports an error if it fails. */
+    bool Preprocess(const char* fileName, const char* buffer, size_t length);
+
+    /** The output is zero terminated, and valid until the next Preprocess. */
+    const char* GetOutput() const { return &m_output[0]; }
+    size_t GetOutputLength() const { return m_output.GetSize() - 1; }
+
+    /** Tokens of the output for HLSLParser::SetTokens, or NULL without a token cache.
+    Valid until the next Preprocess. */
+    const HLSLTokenBuffer* GetTokens() const { return (m_tokens.GetSize() > 0) ? &m_tokens : NULL; }
+
+private:
+
+    struct Macro;
+    struct Reader;
+
+    /** Tokens being read, from a file or from the expansion of a macro. */
+    struct Context
+    {
+        const HLSLPreprocessorToken*    tokens;     // NULL when the tokens are in m_expansion.
+        int                             position;
+        int                             end;
+        Macro*                          macro;      // Enabled again once the context is read.
+    };
+
+    struct Conditional
+    {
+        bool                            active;     // The current branch is compiled.
+        bool                            taken;      // A branch was taken, or the parent isn't active.
+        bool                            sawElse;
+    };
+
+    bool ProcessFile(const HLSLPreprocessorFile* file, int depth);
+    bool ProcessDirective(const HLSLPreprocessorFile* file, const HLSLPreprocessorToken* tokens, int count, int depth);
+    /** The tokens follow the name of the directive, which is on the line. */
+    bool ProcessInclude(const HLSLPreprocessorFile* file, int line, const HLSLPreprocessorToken* tokens, int count, int depth);
+    bool ProcessDefine(int line, const HLSLPreprocessorToken* tokens, int count);
+    bool ProcessLine(int line, const HLSLPreprocessorToken* tokens, int count);
+    bool EvaluateCondition(int line, const HLSLPreprocessorToken* tokens, int count, bool& result);
+
+    Macro* FindMacro(const HLSLPreprocessorToken& token) const;
+    Macro* AddMacro(const HLSLPreprocessorToken& name);
+    void ClearMacros();
+    bool GetIsActive() const;
+
+    const HLSLPreprocessorToken& GetToken(const Context& context, int index) const;
+    bool ReadRawToken(Reader& reader, HLSLPreprocessorToken& token);
+
+    /** Reads the next token, expanding macros. Returns false at the end of the reader. */
+    bool ReadToken(Reader& reader, HLSLPreprocessorToken& token);
+    bool PeekIsOpenParen(const Reader& reader) const;
+
+    /** Replaces __LINE__ and __FILE__, unless they were defined as macros. */
+    void ExpandBuiltinMacro(HLSLPreprocessorToken& token);
+    bool ReadArguments(Reader& reader, Macro* macro, const HLSLPreprocessorToken& name, Array<int>& argumentEnds, Array<HLSLPreprocessorToken>& arguments);
+    void ExpandMacro(Reader& reader, Macro* macro, const HLSLPreprocessorToken& name, const Array<int>& argumentEnds, const Array<HLSLPreprocessorToken>& arguments);
+    void ExpandTokens(const HLSLPreprocessorToken* tokens, int count, Array<HLSLPreprocessorToken>& result);
+    HLSLPreprocessorToken Stringize(const HLSLPreprocessorToken* tokens, int count);
+    HLSLPreprocessorToken Paste(const HLSLPreprocessorToken& left, const HLSLPreprocessorToken& right);
+
+    void Emit(const HLSLPreprocessorToken& token);
+    void EmitText(const char* text, size_t length);
+    void SyncLine(int line);
+
+    const HLSLPreprocessorFile* LoadFile(const char* fileName);
+
+    void Error(int line, const char* format, ...);
+
+private:
+
+    Allocator*                          m_allocator;
+    Logger*                             m_logger;
+    FileReadCallback                    m_readFile;
+    HLSLIncludeCache*                   m_cache;            // Never NULL.
+    HLSLDependencyManifest*             m_dependencies;
+    const HLSLTokenCache*               m_tokenCache;
+    HLSLDependencyManifest              m_manifest;         // Files read by the last Preprocess, when they are needed.
+    bool                                m_recordDependencies;
+    bool                                m_error;
+
+    StringPool                          m_strings;
+    Array<Macro*>                       m_macros;
+    Array<Macro*>                       m_macroSlots;       // Hash table of the macros by name.
+    Array<const char*>                  m_defines;          // Added with Define, as "name value".
+    HLSLPreprocessorFile                m_defineFile;
+    HLSLIncludeCache                    m_includeCache;     // Used when no cache is given.
+    Array<const HLSLPreprocessorFile*>  m_onceFiles;        // Files with #pragma once.
+    Array<Conditional>                  m_conditionals;
+    int                                 m_firstConditional; // First conditional of the current file.
+    Array<HLSLPreprocessorToken>        m_expansion;        // Tokens of the macros being expanded.
+
+    // Location of the output, in the source files.
+    const char*                         m_fileName;         // Name used by the current file, #line can change it.
+    int                                 m_lineOffset;       // Added to the lines of the current file by #line.
+    const char*                         m_outputFileName;
+    int                                 m_outputLine;
+    bool                                m_spaceNeeded;      // The last token came from a macro.
+    Array<char>                         m_output;
+    HLSLTokenBuffer                     m_tokens;           // Of the output, with a token cache.
+
+};
+
+}
+
+#endif
@@ -0,0 +1,227 @@
+#include "Engine.h"
+
+#include "HLSLTokenCache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+#if defined(_WIN32)
+#include <process.h> // _getpid
+#else
+#include <unistd.h> // getpid
+#endif
+
+namespace M4
+{
+
+static const char _tokenCacheMagic[8] = { 'H', 'L', 'S', 'L', 'T', 'O', 'K', 0 };
+static const unsigned int _tokenCacheByteOrder = 0x01020304;
+
+/** The arrays of the token buffer follow the header, 4 byte aligned ones first, and
+then the manifest and the preprocessed text. */
+struct HLSLTokenCache::Header
+{
+    char                magic[8];
+    unsigned int        version;
+    unsigned int        byteOrder;
+    unsigned long long  key;
+    unsigned long long  manifestLength;
+    unsigned long long  textLength;
+    unsigned long long  payloadHash;    // String_Hash64 of everything after the header.
+    int                 numTokens;
+    int                 numIdentifiers;
+    int                 numFileNames;
+    int                 numChars;
+};
+
+static size_t GetPayloadSize(int numTokens, int numIdentifiers, int numFileNames, int numChars)
+{
+    return (size_t)numTokens * (sizeof(unsigned int) + sizeof(int) + sizeof(unsigned int) + sizeof(unsigned short)) +
+           (size_t)numIdentifiers * sizeof(HLSLTokenBuffer::Identifier) +
+           (size_t)numFileNames * sizeof(HLSLTokenBuffer::FileName) +
+           (size_t)numChars;
+}
+
+template <typename T>
+static const char* ReadArray(const char* data, Array<T>& array, int size)
+{
+    array.Resize(size);
+    if (size > 0)
+    {
+        memcpy(&array[0], data, size * sizeof(T));
+    }
+    return data + size * sizeof(T);
+}
+
+template <typename T>
+static unsigned long long HashArray(const Array<T>& array, unsigned long long hash)
+{
+    return (array.GetSize() == 0) ? hash : String_Hash64((const char*)&array[0], array.GetSize() * sizeof(T), hash);
+}
+
+/** Hashes the payload in the order it is written. */
+static unsigned long long GetPayloadHash(const HLSLTokenBuffer& tokens, const Array<char>& manifest, const char* text, size_t length)
+{
+    unsigned long long hash = String_Hash64Seed;
+    hash = HashArray(tokens.offsets, hash);
+    hash = HashArray(tokens.lines, hash);
+    hash = HashArray(tokens.values, hash);
+    hash = HashArray(tokens.identifiers, hash);
+    hash = HashArray(tokens.fileNames, hash);
+    hash = HashArray(tokens.kinds, hash);
+    hash = HashArray(tokens.chars, hash);
+    hash = HashArray(manifest, hash);
+    return String_Hash64(text, length, hash);
+}
+
+template <typename T>
+static bool WriteArray(FILE* file, const Array<T>& array)
+{
+    return array.GetSize() == 0 || fwrite(&array[0], sizeof(T), array.GetSize(), file) == (size_t)array.GetSize();
+}
+
+HLSLTokenCache::HLSLTokenCache(Allocator* allocator, const char* directory)
+{
+    size_t length = strlen(directory);
+    m_allocator = allocator;
+    m_directory = (char*)allocator->New(allocator->m_userData, length + 1);
+    memcpy(m_directory, directory, length + 1);
+}
+
+HLSLTokenCache::~HLSLTokenCache()
+{
+    m_allocator->Delete(m_allocator->m_userData, m_directory);
+}
+
+void HLSLTokenCache::GetFileName(unsigned long long key, char* fileName, int fileNameSize) const
+{
+    String_Printf(fileName, fileNameSize, "%s/%016llx-v%d.tokens", m_directory, key, HLSLTokenizer::s_version);
+}
+
+bool HLSLTokenCache::Load(const HLSLDependencyManifest& inputs, FileReadCallback readFile, Array<char>& text, HLSLTokenBuffer* tokens, HLSLDependencyManifest* dependencies) const
+{
+    unsigned long long key = inputs.GetKey();
+    char fileName[1024];
+    GetFileName(key, fileName, sizeof(fileName));
+
+    MappedFile file;
+    if (!file.Open(fileName) || file.GetSize() < sizeof(Header))
+    {
+        return false;
+    }
+
+    Header header;
+    memcpy(&header, file.GetData(), sizeof(header));
+    if (memcmp(header.magic, _tokenCacheMagic, sizeof(_tokenCacheMagic)) != 0 ||
+        header.version != (unsigned int)HLSLTokenizer::s_version ||
+        header.byteOrder != _tokenCacheByteOrder ||
+        header.key != key ||
+        header.numTokens <= 0 || header.numIdentifiers < 0 || header.numFileNames <= 0 || header.numChars < 0 ||
+        header.manifestLength > file.GetSize() || header.textLength > file.GetSize() ||
+        file.GetSize() != sizeof(Header) + GetPayloadSize(header.numTokens, header.numIdentifiers, header.numFileNames, header.numChars) + header.manifestLength + header.textLength ||
+        String_Hash64(file.GetData() + sizeof(Header), file.GetSize() - sizeof(Header)) != header.payloadHash)
+    {
+        return false;
+    }
+
+    // Only the files that the inputs don't cover need to be read.
+    const char* data = file.GetData() + sizeof(Header) + GetPayloadSize(header.numTokens, header.numIdentifiers, header.numFileNames, header.numChars);
+    if (!dependencies->Read(data, (size_t)header.manifestLength) || !dependencies->GetIsUpToDate(readFile, &inputs))
+    {
+        dependencies->Clear();
+        return false;
+    }
+    data += header.manifestLength;
+
+    size_t length = (size_t)header.textLength;
+    text.Resize((int)length + 1);
+    memcpy(&text[0], data, length);
+    text[(int)length] = 0;
+
+    tokens->Clear();
+    data = file.GetData() + sizeof(Header);
+    data = ReadArray(data, tokens->offsets, header.numTokens);
+    data = ReadArray(data, tokens->lines, header.numTokens);
+    data = ReadArray(data, tokens->values, header.numTokens);
+    data = ReadArray(data, tokens->identifiers, header.numIdentifiers);
+    data = ReadArray(data, tokens->fileNames, header.numFileNames);
+    data = ReadArray(data, tokens->kinds, header.numTokens);
+    data = ReadArray(data, tokens->chars, header.numChars);
+
+    // The tokens point into the text, so a damaged file must not be walked.
+    if (!tokens->GetIsValid(length))
+    {
+        tokens->Clear();
+        dependencies->Clear();
+        text.Clear();
+        return false;
+    }
+    return true;
+}
+
+bool HLSLTokenCache::Store(const HLSLDependencyManifest& inputs, const HLSLDependencyManifest& dependencies, const char* text, size_t length, const HLSLTokenBuffer& tokens) const
+{
+    if (tokens.errorToken >= 0 || tokens.GetSize() == 0)
+    {
+        return false;
+    }
+
+    unsigned long long key = inputs.GetKey();
+    char fileName[1024];
+    GetFileName(key, fileName, sizeof(fileName));
+
+    Array<char> manifest(m_allocator);
+    dependencies.Write(manifest);
+
+    // The name of the temporary file is unique to the process and the call.
+    static std::atomic<unsigned int> s_numFiles(0);
+#if defined(_WIN32)
+    int processId = _getpid();
+#else
+    int processId = (int)getpid();
+#endif
+    char tempFileName[1100];
+    String_Printf(tempFileName, sizeof(tempFileName), "%s.%d-%u.tmp", fileName, processId, s_numFiles++);
+
+    FILE* file = fopen(tempFileName, "wb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    Header header;
+    memcpy(header.magic, _tokenCacheMagic, sizeof(_tokenCacheMagic));
+    header.version          = HLSLTokenizer::s_version;
+    header.byteOrder        = _tokenCacheByteOrder;
+    header.key              = key;
+    header.manifestLength   = manifest.GetSize();
+    header.textLength       = length;
+    header.payloadHash      = GetPayloadHash(tokens, manifest, text, length);
+    header.numTokens        = tokens.GetSize();
+    header.numIdentifiers   = tokens.identifiers.GetSize();
+    header.numFileNames     = tokens.fileNames.GetSize();
+    header.numChars         = tokens.chars.GetSize();
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        WriteArray(file, tokens.offsets) &&
+        WriteArray(file, tokens.lines) &&
+        WriteArray(file, tokens.values) &&
+        WriteArray(file, tokens.identifiers) &&
+        WriteArray(file, tokens.fileNames) &&
+        WriteArray(file, tokens.kinds) &&
+        WriteArray(file, tokens.chars) &&
+        WriteArray(file, manifest) &&
+        (length == 0 || fwrite(text, 1, length, file) == length);
+    written = (fclose(file) == 0) && written;
+
+    // Readers only ever see the complete file.
+    if (!written || rename(tempFileName, fileName) != 0)
+    {
+        remove(tempFileName);
+        return false;
+    }
+    return true;
+}
+
+}
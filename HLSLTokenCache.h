@@ -0,0 +1,63 @@
+#ifndef HLSL_TOKEN_CACHE_H
+#define HLSL_TOKEN_CACHE_H
+
+#include "Engine.h"
+
+#include "HLSLDependencyManifest.h"
+#include "HLSLTokenizer.h"
+
+namespace M4
+{
+
+/** Keeps preprocessed shaders on disk with their tokens, so that a shader whose
+source, macros and included files haven't changed since it was last preprocessed,
+by any process, is not preprocessed or lexed again.
+An entry is named by the key of the inputs of the shader: a manifest with the source
+file and the options, which are known before preprocessing. It holds the manifest of
+the files that were read to preprocess it, and it is only used if none of them has
+changed. The files are memory mapped when they are loaded.
+Several processes can use the same directory at once: a file is written under a
+temporary name and renamed once it is complete, so it is either missing or whole,
+and it is never modified once it has its name. */
+class HLSLTokenCache
+{
+
+public:
+
+    /** The directory must exist. */
+    HLSLTokenCache(Allocator* allocator, const char* directory);
+    ~HLSLTokenCache();
+
+    /** Fills the preprocessed text, zero terminated, and its tokens from the entry
+    of the inputs, and replaces dependencies with the manifest it was stored with.
+    The files of the manifest are read again with readFile to check them, except
+    the ones that are in the inputs. Returns false if there is no entry, if it is
+    out of date, or if the file is not valid. */
+    bool Load(const HLSLDependencyManifest& inputs, FileReadCallback readFile, Array<char>& text, HLSLTokenBuffer* tokens, HLSLDependencyManifest* dependencies) const;
+
+    /** Stores the preprocessed text and its tokens, as filled by HLSLTokenizer::Tokenize,
+    with the manifest of the files they depend on. Tokens with an error are not stored,
+    since the error message has the file name in it. Returns false if the file can't
+    be written. */
+    bool Store(const HLSLDependencyManifest& inputs, const HLSLDependencyManifest& dependencies, const char* text, size_t length, const HLSLTokenBuffer& tokens) const;
+
+private:
+
+    struct Header;
+
+    void GetFileName(unsigned long long key, char* fileName, int fileNameSize) const;
+
+    // Not copyable.
+    HLSLTokenCache(const HLSLTokenCache&);
+    void operator=(const HLSLTokenCache&);
+
+private:
+
+    Allocator*      m_allocator;
+    char*           m_directory;
+
+};
+
+}
+
+#endif
@@ -9,6 +9,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
+
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HLSL_TOKENIZER_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if _MSC_VER
+#include <intrin.h>
+#endif
+#endif
 
 namespace M4
 {
@@ -124,290 +136,946 @@ static const char* _reservedWords[] =
         "R8UI",
     };
 
-static bool GetIsSymbol(char c)
-{
-    switch (c)
-    {
-    case ';':
-    case ':':
-    case '(': case ')':
-    case '[': case ']':
-    case '{': case '}':
-    case '-': case '+':
-    case '*': case '/':
-    case '%':
-    case '?':
-    case '!':
-    case ',':
-    case '=':
-    case '.':
-    case '<': case '>':
-    case '|': case '&': case '^': case '~':
-    case '@':
-        return true;
+// Reserved words are looked up in a hash table that is built on first use. The slot
+// comes from the String_Hash of the word, which the tokenizer computes while scanning
+// identifiers anyway. The multiplier was picked so that no two reserved words share a
+// slot, which makes a lookup cost at most one compare for a reserved word. If a new
+// word collides the table still works, but some lookups need an extra compare.
+static const unsigned int _reservedWordMultiplier = 0x6a2acc09u;
+static const int _reservedWordTableBits = 9;
+static const int _reservedWordTableSize = 1 << _reservedWordTableBits;
+static const size_t _maxReservedWordLength = 16;
+
+static unsigned int GetReservedWordSlot(unsigned int hash)
+{
+    return (hash * _reservedWordMultiplier) >> (32 - _reservedWordTableBits);
+}
+
+struct ReservedWordTable
+{
+    ReservedWordTable()
+    {
+        memset(slot, 0, sizeof(slot));
+        const int numReservedWords = sizeof(_reservedWords) / sizeof(const char*);
+        for (int i = 0; i < numReservedWords; ++i)
+        {
+            unsigned int index = GetReservedWordSlot(String_Hash(_reservedWords[i], strlen(_reservedWords[i])));
+            while (slot[index] != 0)
+            {
+                index = (index + 1) & (_reservedWordTableSize - 1);
+            }
+            slot[index] = (unsigned char)(i + 1);
+        }
     }
-    return false;
+
+    // Index of the reserved word plus one, 0 for empty slots.
+    unsigned char slot[_reservedWordTableSize];
+};
+
+/** Returns the token of the reserved word, or HLSLToken_Identifier if the word isn't
+reserved. The hash must be String_Hash(word, length). */
+static int FindReservedWord(const char* word, size_t length, unsigned int hash)
+{
+    static const ReservedWordTable table;
+
+    if (length > _maxReservedWordLength)
+    {
+        return HLSLToken_Identifier;
+    }
+
+    unsigned int index = GetReservedWordSlot(hash);
+    while (table.slot[index] != 0)
+    {
+        int i = table.slot[index] - 1;
+        if (strncmp(_reservedWords[i], word, length) == 0 && _reservedWords[i][length] == 0)
+        {
+            return 256 + i;
+        }
+        index = (index + 1) & (_reservedWordTableSize - 1);
+    }
+    return HLSLToken_Identifier;
+}
+
+enum CharClass
+{
+    CharClass_End       = 1 << 0,   // Terminating zero.
+    CharClass_Space     = 1 << 1,   // What isspace accepts in the C locale.
+    CharClass_Symbol    = 1 << 2,   // Single character tokens.
+    CharClass_Operator  = 1 << 3,   // First character of a two character operator.
+    CharClass_Number    = 1 << 4,   // May start a number, strtod also accepts inf and nan.
+};
+
+#define E CharClass_End
+#define S CharClass_Space
+#define Y CharClass_Symbol
+#define O CharClass_Operator
+#define N CharClass_Number
+static const unsigned char _charClass[256] =
+    {
+    /* 00 */ E, 0, 0, 0, 0, 0, 0, 0, 0, S, S, S, S, S, 0, 0,
+    /* 10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 20 */ S, Y|O, 0, 0, 0, Y, Y|O, 0, Y, Y, Y|O, Y|O, Y, Y|O, Y|N, Y|O,
+    /* 30 */ N, N, N, N, N, N, N, N, N, N, Y, Y, Y|O, Y|O, Y|O, Y,
+    /* 40 */ Y, 0, 0, 0, 0, 0, 0, 0, 0, N, 0, 0, 0, 0, N, 0,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, Y, 0, Y, Y, 0,
+    /* 60 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, N, 0, 0, 0, 0, N, 0,
+    /* 70 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, Y, Y|O, Y, Y, 0,
+    /* 80 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* A0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* B0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* C0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* E0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* F0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    };
+#undef E
+#undef S
+#undef Y
+#undef O
+#undef N
+
+static int GetCharClass(char c)
+{
+    return _charClass[(unsigned char)c];
+}
+
+/** Returns true for the characters isspace accepts in the C locale. */
+static bool GetIsSpace(char c)
+{
+    return (GetCharClass(c) & CharClass_Space) != 0;
+}
+
+/** Returns the token of the two character operator, or 0 if c0 and c1 don't form one. */
+static int GetOperatorToken(char c0, char c1)
+{
+    switch (c0)
+    {
+    case '+': return (c1 == '=') ? HLSLToken_PlusEqual : (c1 == '+') ? HLSLToken_PlusPlus : 0;
+    case '-': return (c1 == '=') ? HLSLToken_MinusEqual : (c1 == '-') ? HLSLToken_MinusMinus : 0;
+    case '*': return (c1 == '=') ? HLSLToken_TimesEqual : 0;
+    case '/': return (c1 == '=') ? HLSLToken_DivideEqual : 0;
+    case '=': return (c1 == '=') ? HLSLToken_EqualEqual : 0;
+    case '!': return (c1 == '=') ? HLSLToken_NotEqual : 0;
+    case '<': return (c1 == '=') ? HLSLToken_LessEqual : (c1 == '<') ? HLSLToken_BitShiftLeft : 0;
+    case '>': return (c1 == '=') ? HLSLToken_GreaterEqual : (c1 == '>') ? HLSLToken_BitShiftRight : 0;
+    case '&': return (c1 == '&') ? HLSLToken_AndAnd : 0;
+    case '|': return (c1 == '|') ? HLSLToken_BarBar : 0;
+    }
+    return 0;
 }
 
 /** Returns true if the character is a valid token separator at the end of a number type token */
 static bool GetIsNumberSeparator(char c)
 {
-    return c == 0 || isspace(c) || GetIsSymbol(c);
+    return (GetCharClass(c) & (CharClass_End | CharClass_Space | CharClass_Symbol)) != 0;
 }
 
-HLSLTokenizer::HLSLTokenizer(Logger* logger, const char* fileName, const char* buffer, size_t length)
+// The whitespace and block comment scanners process 16 or 32 bytes at a time when the
+// CPU allows it. They return the first byte that isn't whitespace, or the '*' of the
+// closing "*/", or the end of the buffer, and add the newlines they pass to lines.
+typedef const char* (*ScanFunction)(const char* p, const char* end, int& lines);
+
+static const char* SkipWhitespaceScalar(const char* p, const char* end, int& lines)
 {
-    m_logger            = logger;
-    m_buffer            = buffer;
-    m_bufferEnd         = buffer + length;
-    m_fileName          = fileName;
-    m_lineNumber        = 1;
-    m_tokenLineNumber   = 1;
-    m_error             = false;
-    Next();
+    while (p < end && GetIsSpace(p[0]))
+    {
+        if (p[0] == '\n')
+        {
+            ++lines;
+        }
+        ++p;
+    }
+    return p;
 }
-int HLSLTokenizer::GetTokenID(const char* name)
+
+static const char* FindCommentEndScalar(const char* p, const char* end, int& lines)
 {
-    const int numReservedWords = sizeof(_reservedWords) / sizeof(const char*);
-    for (int i = 0; i < numReservedWords; ++i)
-        if (strcmp(_reservedWords[i], name) == 0)
-            return 256 + i;
-    return 0;
+    while (p < end)
+    {
+        if (p[0] == '\n')
+        {
+            ++lines;
+        }
+        if (p[0] == '*' && p + 1 < end && p[1] == '/')
+        {
+            break;
+        }
+        ++p;
+    }
+    return p;
 }
 
-void HLSLTokenizer::Next()
+#if HLSL_TOKENIZER_SSE2
+
+static int CountTrailingZeros(unsigned int x)
+{
+#if _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (int)index;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+static int CountBits(unsigned int x)
 {
+#if _MSC_VER
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return (int)((((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+#else
+    return __builtin_popcount(x);
+#endif
+}
+
+/** Returns the newlines in the first n bytes of a block, given the newline mask of the block. */
+static int CountLines(unsigned int newlineMask, int n)
+{
+    return CountBits(newlineMask & ((1u << n) - 1));
+}
 
-	while( SkipWhitespace() || SkipComment() || ScanLineDirective() || SkipPragmaDirective() )
+static const char* SkipWhitespaceSSE2(const char* p, const char* end, int& lines)
+{
+    const __m128i space   = _mm_set1_epi8(' ');
+    const __m128i tab     = _mm_set1_epi8('\t');
+    const __m128i range   = _mm_set1_epi8('\r' - '\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16)
     {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i x = _mm_sub_epi8(v, tab);
+        __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(x, range), x));
+        unsigned int spaceMask   = (unsigned int)_mm_movemask_epi8(isSpace);
+        unsigned int newlineMask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (spaceMask != 0xFFFF)
+        {
+            int n = CountTrailingZeros(~spaceMask);
+            lines += CountLines(newlineMask, n);
+            return p + n;
+        }
+        lines += CountBits(newlineMask);
+        p += 16;
     }
+    return SkipWhitespaceScalar(p, end, lines);
+}
 
-    if (m_error)
+static const char* FindCommentEndSSE2(const char* p, const char* end, int& lines)
+{
+    const __m128i star    = _mm_set1_epi8('*');
+    const __m128i slash   = _mm_set1_epi8('/');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 17)
     {
-        m_token = HLSLToken_EndOfStream;
-        return;
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i w = _mm_loadu_si128((const __m128i*)(p + 1));
+        unsigned int endMask     = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v, star), _mm_cmpeq_epi8(w, slash)));
+        unsigned int newlineMask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (endMask != 0)
+        {
+            int n = CountTrailingZeros(endMask);
+            lines += CountLines(newlineMask, n);
+            return p + n;
+        }
+        lines += CountBits(newlineMask);
+        p += 16;
     }
+    return FindCommentEndScalar(p, end, lines);
+}
 
-    m_tokenLineNumber = m_lineNumber;
+#if _MSC_VER
+#define HLSL_TARGET_AVX2
+#else
+#define HLSL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
-    if (m_buffer >= m_bufferEnd || *m_buffer == '\0')
+HLSL_TARGET_AVX2 static const char* SkipWhitespaceAVX2(const char* p, const char* end, int& lines)
+{
+    const __m256i space   = _mm256_set1_epi8(' ');
+    const __m256i tab     = _mm256_set1_epi8('\t');
+    const __m256i range   = _mm256_set1_epi8('\r' - '\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (end - p >= 32)
     {
-        m_token = HLSLToken_EndOfStream;
-        return;
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i x = _mm256_sub_epi8(v, tab);
+        __m256i isSpace = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(_mm256_min_epu8(x, range), x));
+        unsigned int spaceMask   = (unsigned int)_mm256_movemask_epi8(isSpace);
+        unsigned int newlineMask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        if (spaceMask != 0xFFFFFFFF)
+        {
+            int n = CountTrailingZeros(~spaceMask);
+            lines += CountLines(newlineMask, n);
+            return p + n;
+        }
+        lines += CountBits(newlineMask);
+        p += 32;
     }
+    return SkipWhitespaceSSE2(p, end, lines);
+}
 
-    const char* start = m_buffer;
+HLSL_TARGET_AVX2 static const char* FindCommentEndAVX2(const char* p, const char* end, int& lines)
+{
+    const __m256i star    = _mm256_set1_epi8('*');
+    const __m256i slash   = _mm256_set1_epi8('/');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (end - p >= 33)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i w = _mm256_loadu_si256((const __m256i*)(p + 1));
+        unsigned int endMask     = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v, star), _mm256_cmpeq_epi8(w, slash)));
+        unsigned int newlineMask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        if (endMask != 0)
+        {
+            int n = CountTrailingZeros(endMask);
+            lines += CountLines(newlineMask, n);
+            return p + n;
+        }
+        lines += CountBits(newlineMask);
+        p += 32;
+    }
+    return FindCommentEndSSE2(p, end, lines);
+}
 
-    // +=, -=, *=, /=, ==, <=, >=
-    if (m_buffer[0] == '+' && m_buffer[1] == '=')
+static bool GetHasAVX2()
+{
+#if _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
     {
-        m_token = HLSLToken_PlusEqual;
-        m_buffer += 2;
-        return;
+        return false;
     }
-    else if (m_buffer[0] == '-' && m_buffer[1] == '=')
+    // The OS has to save the YMM registers too.
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx     = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
     {
-        m_token = HLSLToken_MinusEqual;
-        m_buffer += 2;
-        return;
+        return false;
     }
-    else if (m_buffer[0] == '*' && m_buffer[1] == '=')
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+struct ScanFunctions
+{
+    ScanFunctions()
     {
-        m_token = HLSLToken_TimesEqual;
-        m_buffer += 2;
-        return;
+        skipWhitespace = SkipWhitespaceScalar;
+        findCommentEnd = FindCommentEndScalar;
+#if HLSL_TOKENIZER_SSE2
+        if (GetHasAVX2())
+        {
+            skipWhitespace = SkipWhitespaceAVX2;
+            findCommentEnd = FindCommentEndAVX2;
+        }
+        else
+        {
+            skipWhitespace = SkipWhitespaceSSE2;
+            findCommentEnd = FindCommentEndSSE2;
+        }
+#endif
     }
-    else if (m_buffer[0] == '/' && m_buffer[1] == '=')
+
+    ScanFunction skipWhitespace;
+    ScanFunction findCommentEnd;
+};
+
+static const ScanFunctions& GetScanFunctions()
+{
+    static const ScanFunctions functions;
+    return functions;
+}
+
+HLSLLineIndex::HLSLLineIndex(Allocator* allocator) : m_lineStarts(allocator)
+{
+    Clear();
+}
+
+void HLSLLineIndex::Clear()
+{
+    m_lineStarts.Clear();
+    m_lineStarts.PushBack(0);
+}
+
+void HLSLLineIndex::AddLines(const char* start, const char* end, unsigned int offset)
+{
+    const char* p = start;
+    while (p < end && (p = (const char*)memchr(p, '\n', end - p)) != NULL)
     {
-        m_token = HLSLToken_DivideEqual;
-        m_buffer += 2;
-        return;
+        ++p;
+        m_lineStarts.PushBack(offset + (unsigned int)(p - start));
     }
-    else if (m_buffer[0] == '=' && m_buffer[1] == '=')
+}
+
+void HLSLLineIndex::GetLocation(unsigned int offset, int& line, int& column) const
+{
+    // Find the last line that starts at or before the offset.
+    int first = 0;
+    int last  = m_lineStarts.GetSize() - 1;
+    while (first < last)
     {
-        m_token = HLSLToken_EqualEqual;
-        m_buffer += 2;
-        return;
+        int middle = (first + last + 1) / 2;
+        if (m_lineStarts[middle] <= offset)
+        {
+            first = middle;
+        }
+        else
+        {
+            last = middle - 1;
+        }
     }
-    else if (m_buffer[0] == '!' && m_buffer[1] == '=')
+    line   = first + 1;
+    column = (int)(offset - m_lineStarts[first]) + 1;
+}
+
+HLSLSourceStream::HLSLSourceStream(Allocator* allocator, const HLSLSourceReader& reader, size_t chunkSize)
+{
+    m_allocator     = allocator;
+    m_reader        = reader;
+    m_chunkSize     = chunkSize;
+    m_buffer        = NULL;
+    m_capacity      = 0;
+    m_size          = 0;
+    m_lineEnd       = 0;
+    m_offset        = 0;
+    m_endOfSource   = false;
+}
+
+HLSLSourceStream::~HLSLSourceStream()
+{
+    if (m_buffer != NULL)
     {
-        m_token = HLSLToken_NotEqual;
-        m_buffer += 2;
-        return;
+        m_allocator->Delete(m_allocator->m_userData, m_buffer);
     }
-    else if (m_buffer[0] == '<' && m_buffer[1] == '=')
+}
+
+bool HLSLSourceStream::Refill(const char*& start, const char*& end)
+{
+    // Keep the partial line that followed the previous window.
+    size_t tail = m_size - m_lineEnd;
+    memmove(m_buffer, m_buffer + m_lineEnd, tail);
+    m_offset += m_lineEnd;
+    m_size    = tail;
+    m_lineEnd = 0;
+
+    // The tail has no newline, so read until a chunk brings one.
+    size_t searched = tail;
+    while (true)
     {
-        m_token = HLSLToken_LessEqual;
-        m_buffer += 2;
-        return;
+        size_t i = m_size;
+        while (i > searched && m_buffer[i - 1] != '\n')
+        {
+            --i;
+        }
+        if (i > searched || m_endOfSource)
+        {
+            m_lineEnd = m_endOfSource ? m_size : i;
+            break;
+        }
+        searched = m_size;
+
+        // Leave room for a zero after the data, like a string.
+        if (m_capacity - m_size < m_chunkSize + 1)
+        {
+            size_t capacity = m_capacity * 2;
+            if (capacity < m_size + m_chunkSize + 1)
+            {
+                capacity = m_size + m_chunkSize + 1;
+            }
+            char* buffer = (char*)m_allocator->NewArray(m_allocator->m_userData, 1, capacity);
+            if (m_buffer != NULL)
+            {
+                memcpy(buffer, m_buffer, m_size);
+                m_allocator->Delete(m_allocator->m_userData, m_buffer);
+            }
+            m_buffer   = buffer;
+            m_capacity = capacity;
+        }
+
+        size_t read = m_reader.Read(m_reader.m_userData, m_buffer + m_size, m_chunkSize);
+        if (read == 0)
+        {
+            m_endOfSource = true;
+        }
+        m_size += read;
     }
-    else if (m_buffer[0] == '>' && m_buffer[1] == '=')
+
+    if (m_buffer != NULL)
     {
-        m_token = HLSLToken_GreaterEqual;
-        m_buffer += 2;
-        return;
+        m_buffer[m_size] = 0;
     }
-    else if (m_buffer[0] == '&' && m_buffer[1] == '&')
+    start = m_buffer;
+    end   = m_buffer + m_lineEnd;
+    return m_lineEnd > 0;
+}
+
+HLSLTokenizer::HLSLTokenizer(Logger* logger, const char* fileName, const char* buffer, size_t length)
+{
+    m_logger            = logger;
+    m_lineIndex         = NULL;
+    Reset(fileName, buffer, length);
+}
+
+void HLSLTokenizer::Reset(const char* fileName, const char* buffer, size_t length)
+{
+    Start(fileName, buffer, length, NULL);
+    Lex();
+}
+
+void HLSLTokenizer::Reset(const char* fileName, HLSLSourceStream* stream)
+{
+    Start(fileName, NULL, 0, stream);
+    Lex();
+}
+
+void HLSLTokenizer::Start(const char* fileName, const char* buffer, size_t length, HLSLSourceStream* stream)
+{
+    m_buffer            = buffer;
+    m_bufferEnd         = buffer + length;
+    m_stream            = stream;
+    m_bufferStart       = buffer;
+    m_fileName          = fileName;
+    m_bufferFileName    = fileName;
+    m_lineNumber        = 1;
+    m_tokenLineNumber   = 1;
+    m_error             = false;
+    m_identifierStart   = buffer;
+    m_identifierLength  = 0;
+    m_identifierHash    = 0;
+    m_numLineDirectives = 0;
+    m_lineDirectiveToken = -1;
+    m_inComment         = false;
+    m_tokens            = NULL;
+    m_tokenIndex        = 0;
+    m_fileNameIndex     = 0;
+    m_tokenizing        = NULL;
+    if (m_lineIndex != NULL)
     {
-        m_token = HLSLToken_AndAnd;
-        m_buffer += 2;
-        return;
+        m_lineIndex->Clear();
+        m_lineIndex->AddLines(buffer, m_bufferEnd, 0);
     }
-    else if (m_buffer[0] == '|' && m_buffer[1] == '|')
+}
+
+void HLSLTokenizer::SetLineIndex(HLSLLineIndex* lineIndex)
+{
+    m_lineIndex = lineIndex;
+    if (m_lineIndex != NULL && m_stream == NULL)
     {
-        m_token = HLSLToken_BarBar;
-        m_buffer += 2;
+        m_lineIndex->Clear();
+        m_lineIndex->AddLines(m_bufferStart, m_bufferEnd, 0);
+    }
+}
+
+int HLSLTokenizer::GetTokenID(const char* name)
+{
+    size_t length = strlen(name);
+    int token = FindReservedWord(name, length, String_Hash(name, length));
+    return (token == HLSLToken_Identifier) ? 0 : token;
+}
+
+void HLSLTokenizer::Next()
+{
+    if (m_tokens != NULL)
+    {
+        SetTokenIndex(m_tokenIndex + 1);
         return;
     }
+    Lex();
+}
+
+void HLSLTokenizer::Lex()
+{
 
-    // ++, --
-    if ((m_buffer[0] == '-' || m_buffer[0] == '+') && (m_buffer[1] == m_buffer[0]))
+    // Windows of a stream end on a line, so they are only refilled between tokens.
+    do
     {
-        m_token = (m_buffer[0] == '+') ? HLSLToken_PlusPlus : HLSLToken_MinusMinus;
-        m_buffer += 2;
+        while( SkipWhitespace() || SkipComment() || ScanLineDirective() || SkipPragmaDirective() )
+        {
+        }
+    }
+    while (m_buffer >= m_bufferEnd && !m_error && Refill());
+
+    if (m_error)
+    {
+        m_token = HLSLToken_EndOfStream;
         return;
     }
-    else if ((m_buffer[0] == '<' || m_buffer[0] == '>') && (m_buffer[1] == m_buffer[0]))
+
+    m_tokenLineNumber = m_lineNumber;
+    m_tokenStart = m_buffer;
+
+    if (m_buffer >= m_bufferEnd || *m_buffer == '\0')
     {
-        m_token = (m_buffer[0] == '<') ? HLSLToken_BitShiftLeft : HLSLToken_BitShiftRight;
-        m_buffer += 2;
+        m_token = HLSLToken_EndOfStream;
         return;
     }
 
+    const char* start = m_buffer;
+
+    int charClass = GetCharClass(m_buffer[0]);
+
+    // +=, -=, *=, /=, ==, !=, <=, >=, &&, ||, ++, --, <<, >>
+    if (charClass & CharClass_Operator)
+    {
+        int token = GetOperatorToken(m_buffer[0], m_buffer[1]);
+        if (token != 0)
+        {
+            m_token = token;
+            m_buffer += 2;
+            return;
+        }
+    }
+
     // Check for the start of a number.
-    if (ScanNumber())
+    if ((charClass & CharClass_Number) && ScanNumber())
     {
         return;
     }
     
-    if (GetIsSymbol(m_buffer[0]))
+    if (charClass & CharClass_Symbol)
     {
         m_token = static_cast<unsigned char>(m_buffer[0]);
         ++m_buffer;
         return;
     }
 
-    // Must be an identifier or a reserved word.
-    while (m_buffer < m_bufferEnd && m_buffer[0] != 0 && !GetIsSymbol(m_buffer[0]) && !isspace(m_buffer[0]))
+    // Must be an identifier or a reserved word. Identifiers are left in the buffer,
+    // and hashed while scanning so that they can be interned without another pass.
+    unsigned int hash = String_HashSeed;
+    while (m_buffer < m_bufferEnd && !(GetCharClass(m_buffer[0]) & (CharClass_End | CharClass_Space | CharClass_Symbol)))
     {
+        hash = String_HashAdd(hash, m_buffer[0]);
         ++m_buffer;
     }
 
-    size_t length = m_buffer - start;
-    memcpy(m_identifier, start, length);
-    m_identifier[length] = 0;
-    
-    const int numReservedWords = sizeof(_reservedWords) / sizeof(const char*);
-    for (int i = 0; i < numReservedWords; ++i)
-    {
-        if (strcmp(_reservedWords[i], m_identifier) == 0)
-        {
-            m_token = 256 + i;
-            return;
-        }
-    }
+    m_identifierStart  = start;
+    m_identifierLength = m_buffer - start;
+    m_identifierHash   = hash;
 
-    m_token = HLSLToken_Identifier;
+    m_token = FindReservedWord(start, m_identifierLength, hash);
+}
 
+bool HLSLTokenizer::Refill()
+{
+    if (m_stream == NULL || !m_stream->Refill(m_buffer, m_bufferEnd))
+    {
+        return false;
+    }
+    m_bufferStart = m_buffer;
+    if (m_lineIndex != NULL)
+    {
+        m_lineIndex->AddLines(m_buffer, m_bufferEnd, (unsigned int)m_stream->GetOffset());
+    }
+    return true;
 }
 
 bool HLSLTokenizer::SkipWhitespace()
 {
-    bool result = false;
-    while (m_buffer < m_bufferEnd && isspace(m_buffer[0]))
+    // Most runs are a single space, don't bother with the wide scan for those.
+    if (m_buffer >= m_bufferEnd || !GetIsSpace(m_buffer[0]))
+    {
+        return false;
+    }
+    if (m_buffer + 1 >= m_bufferEnd || !GetIsSpace(m_buffer[1]))
     {
-        result = true;
         if (m_buffer[0] == '\n')
         {
             ++m_lineNumber;
         }
         ++m_buffer;
+        return true;
+    }
+    m_buffer = GetScanFunctions().skipWhitespace(m_buffer, m_bufferEnd, m_lineNumber);
+    return true;
+}
+
+void HLSLTokenizer::SkipLine()
+{
+    // memchr is already vectorized by the C library.
+    const char* newline = (const char*)memchr(m_buffer, '\n', m_bufferEnd - m_buffer);
+    if (newline != NULL)
+    {
+        m_buffer = newline + 1;
+        ++m_lineNumber;
+    }
+    else
+    {
+        m_buffer = m_bufferEnd;
     }
-    return result;
 }
 
 bool HLSLTokenizer::SkipComment()
 {
     bool result = false;
-    if (m_buffer[0] == '/')
+    if (m_bufferEnd - m_buffer > 1 && m_buffer[0] == '/')
     {
         if (m_buffer[1] == '/')
         {
             // Single line comment.
             result = true;
             m_buffer += 2;
-            while (m_buffer < m_bufferEnd)
-            {
-                if (*(m_buffer++) == '\n')
-                {
-                    ++m_lineNumber;
-                    break;
-                }
-            }
+            SkipLine();
         }
         else if (m_buffer[1] == '*')
         {
             // Multi-line comment.
             result = true;
             m_buffer += 2;
-            while (m_buffer < m_bufferEnd)
+            SkipBlockComment();
+        }
+    }
+    return result;
+}
+
+void HLSLTokenizer::SkipBlockComment()
+{
+    m_buffer = GetScanFunctions().findCommentEnd(m_buffer, m_bufferEnd, m_lineNumber);
+    while (m_buffer >= m_bufferEnd && Refill())
+    {
+        m_buffer = GetScanFunctions().findCommentEnd(m_buffer, m_bufferEnd, m_lineNumber);
+    }
+    if (m_buffer < m_bufferEnd)
+    {
+        m_buffer += 2;
+    }
+    else
+    {
+        m_inComment = true;
+    }
+}
+
+bool HLSLTokenizer::SkipPragmaDirective()
+{
+	bool result = false;
+	if( m_bufferEnd - m_buffer > 7 && *m_buffer == '#' )
+	{
+		const char* ptr = m_buffer + 1;
+		while( GetIsSpace( *ptr ) )
+			ptr++;
+
+		if( strncmp( ptr, "pragma", 6 ) == 0 && GetIsSpace( ptr[ 6 ] ) )
+		{
+			m_buffer = ptr + 6;
+			result = true;
+			SkipLine();
+		}
+	}
+	return result;
+}
+
+static bool GetIsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int GetHexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/** Compares the start of the string with a lower case prefix, ignoring case. */
+static bool GetHasPrefixNoCase(const char* string, const char* prefix)
+{
+    for (; *prefix != 0; ++string, ++prefix)
+    {
+        if ((*string | 0x20) != *prefix)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Accumulates a digit the way strtol does, saturating at LONG_MAX. */
+static unsigned long long AddDigit(unsigned long long value, int base, int digit)
+{
+    const unsigned long long maxValue = LONG_MAX;
+    if (value > (maxValue - digit) / base)
+    {
+        return maxValue;
+    }
+    return value * base + digit;
+}
+
+/** Powers of ten that are exactly representable as doubles. */
+static const double _powersOfTen[] =
+    {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+bool HLSLTokenizer::ScanNumber()
+{
+
+    // Don't treat the + or - as part of the number.
+    if (m_buffer[0] == '+' || m_buffer[0] == '-')
+    {
+        return false;
+    }
+
+    // inf and nan are left to the C library, but most identifiers that start
+    // with the same letters can be ruled out right away.
+    if (!GetIsDigit(m_buffer[0]) && m_buffer[0] != '.')
+    {
+        if (m_bufferEnd - m_buffer >= 3 && (GetHasPrefixNoCase(m_buffer, "inf") || GetHasPrefixNoCase(m_buffer, "nan")))
+        {
+            return ScanSpecialNumber();
+        }
+        return false;
+    }
+
+    // Parse hex literals.
+    if (m_bufferEnd - m_buffer > 2 && m_buffer[0] == '0' && (m_buffer[1] == 'x' || m_buffer[1] == 'X'))
+    {
+        const char* hEnd = m_buffer + 2;
+        unsigned long long value = 0;
+        int digit;
+        while (hEnd < m_bufferEnd && (digit = GetHexDigit(hEnd[0])) >= 0)
+        {
+            value = AddDigit(value, 16, digit);
+            ++hEnd;
+        }
+        if (GetIsNumberSeparator(hEnd[0]))
+        {
+            m_buffer = hEnd;
+            m_token  = HLSLToken_IntLiteral;
+            m_iValue = (int)(long)value;
+            return true;
+        }
+        // Hex floats.
+        return ScanSpecialNumber();
+    }
+
+    // Scan the digits once, keeping the integer value, and the float value as a
+    // decimal mantissa and exponent.
+    const char* p = m_buffer;
+    unsigned long long iValue   = 0;
+    unsigned long long mantissa = 0;
+    int  exponent  = 0;
+    bool truncated = false;     // The mantissa doesn't have all the digits.
+
+    const unsigned long long maxMantissa = 1ull << 53;
+    while (p < m_bufferEnd && GetIsDigit(p[0]))
+    {
+        int digit = p[0] - '0';
+        iValue = AddDigit(iValue, 10, digit);
+        if (mantissa < maxMantissa)
+        {
+            mantissa = mantissa * 10 + digit;
+        }
+        else
+        {
+            truncated |= (digit != 0);
+            ++exponent;
+        }
+        ++p;
+    }
+    const char* iEnd = p;
+
+    bool hasDigits = (iEnd > m_buffer);
+    if (p < m_bufferEnd && p[0] == '.')
+    {
+        ++p;
+        while (p < m_bufferEnd && GetIsDigit(p[0]))
+        {
+            int digit = p[0] - '0';
+            if (mantissa < maxMantissa)
+            {
+                mantissa = mantissa * 10 + digit;
+                --exponent;
+            }
+            else
+            {
+                truncated |= (digit != 0);
+            }
+            hasDigits = true;
+            ++p;
+        }
+    }
+
+    if (!hasDigits)
+    {
+        return false;
+    }
+
+    // The exponent is only part of the number if it has digits.
+    if (p < m_bufferEnd && (p[0] == 'e' || p[0] == 'E'))
+    {
+        const char* e = p + 1;
+        bool negative = false;
+        if (e < m_bufferEnd && (e[0] == '+' || e[0] == '-'))
+        {
+            negative = (e[0] == '-');
+            ++e;
+        }
+        if (e < m_bufferEnd && GetIsDigit(e[0]))
+        {
+            int value = 0;
+            while (e < m_bufferEnd && GetIsDigit(e[0]))
             {
-                if (m_buffer[0] == '\n')
-                {
-                    ++m_lineNumber;
-                }
-                if (m_buffer[0] == '*' && m_buffer[1] == '/')
+                if (value < 100000)
                 {
-                    break;
+                    value = value * 10 + (e[0] - '0');
                 }
-                ++m_buffer;
-            }
-            if (m_buffer < m_bufferEnd)
-            {
-                m_buffer += 2;
+                ++e;
             }
+            exponent += negative ? -value : value;
+            p = e;
         }
     }
-    return result;
-}
+    const char* fEnd = p;
 
-bool HLSLTokenizer::SkipPragmaDirective()
-{
-	bool result = false;
-	if( m_bufferEnd - m_buffer > 7 && *m_buffer == '#' )
+    // If the character after the number is an f then the f is treated as part
+    // of the number (to handle 1.0f syntax).
+	if( ( fEnd[ 0 ] == 'f' || fEnd[ 0 ] == 'h' ) && fEnd < m_bufferEnd )
 	{
-		const char* ptr = m_buffer + 1;
-		while( isspace( *ptr ) )
-			ptr++;
-
-		if( strncmp( ptr, "pragma", 6 ) == 0 && isspace( ptr[ 6 ] ) )
-		{
-			m_buffer = ptr + 6;
-			result = true;
-			while( m_buffer < m_bufferEnd )
-			{
-				if( *( m_buffer++ ) == '\n' )
-				{
-					++m_lineNumber;
-					break;
-				}
-			}
-		}
+		++fEnd;
 	}
-	return result;
-}
 
-bool HLSLTokenizer::ScanNumber()
-{
-
-    // Don't treat the + or - as part of the number.
-    if (m_buffer[0] == '+' || m_buffer[0] == '-')
+	if( fEnd > iEnd && GetIsNumberSeparator( fEnd[ 0 ] ) )
+	{
+        // The mantissa and the power of ten are both exact, so a single multiply or
+        // divide rounds correctly. Anything else goes through strtod.
+        double fValue;
+        if (!truncated && mantissa <= maxMantissa && exponent >= -22 && exponent <= 22)
+        {
+            fValue = (exponent < 0) ? mantissa / _powersOfTen[-exponent] : mantissa * _powersOfTen[exponent];
+        }
+        else
+        {
+            fValue = String_ToDouble(m_buffer, NULL);
+        }
+		m_buffer = fEnd;
+		m_token = HLSLToken_FloatLiteral;
+        m_fValue = static_cast<float>(fValue);
+        return true;
+    }
+    else if (iEnd > m_buffer && GetIsNumberSeparator(iEnd[0]))
     {
-        return false;
+        m_buffer = iEnd;
+        m_token  = HLSLToken_IntLiteral;
+        m_iValue = (int)(long)iValue;
+        return true;
     }
 
+    return false;
+}
+
+bool HLSLTokenizer::ScanSpecialNumber()
+{
     // Parse hex literals.
-    if (m_bufferEnd - m_buffer > 2 && m_buffer[0] == '0' && m_buffer[1] == 'x')
+    if (m_bufferEnd - m_buffer > 2 && m_buffer[0] == '0' && (m_buffer[1] == 'x' || m_buffer[1] == 'X'))
     {
         char*   hEnd = NULL;
         int     iValue = strtol(m_buffer+2, &hEnd, 16);
@@ -459,12 +1127,12 @@ bool HLSLTokenizer::ScanNumber()
 bool HLSLTokenizer::ScanLineDirective()
 {
     
-    if (m_bufferEnd - m_buffer > 5 && strncmp(m_buffer, "#line", 5) == 0 && isspace(m_buffer[5]))
+    if (m_bufferEnd - m_buffer > 5 && strncmp(m_buffer, "#line", 5) == 0 && GetIsSpace(m_buffer[5]))
     {
 
         m_buffer += 5;
         
-        while (m_buffer < m_bufferEnd && isspace(m_buffer[0]))
+        while (m_buffer < m_bufferEnd && GetIsSpace(m_buffer[0]))
         {
             if (m_buffer[0] == '\n')
             {
@@ -477,27 +1145,27 @@ bool HLSLTokenizer::ScanLineDirective()
         char* iEnd = NULL;
         int lineNumber = String_ToInteger(m_buffer, &iEnd);
 
-        if (!isspace(*iEnd))
+        if (!GetIsSpace(*iEnd))
         {
             Error("Syntax error: expected line number after #line");
             return false;
         }
 
         m_buffer = iEnd;
-        while (m_buffer < m_bufferEnd && isspace(m_buffer[0]))
+        while (m_buffer < m_bufferEnd && GetIsSpace(m_buffer[0]))
         {
             char c = m_buffer[0];
             ++m_buffer;
             if (c == '\n')
             {
-                m_lineNumber = lineNumber;
+                SetLineNumber(lineNumber);
                 return true;
             }
         }
 
         if (m_buffer >= m_bufferEnd)
         {
-            m_lineNumber = lineNumber;
+            SetLineNumber(lineNumber);
             return true;
         }
 
@@ -509,6 +1177,9 @@ bool HLSLTokenizer::ScanLineDirective()
             
         ++m_buffer;
         
+        // The name is only kept once the directive is valid, errors are reported in
+        // the current file.
+        char fileName[s_maxIdentifier];
         int i = 0;
         while (i + 1 < s_maxIdentifier && m_buffer < m_bufferEnd && m_buffer[0] != '"')
         {
@@ -518,12 +1189,12 @@ bool HLSLTokenizer::ScanLineDirective()
                 return false;
             }
 
-            m_lineDirectiveFileName[i] = *m_buffer;
+            fileName[i] = *m_buffer;
             ++m_buffer;
             ++i;
         }
         
-        m_lineDirectiveFileName[i] = 0;
+        fileName[i] = 0;
         
         if (m_buffer >= m_bufferEnd)
         {
@@ -542,7 +1213,7 @@ bool HLSLTokenizer::ScanLineDirective()
         
         while (m_buffer < m_bufferEnd && m_buffer[0] != '\n')
         {
-            if (!isspace(m_buffer[0]))
+            if (!GetIsSpace(m_buffer[0]))
             {
                 Error("Syntax error: unexpected input after file name near #line");
                 return false;
@@ -553,8 +1224,10 @@ bool HLSLTokenizer::ScanLineDirective()
         // Skip new line
         ++m_buffer;
 
-        m_lineNumber = lineNumber;
+        SetLineNumber(lineNumber);
+        memcpy(m_lineDirectiveFileName, fileName, i + 1);
         m_fileName = m_lineDirectiveFileName;
+        ++m_numLineDirectives;
 
         return true;
 
@@ -564,6 +1237,455 @@ bool HLSLTokenizer::ScanLineDirective()
 
 }
 
+void HLSLTokenizer::SetLineNumber(int lineNumber)
+{
+    m_lineNumber = lineNumber;
+    if (m_tokenizing != NULL && m_lineDirectiveToken < 0)
+    {
+        m_lineDirectiveToken = m_tokenizing->GetSize();
+    }
+}
+
+HLSLTokenBuffer::HLSLTokenBuffer(Allocator* allocator) :
+    kinds(allocator), offsets(allocator), lines(allocator), values(allocator), identifiers(allocator), chars(allocator), fileNames(allocator), allocator(allocator)
+{
+    errorToken  = -1;
+    errorOffset = -1;
+}
+
+void HLSLTokenBuffer::Clear()
+{
+    kinds.Clear();
+    offsets.Clear();
+    lines.Clear();
+    values.Clear();
+    identifiers.Clear();
+    chars.Clear();
+    fileNames.Clear();
+    errorToken  = -1;
+    errorOffset = -1;
+}
+
+bool HLSLTokenBuffer::GetIsValid(size_t length) const
+{
+    int numTokens = GetSize();
+    if (numTokens == 0 || kinds[numTokens - 1] != HLSLToken_EndOfStream ||
+        offsets.GetSize() != numTokens || lines.GetSize() != numTokens || values.GetSize() != numTokens ||
+        (chars.GetSize() > 0 && chars[chars.GetSize() - 1] != 0) ||
+        errorToken >= numTokens || (errorToken >= 0 && (errorOffset < 0 || errorOffset >= chars.GetSize())))
+    {
+        return false;
+    }
+    for (int i = 0; i < numTokens; ++i)
+    {
+        int kind = kinds[i];
+        size_t tokenLength = 0;
+        if (kind > HLSLToken_EndOfStream)
+        {
+            return false;
+        }
+        if (kind == HLSLToken_Identifier)
+        {
+            if (values[i] >= (unsigned int)identifiers.GetSize())
+            {
+                return false;
+            }
+            tokenLength = identifiers[values[i]].length;
+        }
+        else if (kind >= 256 && kind < HLSLToken_LessEqual)
+        {
+            tokenLength = strlen(_reservedWords[kind - 256]);
+        }
+        if (offsets[i] > length || tokenLength > length - offsets[i])
+        {
+            return false;
+        }
+    }
+    // The file names start at the first token, and follow the tokens.
+    if (fileNames.GetSize() == 0 || fileNames[0].firstToken != 0)
+    {
+        return false;
+    }
+    for (int i = 0; i < fileNames.GetSize(); ++i)
+    {
+        const FileName& fileName = fileNames[i];
+        if (fileName.firstToken >= numTokens || (i > 0 && fileName.firstToken < fileNames[i - 1].firstToken) ||
+            fileName.offset < -1 || fileName.offset >= chars.GetSize())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Appends a zero terminated string to the characters of the buffer and returns its offset. */
+static int AddChars(HLSLTokenBuffer* tokens, const char* string)
+{
+    int offset = tokens->chars.GetSize();
+    int length = (int)strlen(string) + 1;
+    tokens->chars.Resize(offset + length);
+    memcpy(&tokens->chars[offset], string, length);
+    return offset;
+}
+
+void HLSLTokenizer::Tokenize(HLSLTokenBuffer* tokens, int numThreads)
+{
+    ASSERT(m_tokens == NULL);
+    tokens->Clear();
+    if (m_stream != NULL)
+    {
+        return;
+    }
+
+    if (numThreads > 1 && (size_t)(m_bufferEnd - m_buffer) >= 2 * s_minChunkSize)
+    {
+        TokenizeParallel(tokens, numThreads);
+    }
+    else
+    {
+        PushTokens(tokens);
+    }
+
+    // The error is reported again once the parser gets to it.
+    if (tokens->errorToken >= 0)
+    {
+        m_error = false;
+    }
+
+    m_tokens        = tokens;
+    m_fileNameIndex = 0;
+    SetTokenIndex(0);
+}
+
+void HLSLTokenizer::SetTokens(const HLSLTokenBuffer* tokens)
+{
+    ASSERT(m_tokens == NULL && m_stream == NULL);
+    m_tokens        = tokens;
+    m_fileNameIndex = 0;
+    SetTokenIndex(0);
+}
+
+void HLSLTokenizer::PushTokens(HLSLTokenBuffer* tokens)
+{
+    // The current token has already been scanned.
+    int numLineDirectives = -1;
+    m_tokenizing = tokens;
+    while (true)
+    {
+        if (numLineDirectives != m_numLineDirectives)
+        {
+            HLSLTokenBuffer::FileName& fileName = tokens->fileNames.PushBackNew();
+            fileName.firstToken = tokens->GetSize();
+            fileName.offset     = (m_fileName == m_bufferFileName) ? -1 : AddChars(tokens, m_fileName);
+            numLineDirectives = m_numLineDirectives;
+        }
+        PushToken(tokens);
+        if (m_token == HLSLToken_EndOfStream)
+        {
+            break;
+        }
+        Lex();
+    }
+    m_tokenizing = NULL;
+}
+
+void HLSLTokenizer::TokenizeChunk(HLSLTokenBuffer* tokens, const char* bufferStart, const char* start, const char* end, int lineNumber, const char* fileName, bool inComment)
+{
+    tokens->Clear();
+    Start(fileName, start, end - start, NULL);
+    m_bufferStart = bufferStart;
+    m_lineNumber  = lineNumber;
+    m_tokenizing  = tokens;
+    if (inComment)
+    {
+        SkipBlockComment();
+    }
+    Lex();
+    PushTokens(tokens);
+}
+
+/** Returns where the chunk that follows position should start. */
+static const char* FindChunkStart(const char* position, const char* start, const char* end)
+{
+    while (position < end)
+    {
+        const char* newline = (const char*)memchr(position, '\n', end - position);
+        if (newline == NULL)
+        {
+            break;
+        }
+        position = newline + 1;
+
+        // A #pragma can be split from its # by newlines.
+        const char* p = position;
+        while (p > start && GetIsSpace(p[-1]))
+        {
+            --p;
+        }
+        if (p == start || p[-1] != '#')
+        {
+            return position;
+        }
+    }
+    return end;
+}
+
+/** Appends the tokens of a chunk. Lines before the first #line of the chunk are
+moved by lineOffset, and tokens that use the file name the chunk started with are
+left to the previous file name. */
+static void AppendTokens(HLSLTokenBuffer* tokens, const HLSLTokenBuffer& chunk, int lineOffset, int lineDirectiveToken)
+{
+    int firstToken      = tokens->GetSize();
+    int firstIdentifier = tokens->identifiers.GetSize();
+    int firstChar       = tokens->chars.GetSize();
+    int numTokens       = chunk.GetSize();
+
+    tokens->kinds.Resize(firstToken + numTokens);
+    tokens->offsets.Resize(firstToken + numTokens);
+    tokens->lines.Resize(firstToken + numTokens);
+    tokens->values.Resize(firstToken + numTokens);
+    memcpy(&tokens->kinds[firstToken], &chunk.kinds[0], numTokens * sizeof(unsigned short));
+    memcpy(&tokens->offsets[firstToken], &chunk.offsets[0], numTokens * sizeof(unsigned int));
+    for (int i = 0; i < numTokens; ++i)
+    {
+        bool relative = lineDirectiveToken < 0 || i < lineDirectiveToken;
+        tokens->lines[firstToken + i]  = chunk.lines[i] + (relative ? lineOffset : 0);
+        unsigned int value = chunk.values[i];
+        tokens->values[firstToken + i] = (chunk.kinds[i] == HLSLToken_Identifier) ? value + firstIdentifier : value;
+    }
+
+    if (chunk.identifiers.GetSize() > 0)
+    {
+        tokens->identifiers.Resize(firstIdentifier + chunk.identifiers.GetSize());
+        memcpy(&tokens->identifiers[firstIdentifier], &chunk.identifiers[0], chunk.identifiers.GetSize() * sizeof(HLSLTokenBuffer::Identifier));
+    }
+    if (chunk.chars.GetSize() > 0)
+    {
+        tokens->chars.Resize(firstChar + chunk.chars.GetSize());
+        memcpy(&tokens->chars[firstChar], &chunk.chars[0], chunk.chars.GetSize());
+    }
+
+    for (int i = 0; i < chunk.fileNames.GetSize(); ++i)
+    {
+        if (chunk.fileNames[i].offset >= 0)
+        {
+            HLSLTokenBuffer::FileName& fileName = tokens->fileNames.PushBackNew();
+            fileName.firstToken = firstToken + chunk.fileNames[i].firstToken;
+            fileName.offset     = firstChar + chunk.fileNames[i].offset;
+        }
+    }
+
+    if (chunk.errorToken >= 0)
+    {
+        tokens->errorToken  = firstToken + chunk.errorToken;
+        tokens->errorOffset = firstChar + chunk.errorOffset;
+    }
+}
+
+static void RemoveLastToken(HLSLTokenBuffer* tokens)
+{
+    tokens->kinds.PopBack();
+    tokens->offsets.PopBack();
+    tokens->lines.PopBack();
+    tokens->values.PopBack();
+}
+
+void HLSLTokenizer::TokenizeParallel(HLSLTokenBuffer* tokens, int numThreads)
+{
+    struct Chunk
+    {
+        Chunk(Logger* logger, Allocator* allocator) : tokenizer(logger, NULL, NULL, 0), tokens(allocator) {}
+        HLSLTokenizer   tokenizer;
+        HLSLTokenBuffer tokens;
+        const char*     start;
+        const char*     end;
+        std::thread     thread;
+    };
+
+    const char* end = m_bufferEnd;
+    size_t chunkSize = (end - m_buffer) / numThreads;
+    if (chunkSize < s_minChunkSize)
+    {
+        numThreads = (int)((end - m_buffer) / s_minChunkSize);
+        chunkSize  = (end - m_buffer) / numThreads;
+    }
+
+    // This tokenizer carries on with the first chunk, the others are tokenized as if
+    // they started on the first line and outside of a comment.
+    Allocator* allocator = tokens->allocator;
+    Chunk* chunks = (Chunk*)allocator->NewArray(allocator->m_userData, sizeof(Chunk), numThreads);
+    const char* chunkStart = FindChunkStart(m_buffer + chunkSize, m_bufferStart, end);
+    m_bufferEnd = chunkStart;
+    int numChunks = 1;
+    while (chunkStart < end)
+    {
+        Chunk* chunk = new (&chunks[numChunks]) Chunk(m_logger, allocator);
+        chunk->start = chunkStart;
+        chunk->end   = (numChunks + 1 < numThreads) ? FindChunkStart(chunkStart + chunkSize, m_bufferStart, end) : end;
+        chunk->thread = std::thread([this, chunk]() {
+            chunk->tokenizer.TokenizeChunk(&chunk->tokens, m_bufferStart, chunk->start, chunk->end, 1, m_bufferFileName, false);
+        });
+        chunkStart = chunk->end;
+        ++numChunks;
+    }
+
+    PushTokens(tokens);
+    for (int i = 1; i < numChunks; ++i)
+    {
+        chunks[i].thread.join();
+    }
+
+    // Stitch the chunks in order. The chunks that actually started inside a comment,
+    // and those with errors, are tokenized again from the right state.
+    bool        ended      = m_error || m_buffer < m_bufferEnd;
+    int         lineNumber = m_lineNumber;
+    const char* fileName   = m_fileName;
+    bool        inComment  = m_inComment;
+    for (int i = 1; i < numChunks && !ended; ++i)
+    {
+        Chunk& chunk = chunks[i];
+        HLSLTokenizer& tokenizer = chunk.tokenizer;
+
+        int lineOffset = lineNumber - 1;
+        if (inComment || chunk.tokens.errorToken >= 0)
+        {
+            tokenizer.TokenizeChunk(&chunk.tokens, m_bufferStart, chunk.start, chunk.end, lineNumber, fileName, inComment);
+            lineOffset = 0;
+        }
+
+        // Drop the end of the stream of the previous chunk.
+        RemoveLastToken(tokens);
+        AppendTokens(tokens, chunk.tokens, lineOffset, tokenizer.m_lineDirectiveToken);
+
+        lineNumber = tokenizer.m_lineNumber + (tokenizer.m_lineDirectiveToken < 0 ? lineOffset : 0);
+        if (tokenizer.m_numLineDirectives > 0)
+        {
+            fileName = tokenizer.m_lineDirectiveFileName;
+        }
+        inComment = tokenizer.m_inComment;
+        ended     = tokenizer.m_error || tokenizer.m_buffer < tokenizer.m_bufferEnd;
+    }
+
+    for (int i = 1; i < numChunks; ++i)
+    {
+        chunks[i].~Chunk();
+    }
+    allocator->Delete(allocator->m_userData, chunks);
+
+    m_bufferEnd  = end;
+    m_buffer     = end;
+    m_lineNumber = lineNumber;
+}
+
+void HLSLTokenizer::PushToken(HLSLTokenBuffer* tokens)
+{
+    unsigned int value = 0;
+    if (m_token == HLSLToken_FloatLiteral || m_token == HLSLToken_HalfLiteral)
+    {
+        memcpy(&value, &m_fValue, sizeof(value));
+    }
+    else if (m_token == HLSLToken_IntLiteral)
+    {
+        value = (unsigned int)m_iValue;
+    }
+    else if (m_token == HLSLToken_Identifier)
+    {
+        value = (unsigned int)tokens->identifiers.GetSize();
+        HLSLTokenBuffer::Identifier& identifier = tokens->identifiers.PushBackNew();
+        identifier.length = (unsigned int)m_identifierLength;
+        identifier.hash   = m_identifierHash;
+    }
+
+    tokens->kinds.PushBack((unsigned short)m_token);
+    tokens->offsets.PushBack((unsigned int)(m_tokenStart - m_bufferStart));
+    tokens->lines.PushBack(m_tokenLineNumber);
+    tokens->values.PushBack(value);
+}
+
+void HLSLTokenizer::SetTokenIndex(int index)
+{
+    ASSERT(m_tokens != NULL);
+
+    // Stay on the end of the stream.
+    if (index >= m_tokens->GetSize())
+    {
+        index = m_tokens->GetSize() - 1;
+    }
+    m_tokenIndex = index;
+
+    if (index == m_tokens->errorToken && !m_error)
+    {
+        m_logger->LogError(m_logger->m_userData, "%s", &m_tokens->chars[m_tokens->errorOffset]);
+        m_error = true;
+    }
+    if (m_error)
+    {
+        m_token = HLSLToken_EndOfStream;
+        return;
+    }
+
+    m_token           = m_tokens->kinds[index];
+    m_tokenLineNumber = m_tokens->lines[index];
+    m_lineNumber      = m_tokenLineNumber;
+    m_tokenStart      = m_bufferStart + m_tokens->offsets[index];
+
+    unsigned int value = m_tokens->values[index];
+    if (m_token == HLSLToken_FloatLiteral || m_token == HLSLToken_HalfLiteral)
+    {
+        memcpy(&m_fValue, &value, sizeof(value));
+    }
+    else if (m_token == HLSLToken_IntLiteral)
+    {
+        m_iValue = (int)value;
+    }
+    else if (m_token == HLSLToken_Identifier)
+    {
+        m_identifierStart  = m_tokenStart;
+        m_identifierLength = m_tokens->identifiers[value].length;
+        m_identifierHash   = m_tokens->identifiers[value].hash;
+    }
+    else if (m_token >= 256 && m_token < HLSLToken_LessEqual)
+    {
+        // Reserved words can also be read as identifiers.
+        m_identifierStart  = m_tokenStart;
+        m_identifierLength = strlen(_reservedWords[m_token - 256]);
+        m_identifierHash   = String_Hash(m_identifierStart, m_identifierLength);
+    }
+
+    // Tokens are mostly walked forward, so the file name is found from the last one.
+    const Array<HLSLTokenBuffer::FileName>& fileNames = m_tokens->fileNames;
+    if (fileNames[m_fileNameIndex].firstToken > index)
+    {
+        m_fileNameIndex = 0;
+    }
+    while (m_fileNameIndex + 1 < fileNames.GetSize() && fileNames[m_fileNameIndex + 1].firstToken <= index)
+    {
+        ++m_fileNameIndex;
+    }
+    int offset = fileNames[m_fileNameIndex].offset;
+    m_fileName = (offset < 0) ? m_bufferFileName : &m_tokens->chars[offset];
+}
+
+int HLSLTokenizer::PeekToken(int offset) const
+{
+    ASSERT(m_tokens != NULL);
+    if (m_error)
+    {
+        return HLSLToken_EndOfStream;
+    }
+    int index = m_tokenIndex + offset;
+    if (index >= m_tokens->GetSize())
+    {
+        index = m_tokens->GetSize() - 1;
+    }
+    // Tokens after an error are never reached.
+    if (m_tokens->errorToken >= 0 && index >= m_tokens->errorToken)
+    {
+        return HLSLToken_EndOfStream;
+    }
+    return m_tokens->kinds[index];
+}
+
 int HLSLTokenizer::GetToken() const
 {
     return m_token;
@@ -581,9 +1703,22 @@ int HLSLTokenizer::GetInt() const
 
 const char* HLSLTokenizer::GetIdentifier() const
 {
+    // Only used for diagnostics and rare keywords, so it is fine to copy and truncate.
+    size_t length = m_identifierLength;
+    if (length > s_maxIdentifier - 1)
+    {
+        length = s_maxIdentifier - 1;
+    }
+    memcpy(m_identifier, m_identifierStart, length);
+    m_identifier[length] = 0;
     return m_identifier;
 }
 
+bool HLSLTokenizer::GetIsIdentifier(const char* name) const
+{
+    return m_token == HLSLToken_Identifier && strncmp(name, m_identifierStart, m_identifierLength) == 0 && name[m_identifierLength] == 0;
+}
+
 int HLSLTokenizer::GetLineNumber() const
 {
     return m_tokenLineNumber;
@@ -594,6 +1729,16 @@ const char* HLSLTokenizer::GetFileName() const
     return m_fileName;
 }
 
+unsigned int HLSLTokenizer::GetOffset() const
+{
+    size_t offset = m_tokenStart - m_bufferStart;
+    if (m_stream != NULL)
+    {
+        offset += m_stream->GetOffset();
+    }
+    return (unsigned int)offset;
+}
+
 void HLSLTokenizer::Error(const char* format, ...)
 {
     // It's not always convenient to stop executing when an error occurs,
@@ -612,6 +1757,15 @@ void HLSLTokenizer::Error(const char* format, ...)
     int result = vsnprintf(buffer, sizeof(buffer) - 1, format, args);
     va_end(args);
 
+    if (m_tokenizing != NULL)
+    {
+        char message[2048];
+        snprintf(message, sizeof(message), "%s(%d) : %s\n", m_fileName, m_lineNumber, buffer);
+        m_tokenizing->errorToken  = m_tokenizing->GetSize();
+        m_tokenizing->errorOffset = AddChars(m_tokenizing, message);
+        return;
+    }
+
     m_logger->LogError(m_logger->m_userData, "%s(%d) : %s\n", m_fileName, m_lineNumber, buffer);
 } 
 
@@ -627,7 +1781,7 @@ void HLSLTokenizer::GetTokenName(char buffer[s_maxIdentifier]) const
     }
     else if (m_token == HLSLToken_Identifier)
     {
-        strcpy(buffer, m_identifier);
+        strcpy(buffer, GetIdentifier());
     }
     else
     {
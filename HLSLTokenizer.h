@@ -1,6 +1,8 @@
 #ifndef HLSL_TOKENIZER_H
 #define HLSL_TOKENIZER_H
 
+#include "Engine.h"
+
 namespace M4
 {
 
@@ -148,20 +150,171 @@ enum HLSLToken
     HLSLToken_EndOfStream,
 };
 
+/** All the tokens of a buffer, stored as parallel arrays so that walking them
+touches as little memory as possible. Filled by HLSLTokenizer::Tokenize. */
+struct HLSLTokenBuffer
+{
+    explicit HLSLTokenBuffer(Allocator* allocator);
+
+    void Clear();
+    int GetSize() const { return kinds.GetSize(); }
+
+    /** Returns true if walking the tokens only reads a buffer of the length within
+    its bounds. Tokens filled by Tokenize always are, this is for the other ones. */
+    bool GetIsValid(size_t length) const;
+
+    /** Range of tokens that come from the same file, as set by #line. */
+    struct FileName
+    {
+        int             firstToken;
+        int             offset;     // Offset in chars, or -1 for the name of the buffer.
+    };
+
+    /** Identifiers are read from the source, so only their length and hash are kept. */
+    struct Identifier
+    {
+        unsigned int    length;
+        unsigned int    hash;
+    };
+
+    Array<unsigned short>   kinds;
+    Array<unsigned int>     offsets;    // Where the token starts in the buffer.
+    Array<int>              lines;
+    Array<unsigned int>     values;     // Bits of the float or the int, or index of the identifier.
+    Array<Identifier>       identifiers;
+    Array<char>             chars;      // Zero terminated file names and error messages.
+    Array<FileName>         fileNames;
+    Allocator*              allocator;
+
+    /** An error found while tokenizing is only reported when the parser reaches the
+    token, so that earlier syntax errors are still reported first. */
+    int                     errorToken;
+    int                     errorOffset;
+};
+
+/** Maps offsets in a source to lines and columns. Filled by the tokenizer as it
+reads the source, so that locations can be looked up without scanning it again. */
+class HLSLLineIndex
+{
+
+public:
+
+    explicit HLSLLineIndex(Allocator* allocator);
+
+    void Clear();
+
+    /** Records the lines that start in [start, end), which is at offset in the source. */
+    void AddLines(const char* start, const char* end, unsigned int offset);
+
+    int GetNumLines() const { return m_lineStarts.GetSize(); }
+
+    /** Returns the 1-based line and column of an offset. Lines are counted in the
+    source, ignoring #line directives, and columns are in bytes. */
+    void GetLocation(unsigned int offset, int& line, int& column) const;
+
+private:
+
+    Array<unsigned int>     m_lineStarts;
+
+};
+
+/** Pulls the source a chunk at a time. Read copies up to size bytes of the source
+into buffer and returns the number of bytes copied, or 0 at the end of the source. */
+struct HLSLSourceReader
+{
+    void* m_userData;
+
+    size_t (*Read)(void* userData, char* buffer, size_t size);
+};
+
+/** Window over a source that is read in chunks. The window only ever holds whole
+lines, so a token or a directive never spans two windows and the tokenizer only has
+to refill between tokens and inside block comments. The window grows to fit the
+longest line. */
+class HLSLSourceStream
+{
+
+public:
+
+    static const size_t s_defaultChunkSize = 64 * 1024;
+
+    HLSLSourceStream(Allocator* allocator, const HLSLSourceReader& reader, size_t chunkSize = s_defaultChunkSize);
+    ~HLSLSourceStream();
+
+    /** Drops the current window and reads the next lines of the source into
+    [start, end). Returns false at the end of the source. */
+    bool Refill(const char*& start, const char*& end);
+
+    /** Offset of the window in the source. */
+    size_t GetOffset() const { return m_offset; }
+
+private:
+
+    // Not copyable.
+    HLSLSourceStream(const HLSLSourceStream&);
+    void operator=(const HLSLSourceStream&);
+
+    Allocator*          m_allocator;
+    HLSLSourceReader    m_reader;
+    size_t              m_chunkSize;
+    char*               m_buffer;
+    size_t              m_capacity;
+    size_t              m_size;             // Bytes read into the buffer.
+    size_t              m_lineEnd;          // End of the window, the rest is a partial line.
+    size_t              m_offset;
+    bool                m_endOfSource;
+};
+
 class HLSLTokenizer
 {
 
 public:
 
-    /// Maximum string length of an identifier.
+    /// Maximum length of the names returned by GetIdentifier and GetTokenName, and
+    /// of the file names in #line directives. Identifiers themselves have no limit.
     static const int s_maxIdentifier = 255 + 1;
 
+    /** Changes whenever the tokens produced for a source change, so that tokens
+    stored by an older version are not used. */
+    static const int s_version = 2;
+
     /** The file name is only used for error reporting. */
     HLSLTokenizer(Logger* logger, const char* fileName, const char* buffer, size_t length);
 
+    /** Starts tokenizing a new buffer. */
+    void Reset(const char* fileName, const char* buffer, size_t length);
+
+    /** Starts tokenizing a source that is read in chunks. The stream must stay
+    alive until the next Reset. */
+    void Reset(const char* fileName, HLSLSourceStream* stream);
+
     /** Advances to the next token in the stream. */
     void Next();
 
+    /** Tokenizes the rest of the buffer into tokens. The tokenizer then walks the
+    token buffer instead of the source, which allows looking ahead and going back.
+    The token buffer must stay alive until the next Reset. Streams are dropped as
+    they are read, so this does nothing when tokenizing a stream.
+    Large buffers can be split into chunks at newlines and tokenized on numThreads
+    threads, in which case the allocator of the token buffer must be thread safe. */
+    void Tokenize(HLSLTokenBuffer* tokens, int numThreads = 1);
+
+    /** Walks tokens from an earlier Tokenize of the same buffer, like the ones
+    loaded by HLSLTokenCache, instead of lexing the buffer. Must be called right
+    after Reset. The token buffer must stay alive until the next Reset. */
+    void SetTokens(const HLSLTokenBuffer* tokens);
+
+    /** Returns true if the tokenizer walks a token buffer. */
+    bool GetIsTokenized() const { return m_tokens != NULL; }
+
+    /** Index of the current token in the token buffer. Only valid when tokenized. */
+    int GetTokenIndex() const { return m_tokenIndex; }
+    void SetTokenIndex(int index);
+
+    /** Returns the token the specified number of tokens after the current one.
+    Only valid when tokenized. */
+    int PeekToken(int offset) const;
+
     /** Get token ID from the string */
     static int GetTokenID(const char* name);
 
@@ -172,15 +325,33 @@ public:
     float GetFloat() const;
     int   GetInt() const;
 
-    /** Returns the identifier for the current token. */
+    /** Returns a copy of the identifier for the current token, truncated to
+    s_maxIdentifier. Meant for diagnostics, use the span to intern it. */
     const char* GetIdentifier() const;
 
+    /** The identifier for the current token points into the buffer and is not zero
+    terminated. The hash is String_Hash of the identifier. */
+    const char* GetIdentifierStart() const { return m_identifierStart; }
+    size_t GetIdentifierLength() const { return m_identifierLength; }
+    unsigned int GetIdentifierHash() const { return m_identifierHash; }
+
+    /** Returns true if the current token is an identifier equal to name. */
+    bool GetIsIdentifier(const char* name) const;
+
     /** Returns the line number where the current token began. */
     int GetLineNumber() const;
 
     /** Returns the file name where the current token began. */
     const char* GetFileName() const;
 
+    /** Returns the offset in the source where the current token began. */
+    unsigned int GetOffset() const;
+
+    /** Fills the index with the lines of the source as it is read. The index is
+    cleared on Reset, and must be set before the Reset when reading a stream. Pass
+    NULL to stop filling it. */
+    void SetLineIndex(HLSLLineIndex* lineIndex);
+
     /** Gets a human readable text description of the current token. */
     void GetTokenName(char buffer[s_maxIdentifier]) const;
 
@@ -193,11 +364,34 @@ public:
 
 private:
 
+    /** Smallest chunk worth tokenizing on another thread. */
+    static const size_t s_minChunkSize = 256 * 1024;
+
+    void Start(const char* fileName, const char* buffer, size_t length, HLSLSourceStream* stream);
+
+    /** Scans the next token from the source. */
+    void Lex();
+    /** Reads the next window of a stream once the current one is consumed. */
+    bool Refill();
+    void PushToken(HLSLTokenBuffer* tokens);
+    void PushTokens(HLSLTokenBuffer* tokens);
+    void TokenizeParallel(HLSLTokenBuffer* tokens, int numThreads);
+    /** Tokenizes [start, end) of the buffer as if it was a buffer on its own, starting
+    on the specified line, and optionally inside a block comment. */
+    void TokenizeChunk(HLSLTokenBuffer* tokens, const char* bufferStart, const char* start, const char* end, int lineNumber, const char* fileName, bool inComment);
+
     bool SkipWhitespace();
     bool SkipComment();
+    void SkipBlockComment();
 	bool SkipPragmaDirective();
+    /** Moves past the next newline, or to the end of the buffer. */
+    void SkipLine();
     bool ScanNumber();
+    /** Scans inf, nan and hex floats with the C library. */
+    bool ScanSpecialNumber();
     bool ScanLineDirective();
+    /** Sets the line number from a #line directive. */
+    void SetLineNumber(int lineNumber);
 
 private:
 
@@ -205,16 +399,33 @@ private:
     const char*         m_fileName;
     const char*         m_buffer;
     const char*         m_bufferEnd;
+    HLSLSourceStream*   m_stream;
+    HLSLLineIndex*      m_lineIndex;
     int                 m_lineNumber;
     bool                m_error;
 
     int                 m_token;
     float               m_fValue;
     int                 m_iValue;
-    char                m_identifier[s_maxIdentifier];
+    const char*         m_identifierStart;
+    size_t              m_identifierLength;
+    unsigned int        m_identifierHash;
+    mutable char        m_identifier[s_maxIdentifier];     // Filled by GetIdentifier.
     char                m_lineDirectiveFileName[s_maxIdentifier];
     int                 m_tokenLineNumber;
 
+    const char*         m_bufferStart;
+    const char*         m_bufferFileName;
+    const char*         m_tokenStart;
+    int                 m_numLineDirectives;
+    int                 m_lineDirectiveToken;   // First token after a #line while tokenizing, or -1.
+    bool                m_inComment;            // The buffer ended inside a block comment.
+
+    const HLSLTokenBuffer* m_tokens;
+    int                 m_tokenIndex;
+    int                 m_fileNameIndex;
+    HLSLTokenBuffer*    m_tokenizing;           // Errors are stored in it while tokenizing.
+
 };
 
 }
@@ -100,36 +100,126 @@ const HLSLBaseType ScalarBaseType[HLSLBaseType_Count] = {
 };
 
 
-HLSLTree::HLSLTree(Allocator* allocator) :
-    m_allocator(allocator), m_stringPool(allocator)
+HLSLTree::HLSLTree(Allocator* allocator, SharedStringPool* sharedStrings) :
+    m_allocator(allocator), m_stringPool(allocator, sharedStrings)
 {
-    m_firstPage         = (NodePage*)m_allocator->New(m_allocator->m_userData, sizeof(NodePage));
-    m_firstPage->next   = NULL;
-
-    m_currentPage       = m_firstPage;
+    m_firstPage         = NULL;
+    m_currentPage       = NULL;
+    m_largePages        = NULL;
     m_currentPageOffset = 0;
+    m_nextPageSize      = s_nodePageSize;
+    m_paddingBytes      = 0;
+    m_prelude           = NULL;
+    memset(m_numNodes, 0, sizeof(m_numNodes));
+    memset(m_nodeBytes, 0, sizeof(m_nodeBytes));
+
+    AllocatePage(0);
 
     m_root              = AddNode<HLSLRoot>(NULL, 1);
 }
 
 HLSLTree::~HLSLTree()
 {
-    NodePage* page = m_firstPage;
+    NodePage* pages[2] = { m_firstPage, m_largePages };
+    for (int i = 0; i < 2; ++i)
+    {
+        NodePage* page = pages[i];
+        while (page != NULL)
+        {
+            NodePage* next = page->next;
+            m_allocator->Delete(m_allocator->m_userData, page);
+            page = next;
+        }
+    }
+}
+
+void HLSLTree::Reset()
+{
+    NodePage* page = m_largePages;
     while (page != NULL)
     {
         NodePage* next = page->next;
-        m_allocator->Delete(m_allocator, page);
+        m_allocator->Delete(m_allocator->m_userData, page);
         page = next;
     }
+    m_largePages = NULL;
+
+    // The regular pages are reused in order by AllocatePage.
+    m_currentPage       = m_firstPage;
+    m_currentPageOffset = 0;
+    m_paddingBytes      = 0;
+    m_prelude           = NULL;
+    memset(m_numNodes, 0, sizeof(m_numNodes));
+    memset(m_nodeBytes, 0, sizeof(m_nodeBytes));
+
+    m_stringPool.Reset();
+
+    m_root              = AddNode<HLSLRoot>(NULL, 1);
+}
+
+size_t HLSLTree::GetPageHeaderSize()
+{
+    return (sizeof(NodePage) + s_nodeAlignment - 1) & ~(s_nodeAlignment - 1);
+}
+
+char* HLSLTree::GetPageBuffer(NodePage* page)
+{
+    return (char*)page + GetPageHeaderSize();
 }
 
-void HLSLTree::AllocatePage()
+void HLSLTree::AllocatePage(size_t minSize)
 {
-    NodePage* newPage    = (NodePage*)m_allocator->New(m_allocator->m_userData, sizeof(NodePage));
-    newPage->next        = NULL;
-    m_currentPage->next  = newPage;
+    if (m_currentPage != NULL)
+    {
+        m_currentPage->used = m_currentPageOffset;
+    }
+
+    // Reuse the pages left over by a reset when they are large enough.
+    NodePage* next = (m_currentPage != NULL) ? m_currentPage->next : m_firstPage;
+    if (next == NULL || next->size < minSize)
+    {
+        size_t size = m_nextPageSize;
+        if (m_nextPageSize < s_maxNodePageSize)
+        {
+            m_nextPageSize *= 2;
+        }
+        if (size < minSize)
+        {
+            size = minSize;
+        }
+
+        AllocationSiteScope scope(AllocationSite_NodePage);
+        NodePage* newPage = (NodePage*)m_allocator->New(m_allocator->m_userData, GetPageHeaderSize() + size);
+        newPage->next     = next;
+        newPage->size     = size;
+        newPage->used     = 0;
+
+        if (m_currentPage != NULL)
+        {
+            m_currentPage->next = newPage;
+        }
+        else
+        {
+            m_firstPage = newPage;
+        }
+        next = newPage;
+    }
+
     m_currentPageOffset  = 0;
-    m_currentPage        = newPage;
+    m_currentPage        = next;
+}
+
+void* HLSLTree::AllocateLargeNode(size_t size)
+{
+    // Oversized nodes get a page of their own, so that the space left in the
+    // current page is still used.
+    AllocationSiteScope scope(AllocationSite_NodePage);
+    NodePage* page = (NodePage*)m_allocator->New(m_allocator->m_userData, GetPageHeaderSize() + size);
+    page->next  = m_largePages;
+    page->size  = size;
+    page->used  = size;
+    m_largePages = page;
+    return GetPageBuffer(page);
 }
 
 const char* HLSLTree::AddString(const char* string)
@@ -156,17 +246,69 @@ HLSLRoot* HLSLTree::GetRoot() const
     return m_root;
 }
 
-void* HLSLTree::AllocateMemory(size_t size)
+void* HLSLTree::AllocateMemory(size_t size, size_t alignment)
 {
-    if (m_currentPageOffset + size > s_nodePageSize)
+    ASSERT(alignment <= s_nodeAlignment);
+
+    if (size > s_largeNodeSize)
     {
-        AllocatePage();
+        return AllocateLargeNode(size);
     }
-    void* buffer = m_currentPage->buffer + m_currentPageOffset;
-    m_currentPageOffset += size;
+
+    size_t offset = (m_currentPageOffset + alignment - 1) & ~(alignment - 1);
+    if (offset + size > m_currentPage->size)
+    {
+        AllocatePage(size);
+        offset = 0;
+    }
+    m_paddingBytes += offset - m_currentPageOffset;
+
+    void* buffer = GetPageBuffer(m_currentPage) + offset;
+    m_currentPageOffset = offset + size;
     return buffer;
 }
 
+void HLSLTree::GetNodePageStats(HLSLNodePageStats& stats) const
+{
+    stats.numPages      = 0;
+    stats.numLargePages = 0;
+    stats.reservedBytes = 0;
+    stats.usedBytes     = 0;
+    stats.paddingBytes  = m_paddingBytes;
+
+    bool beforeCurrent = true;
+    for (const NodePage* page = m_firstPage; page != NULL; page = page->next)
+    {
+        ++stats.numPages;
+        stats.reservedBytes += page->size;
+        if (page == m_currentPage)
+        {
+            stats.usedBytes += m_currentPageOffset;
+            beforeCurrent = false;
+        }
+        else if (beforeCurrent)
+        {
+            stats.usedBytes += page->used;
+        }
+    }
+    for (const NodePage* page = m_largePages; page != NULL; page = page->next)
+    {
+        ++stats.numPages;
+        ++stats.numLargePages;
+        stats.reservedBytes += page->size;
+        stats.usedBytes     += page->used;
+    }
+}
+
+void HLSLTree::GetMemoryStats(HLSLTreeMemoryStats& stats) const
+{
+    GetNodePageStats(stats.pages);
+    memcpy(stats.numNodes, m_numNodes, sizeof(m_numNodes));
+    memcpy(stats.nodeBytes, m_nodeBytes, sizeof(m_nodeBytes));
+    const SharedStringPool* sharedStrings = m_stringPool.GetSharedPool();
+    stats.numStrings = (sharedStrings != NULL) ? sharedStrings->GetSize() : m_stringPool.GetSize();
+}
+
 // @@ This doesn't do any parameter matching. Simply returns the first function with that name.
 HLSLFunction * HLSLTree::FindFunction(const char * name)
 {
@@ -185,7 +327,7 @@ HLSLFunction * HLSLTree::FindFunction(const char * name)
         statement = statement->nextStatement;
     }
 
-    return NULL;
+    return (m_prelude != NULL) ? m_prelude->FindFunction(name) : NULL;
 }
 
 HLSLDeclaration * HLSLTree::FindGlobalDeclaration(const char * name, HLSLBuffer ** buffer_out/*=NULL*/)
@@ -222,6 +364,11 @@ HLSLDeclaration * HLSLTree::FindGlobalDeclaration(const char * name, HLSLBuffer
         statement = statement->nextStatement;
     }
 
+    if (m_prelude != NULL)
+    {
+        return m_prelude->FindGlobalDeclaration(name, buffer_out);
+    }
+
     if (buffer_out) *buffer_out = NULL;
     return NULL;
 }
@@ -243,7 +390,7 @@ HLSLStruct * HLSLTree::FindGlobalStruct(const char * name)
         statement = statement->nextStatement;
     }
 
-    return NULL;
+    return (m_prelude != NULL) ? m_prelude->FindGlobalStruct(name) : NULL;
 }
 
 HLSLBuffer * HLSLTree::FindBuffer(const char * name)
@@ -263,7 +410,7 @@ HLSLBuffer * HLSLTree::FindBuffer(const char * name)
         statement = statement->nextStatement;
     }
 
-    return NULL;
+    return (m_prelude != NULL) ? m_prelude->FindBuffer(name) : NULL;
 }
 
 
@@ -1009,7 +1156,11 @@ public:
 
     virtual void VisitFunction(HLSLFunction * node)
     {
-        node->hidden = false;
+        // The nodes of the prelude are never hidden, and are shared between threads.
+        if (node->hidden)
+        {
+            node->hidden = false;
+        }
         HLSLTreeVisitor::VisitFunction(node);
 
         if (node->forward)
@@ -1046,7 +1197,7 @@ public:
         if (type.baseType == HLSLBaseType_UserDefined)
         {
             HLSLStruct * globalStruct = tree->FindGlobalStruct(type.typeName);
-            if (globalStruct != NULL)
+            if (globalStruct != NULL && globalStruct->hidden)
             {
                 globalStruct->hidden = false;
                 VisitStruct(globalStruct);
@@ -1290,7 +1441,7 @@ bool EmulateAlphaTest(HLSLTree* tree, const char* entryName, float alphaRef/*=0.
                 
                 // Build statement: "if (%s.a < 0.5) discard;"
 
-                HLSLDiscardStatement * discard = tree->AddNode<HLSLDiscardStatement>(statement->fileName, statement->line);
+                HLSLDiscardStatement * discard = tree->AddNode<HLSLDiscardStatement>(statement->fileName, statement->line, statement->offset);
                 
                 HLSLExpression * alpha = NULL;
                 if (returnType == HLSLBaseType_Float4 || returnType == HLSLBaseType_Half4)
@@ -1305,7 +1456,7 @@ bool EmulateAlphaTest(HLSLTree* tree, const char* entryName, float alphaRef/*=0.
                     */
                     
                     if (alpha == NULL) {
-                        HLSLMemberAccess * access = tree->AddNode<HLSLMemberAccess>(statement->fileName, statement->line);
+                        HLSLMemberAccess * access = tree->AddNode<HLSLMemberAccess>(statement->fileName, statement->line, statement->offset);
                         access->expressionType = HLSLType(HLSLBaseType_Float);
                         access->object = returnStatement->expression;     // @@ Is reference OK? Or should we clone expression?
                         access->field = tree->AddString("a");
@@ -1323,19 +1474,19 @@ bool EmulateAlphaTest(HLSLTree* tree, const char* entryName, float alphaRef/*=0.
                     return false;
                 }
                 
-                HLSLLiteralExpression * threshold = tree->AddNode<HLSLLiteralExpression>(statement->fileName, statement->line);
+                HLSLLiteralExpression * threshold = tree->AddNode<HLSLLiteralExpression>(statement->fileName, statement->line, statement->offset);
                 threshold->expressionType = HLSLType(HLSLBaseType_Float);
                 threshold->fValue = alphaRef;
                 threshold->type = HLSLBaseType_Float;
                 
-                HLSLBinaryExpression * condition = tree->AddNode<HLSLBinaryExpression>(statement->fileName, statement->line);
+                HLSLBinaryExpression * condition = tree->AddNode<HLSLBinaryExpression>(statement->fileName, statement->line, statement->offset);
                 condition->expressionType = HLSLType(HLSLBaseType_Bool);
                 condition->binaryOp = HLSLBinaryOp_Less;
                 condition->expression1 = alpha;
                 condition->expression2 = threshold;
 
                 // Insert statement.
-                HLSLIfStatement * st = tree->AddNode<HLSLIfStatement>(statement->fileName, statement->line);
+                HLSLIfStatement * st = tree->AddNode<HLSLIfStatement>(statement->fileName, statement->line, statement->offset);
                 st->condition = condition;
                 st->statement = discard;
                 st->nextStatement = statement;
@@ -1585,7 +1736,7 @@ struct StatementList {
         {
             assert(expr->expressionType.baseType != HLSLBaseType_Void);
             
-            HLSLDeclaration * declaration = m_tree->AddNode<HLSLDeclaration>(expr->fileName, expr->line);
+            HLSLDeclaration * declaration = m_tree->AddNode<HLSLDeclaration>(expr->fileName, expr->line, expr->offset);
             declaration->name = m_tree->AddStringFormat("tmp%d", tmp_index++);
             declaration->type = expr->expressionType;
             declaration->assignment = expr;
@@ -1597,7 +1748,7 @@ struct StatementList {
 
         HLSLExpressionStatement * BuildExpressionStatement(HLSLExpression * expr)
         {
-            HLSLExpressionStatement * statement = m_tree->AddNode<HLSLExpressionStatement>(expr->fileName, expr->line);
+            HLSLExpressionStatement * statement = m_tree->AddNode<HLSLExpressionStatement>(expr->fileName, expr->line, expr->offset);
             statement->expression = expr;
             return statement;
         }
@@ -1608,7 +1759,7 @@ struct StatementList {
                 HLSLDeclaration * declaration = BuildTemporaryDeclaration(expr);
                 statements.append(declaration);
                 
-                HLSLIdentifierExpression * ident = m_tree->AddNode<HLSLIdentifierExpression>(expr->fileName, expr->line);
+                HLSLIdentifierExpression * ident = m_tree->AddNode<HLSLIdentifierExpression>(expr->fileName, expr->line, expr->offset);
                 ident->name = declaration->name;
                 ident->expressionType = declaration->type;
                 return ident;
@@ -1633,7 +1784,7 @@ struct StatementList {
                 
                 HLSLIdentifierExpression * tmp = Flatten(unaryExpr->expression, statements, true);
                 
-                HLSLUnaryExpression * newUnaryExpr = m_tree->AddNode<HLSLUnaryExpression>(unaryExpr->fileName, unaryExpr->line);
+                HLSLUnaryExpression * newUnaryExpr = m_tree->AddNode<HLSLUnaryExpression>(unaryExpr->fileName, unaryExpr->line, unaryExpr->offset);
                 newUnaryExpr->unaryOp = unaryExpr->unaryOp;
                 newUnaryExpr->expression = tmp;
                 newUnaryExpr->expressionType = unaryExpr->expressionType;
@@ -1649,7 +1800,7 @@ struct StatementList {
                     // Flatten right hand side only.
                     HLSLIdentifierExpression * tmp2 = Flatten(binaryExpr->expression2, statements, true);
                     
-                    HLSLBinaryExpression * newBinaryExpr = m_tree->AddNode<HLSLBinaryExpression>(binaryExpr->fileName, binaryExpr->line);
+                    HLSLBinaryExpression * newBinaryExpr = m_tree->AddNode<HLSLBinaryExpression>(binaryExpr->fileName, binaryExpr->line, binaryExpr->offset);
                     newBinaryExpr->binaryOp = binaryExpr->binaryOp;
                     newBinaryExpr->expression1 = binaryExpr->expression1;
                     newBinaryExpr->expression2 = tmp2;
@@ -1661,7 +1812,7 @@ struct StatementList {
                     HLSLIdentifierExpression * tmp1 = Flatten(binaryExpr->expression1, statements, true);
                     HLSLIdentifierExpression * tmp2 = Flatten(binaryExpr->expression2, statements, true);
 
-                    HLSLBinaryExpression * newBinaryExpr = m_tree->AddNode<HLSLBinaryExpression>(binaryExpr->fileName, binaryExpr->line);
+                    HLSLBinaryExpression * newBinaryExpr = m_tree->AddNode<HLSLBinaryExpression>(binaryExpr->fileName, binaryExpr->line, binaryExpr->offset);
                     newBinaryExpr->binaryOp = binaryExpr->binaryOp;
                     newBinaryExpr->expression1 = tmp1;
                     newBinaryExpr->expression2 = tmp2;
@@ -43,6 +43,7 @@ enum HLSLNodeType
 	HLSLNodeType_SamplerState,
 	HLSLNodeType_Attribute,
 	HLSLNodeType_Stage,
+	HLSLNodeType_Count
 };
 
 enum HLSLTypeDimension
@@ -484,6 +485,7 @@ struct HLSLNode
 	HLSLNodeType        nodeType;
 	const char*         fileName;
 	int                 line;
+	unsigned int        offset;             // Offset of the first token in the source, see HLSLLineIndex.
 };
 
 struct HLSLRoot : public HLSLNode
@@ -907,6 +909,25 @@ struct HLSLSamplerState : public HLSLExpression // @@ Does this need to be an ex
 	HLSLStateAssignment*    stateAssignments;
 };
 
+/** Utilization of the pages that store the nodes of a tree. */
+struct HLSLNodePageStats
+{
+	int                 numPages;
+	int                 numLargePages;      // Pages dedicated to a single oversized node.
+	size_t              reservedBytes;
+	size_t              usedBytes;          // Includes the alignment padding.
+	size_t              paddingBytes;
+};
+
+/** Memory used by a tree, broken down by node type. */
+struct HLSLTreeMemoryStats
+{
+	HLSLNodePageStats   pages;
+	int                 numNodes[HLSLNodeType_Count];
+	size_t              nodeBytes[HLSLNodeType_Count];
+	int                 numStrings;         // Of the shared string pool when the tree uses one.
+};
+
 /**
  * Abstract syntax tree for parsed HLSL code.
  */
@@ -915,30 +936,57 @@ class HLSLTree
 
 public:
 
-	explicit HLSLTree(Allocator* allocator);
+	/** When a shared string pool is given, the strings of the tree are interned
+	there, so that they can be compared by pointer across trees. */
+	explicit HLSLTree(Allocator* allocator, SharedStringPool* sharedStrings = NULL);
 	~HLSLTree();
 
+	/** Removes all the nodes and strings from the tree, but keeps the memory
+	for the next parse. Pointers into the tree are invalid after this call. */
+	void Reset();
+
 	/** Adds a string to the string pool used by the tree. */
 	const char* AddString(const char* string);
+	/** Adds a string that isn't zero terminated, hash must be String_Hash(string, length). */
+	const char* AddString(const char* string, size_t length, unsigned int hash) { return m_stringPool.AddString(string, length, hash); }
 	const char* AddStringFormat(const char* string, ...);
 
 	/** Returns true if the string is contained within the tree. */
 	bool GetContainsString(const char* string) const;
 
+	/** Strings in the tree can also be referenced by a 32 bit id. Two strings
+	from the same tree are equal if and only if their ids (or pointers) are. */
+	StringId AddStringId(const char* string) { return m_stringPool.AddStringId(string); }
+	StringId GetStringId(const char* treeString) const { return m_stringPool.GetStringId(treeString); }
+	const char* GetString(StringId id) const { return m_stringPool.GetString(id); }
+
 	/** Returns the root block in the tree */
 	HLSLRoot* GetRoot() const;
 
+	/** Returns the allocator used by the tree. */
+	Allocator* GetAllocator() const { return m_allocator; }
+
 	/** Adds a new node to the tree with the specified type. */
 	template <class T>
-	T* AddNode(const char* fileName, int line)
+	T* AddNode(const char* fileName, int line, unsigned int offset = 0)
 	{
-		HLSLNode* node = new (AllocateMemory(sizeof(T))) T();
+		HLSLNode* node = new (AllocateMemory(sizeof(T), alignof(T))) T();
 		node->nodeType  = T::s_type;
 		node->fileName  = fileName;
 		node->line      = line;
+		node->offset    = offset;
+		m_numNodes[T::s_type]++;
+		m_nodeBytes[T::s_type] += sizeof(T);
 		return static_cast<T*>(node);
 	}
 
+	/** Declarations of the prelude are also found by the Find functions. The prelude
+	is shared with other trees, so it must not be modified. See HLSLPrelude. */
+	void SetPrelude(HLSLTree* prelude) { m_prelude = prelude; }
+	HLSLTree* GetPrelude() const { return m_prelude; }
+
+	SharedStringPool* GetSharedStringPool() const { return m_stringPool.GetSharedPool(); }
+
 	HLSLFunction * FindFunction(const char * name);
 	HLSLDeclaration * FindGlobalDeclaration(const char * name, HLSLBuffer ** buffer_out = NULL);
 	HLSLStruct * FindGlobalStruct(const char * name);
@@ -949,28 +997,51 @@ public:
 
 	bool NeedsFunction(const char * name);
 
+	/** Returns how well the node pages are utilized. */
+	void GetNodePageStats(HLSLNodePageStats& stats) const;
+
+	/** Returns the memory used by the nodes and strings of the tree. */
+	void GetMemoryStats(HLSLTreeMemoryStats& stats) const;
+
 private:
 
-	void* AllocateMemory(size_t size);
-	void  AllocatePage();
+	void* AllocateMemory(size_t size, size_t alignment);
+	void  AllocatePage(size_t minSize);
+	void* AllocateLargeNode(size_t size);
 
 private:
 
+	// Pages start small and double in size up to the maximum, so that small
+	// shaders stay small and big ones don't need thousands of pages.
 	static const size_t s_nodePageSize = 1024 * 4;
+	static const size_t s_maxNodePageSize = 1024 * 64;
+	static const size_t s_largeNodeSize = 1024;
+	static const size_t s_nodeAlignment = 16;
 
 	struct NodePage
 	{
 		NodePage*   next;
-		char        buffer[s_nodePageSize];
+		size_t      size;
+		size_t      used;       // Only valid for the pages before the current one.
 	};
 
+	static size_t GetPageHeaderSize();
+	static char* GetPageBuffer(NodePage* page);
+
 	Allocator*      m_allocator;
 	StringPool      m_stringPool;
 	HLSLRoot*       m_root;
+	HLSLTree*       m_prelude;
 
 	NodePage*       m_firstPage;
 	NodePage*       m_currentPage;
+	NodePage*       m_largePages;
 	size_t          m_currentPageOffset;
+	size_t          m_nextPageSize;
+	size_t          m_paddingBytes;
+
+	int             m_numNodes[HLSLNodeType_Count];
+	size_t          m_nodeBytes[HLSLNodeType_Count];
 
 };
 